@@ -0,0 +1,242 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Admission.hh"
+
+#include <algorithm>
+#include <chrono>
+
+namespace runos {
+
+RateLimiter::RateLimiter(double rate, double burst)
+    : m_interval(rate > 0 ? static_cast<int64_t>(1e9 / rate) : 0)
+    , m_tolerance(static_cast<int64_t>(m_interval * std::max(burst - 1.0, 0.0)))
+{ }
+
+RateLimiter::RateLimiter(const RateLimiter& other)
+    : m_interval(other.m_interval)
+    , m_tolerance(other.m_tolerance)
+    , m_tat(other.m_tat.load(std::memory_order_relaxed))
+{ }
+
+RateLimiter& RateLimiter::operator=(const RateLimiter& other)
+{
+    m_interval = other.m_interval;
+    m_tolerance = other.m_tolerance;
+    m_tat.store(other.m_tat.load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    return *this;
+}
+
+bool RateLimiter::admit(int64_t now)
+{
+    if (unlimited())
+        return true;
+
+    int64_t tat = m_tat.load(std::memory_order_relaxed);
+    for (;;) {
+        int64_t start = std::max(tat, now);
+        if (start - now > m_tolerance)
+            return false;
+        if (m_tat.compare_exchange_weak(tat, start + m_interval,
+                                        std::memory_order_relaxed))
+            return true;
+    }
+}
+
+void RateLimiter::refund()
+{
+    if (not unlimited())
+        m_tat.fetch_sub(m_interval, std::memory_order_relaxed);
+}
+
+AdmissionStats& AdmissionStats::operator+=(const AdmissionStats& other)
+{
+    admitted += other.admitted;
+    admitted_control += other.admitted_control;
+    dropped_port += other.dropped_port;
+    dropped_switch += other.dropped_switch;
+    dropped_global += other.dropped_global;
+    dropped_control += other.dropped_control;
+    return *this;
+}
+
+AdmissionStats SwitchAdmission::stats() const
+{
+    AdmissionStats ret;
+    ret.admitted = m_admitted.load(std::memory_order_relaxed);
+    ret.admitted_control = m_admitted_control.load(std::memory_order_relaxed);
+    ret.dropped_port = m_dropped_port.load(std::memory_order_relaxed);
+    ret.dropped_switch = m_dropped_switch.load(std::memory_order_relaxed);
+    ret.dropped_global = m_dropped_global.load(std::memory_order_relaxed);
+    ret.dropped_control = m_dropped_control.load(std::memory_order_relaxed);
+    return ret;
+}
+
+namespace {
+
+inline uint16_t load16(const uint8_t* p)
+{ return uint16_t(p[0] << 8 | p[1]); }
+
+inline uint32_t load32(const uint8_t* p)
+{ return uint32_t(load16(p)) << 16 | load16(p + 2); }
+
+// Offsets in ofp_packet_in (OpenFlow 1.3)
+const size_t match_offset = 24;
+const size_t oxm_offset = match_offset + 4;
+
+const uint16_t OFPXMC_OPENFLOW_BASIC = 0x8000;
+const uint8_t OFPXMT_OFB_IN_PORT = 0;
+
+const uint16_t ETH_TYPE_VLAN = 0x8100;
+const uint16_t ETH_TYPE_QINQ = 0x88a8;
+const uint16_t ETH_TYPE_LLDP = 0x88cc;
+
+struct PacketInInfo {
+    uint32_t in_port {0};
+    bool control {false};
+};
+
+// Extract only what admission needs without parsing the message.
+// Returns false on malformed message, it will be rejected by parser later.
+bool peek(const uint8_t* data, size_t len, PacketInInfo& info)
+{
+    if (len < oxm_offset)
+        return false;
+
+    size_t match_len = load16(data + match_offset + 2);
+    if (match_len < 4 || match_offset + match_len > len)
+        return false;
+
+    for (size_t off = oxm_offset; off + 4 <= match_offset + match_len; ) {
+        uint16_t oxm_class = load16(data + off);
+        uint8_t field = data[off + 2] >> 1;
+        uint8_t oxm_len = data[off + 3];
+        if (oxm_class == OFPXMC_OPENFLOW_BASIC &&
+            field == OFPXMT_OFB_IN_PORT && oxm_len == 4 &&
+            off + 8 <= len) {
+            info.in_port = load32(data + off + 4);
+            break;
+        }
+        off += 4 + oxm_len;
+    }
+
+    // match is padded to 8 bytes and followed by 2 bytes of padding
+    size_t frame = match_offset + (match_len + 7) / 8 * 8 + 2;
+    if (frame + 14 > len)
+        return true;
+
+    const uint8_t* eth = data + frame;
+    static const uint8_t reserved_dst[] = {0x01, 0x80, 0xc2, 0x00, 0x00};
+    if (std::equal(reserved_dst, reserved_dst + 5, eth) && eth[5] <= 0x0f) {
+        info.control = true;
+        return true;
+    }
+
+    size_t type_off = frame + 12;
+    uint16_t eth_type = load16(data + type_off);
+    while ((eth_type == ETH_TYPE_VLAN || eth_type == ETH_TYPE_QINQ) &&
+           type_off + 6 <= len) {
+        type_off += 4;
+        eth_type = load16(data + type_off);
+    }
+    info.control = (eth_type == ETH_TYPE_LLDP);
+    return true;
+}
+
+RateLimiter make_limiter(const Config& config, const char* name)
+{
+    auto section = config_cd(config, name);
+    double rate = config_get(section, "rate", 0.0);
+    double burst = config_get(section, "burst", std::max(rate / 10, 1.0));
+    return RateLimiter(rate, burst);
+}
+
+} // anonymous namespace
+
+void PacketInAdmission::configure(const Config& config)
+{
+    m_global = make_limiter(config, "global");
+    m_control = make_limiter(config, "control");
+    m_switch_proto = make_limiter(config, "switch");
+    m_port_proto = make_limiter(config, "port");
+    m_enabled = not (m_global.unlimited() && m_control.unlimited() &&
+                     m_switch_proto.unlimited() && m_port_proto.unlimited());
+}
+
+void PacketInAdmission::init(SwitchAdmission& sw) const
+{
+    sw.m_switch = m_switch_proto;
+    sw.m_ports.clear();
+}
+
+bool PacketInAdmission::admit(SwitchAdmission& sw, const uint8_t* data, size_t len)
+{
+    if (not m_enabled) {
+        sw.m_admitted.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    PacketInInfo info;
+    if (not peek(data, len, info)) {
+        sw.m_admitted.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    if (info.control) {
+        if (not m_control.admit(now)) {
+            sw.m_dropped_control.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        sw.m_admitted_control.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Tokens taken by passed buckets are given back if a later one
+    // drops the packet, so drops don't eat into other limits
+    RateLimiter* port = nullptr;
+    if (not m_port_proto.unlimited()) {
+        auto it = sw.m_ports.find(info.in_port);
+        if (it == sw.m_ports.end())
+            it = sw.m_ports.emplace(info.in_port, m_port_proto).first;
+        port = &it->second;
+        if (not port->admit(now)) {
+            sw.m_dropped_port.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    if (not sw.m_switch.admit(now)) {
+        if (port)
+            port->refund();
+        sw.m_dropped_switch.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if (not m_global.admit(now)) {
+        if (port)
+            port->refund();
+        sw.m_switch.refund();
+        sw.m_dropped_global.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    sw.m_admitted.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+} // namespace runos
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+#include "Config.hh"
+
+namespace runos {
+
+/**
+ * Token bucket in the form of generic cell rate algorithm.
+ * The whole state is a single atomic, so it may be shared
+ * between threads without locks.
+ */
+class RateLimiter {
+public:
+    /**
+     * @param rate  Packets per second, 0 for unlimited.
+     * @param burst Packets allowed to arrive at once.
+     */
+    RateLimiter(double rate = 0, double burst = 1);
+
+    RateLimiter(const RateLimiter& other);
+    RateLimiter& operator=(const RateLimiter& other);
+
+    /** Take one token. @param now steady clock in nanoseconds. */
+    bool admit(int64_t now);
+
+    /** Give back the token taken by admit() for a packet dropped later. */
+    void refund();
+
+    bool unlimited() const { return m_interval == 0; }
+
+private:
+    int64_t m_interval; // nanoseconds per token
+    int64_t m_tolerance; // how far ahead of time bucket may go
+    std::atomic<int64_t> m_tat{0}; // theoretical arrival time
+};
+
+/**
+ * Packet-in admission counters.
+ */
+struct AdmissionStats {
+    uint64_t admitted {0};
+    uint64_t admitted_control {0};
+    uint64_t dropped_port {0};
+    uint64_t dropped_switch {0};
+    uint64_t dropped_global {0};
+    uint64_t dropped_control {0};
+
+    AdmissionStats& operator+=(const AdmissionStats& other);
+};
+
+/**
+ * Packet-in admission state of a single switch.
+ * Used only by the I/O thread serving the switch connection.
+ */
+class SwitchAdmission {
+public:
+    AdmissionStats stats() const;
+
+private:
+    friend class PacketInAdmission;
+
+    RateLimiter m_switch;
+    std::unordered_map<uint32_t, RateLimiter> m_ports;
+
+    std::atomic<uint64_t> m_admitted{0};
+    std::atomic<uint64_t> m_admitted_control{0};
+    std::atomic<uint64_t> m_dropped_port{0};
+    std::atomic<uint64_t> m_dropped_switch{0};
+    std::atomic<uint64_t> m_dropped_global{0};
+    std::atomic<uint64_t> m_dropped_control{0};
+};
+
+/**
+ * Admission control of packet-in messages, applied to raw messages
+ * before they are parsed.
+ *
+ * Data packet-ins pass per ingress port, per switch and global token
+ * buckets. Control traffic (LLDP, 802.1D/802.1AB/slow protocols
+ * destined to 01:80:c2:00:00:0x) has its own global bucket, so data
+ * storms never starve topology discovery.
+ *
+ * A packet takes tokens only when every bucket admits it.
+ *
+ * Configured by "admission" section of controller settings:
+ * `"admission": { "port": {"rate": 1000, "burst": 100}, "switch": {...},
+ *  "global": {...}, "control": {...} }`. Missing or zero rate means unlimited,
+ * admission is off when every rate is unlimited.
+ */
+class PacketInAdmission {
+public:
+    void configure(const Config& config);
+
+    /** Prepare per-switch state with the configured limits */
+    void init(SwitchAdmission& sw) const;
+
+    /**
+     * Decide whether packet-in may be processed.
+     * @param data Raw OpenFlow message including header.
+     */
+    bool admit(SwitchAdmission& sw, const uint8_t* data, size_t len);
+
+private:
+    bool m_enabled {false};
+    RateLimiter m_global;
+    RateLimiter m_control;
+    RateLimiter m_switch_proto;
+    RateLimiter m_port_proto;
+};
+
+} // namespace runos
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "BufferPool.hh"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+namespace runos {
+
+namespace {
+
+constexpr size_t size_class(size_t size)
+{
+    size_t cls = 0;
+    while ((BufferPool::min_block << cls) < size)
+        ++cls;
+    return cls;
+}
+
+constexpr size_t nclasses = size_class(BufferPool::max_block) + 1;
+
+struct FreeList {
+    std::array<uint8_t*, BufferPool::max_cached> blocks;
+    size_t count {0};
+};
+
+// Trivially destructible, so the pool stays usable by destructors
+// of other thread-locals holding buffers, e.g. SwitchConnection's,
+// whichever order they run in at thread exit
+struct ThreadPool {
+    std::array<FreeList, nclasses> classes;
+    // Cached blocks were freed, the thread exits
+    bool closed {false};
+};
+static_assert(std::is_trivially_destructible<ThreadPool>::value,
+              "pool is used after thread-locals are destroyed");
+
+thread_local ThreadPool pool;
+
+// Frees cached blocks at thread exit, blocks released
+// after that are freed at once
+struct PoolCleanup {
+    ~PoolCleanup()
+    {
+        for (auto& list : pool.classes) {
+            for (size_t i = 0; i < list.count; ++i)
+                delete[] list.blocks[i];
+            list.count = 0;
+        }
+        pool.closed = true;
+    }
+};
+
+thread_local PoolCleanup cleanup;
+
+} // anonymous namespace
+
+uint8_t* BufferPool::acquire(size_t size, size_t& capacity)
+{
+    if (size > max_block) {
+        capacity = size;
+        return new uint8_t[size];
+    }
+
+    size_t cls = size_class(size);
+    capacity = min_block << cls;
+
+    FreeList& list = pool.classes[cls];
+    if (list.count > 0)
+        return list.blocks[--list.count];
+    return new uint8_t[capacity];
+}
+
+void BufferPool::release(uint8_t* block, size_t capacity)
+{
+    if (block == nullptr)
+        return;
+
+    if (capacity <= max_block && not pool.closed) {
+        // Cleanup is registered by the first access in the thread
+        static_cast<void>(&cleanup);
+        FreeList& list = pool.classes[size_class(capacity)];
+        if (list.count < max_cached) {
+            list.blocks[list.count++] = block;
+            return;
+        }
+    }
+    delete[] block;
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : m_data(other.m_data)
+    , m_size(other.m_size)
+    , m_capacity(other.m_capacity)
+{
+    other.m_data = nullptr;
+    other.m_size = other.m_capacity = 0;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept
+{
+    if (this != &other) {
+        reset();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_capacity, other.m_capacity);
+    }
+    return *this;
+}
+
+void PooledBuffer::append(const void* data, size_t len)
+{
+    std::memcpy(extend(len), data, len);
+}
+
+uint8_t* PooledBuffer::extend(size_t len)
+{
+    if (m_size + len > m_capacity) {
+        size_t capacity;
+        uint8_t* block = BufferPool::acquire(
+                std::max(m_size + len, 2 * m_capacity), capacity);
+        if (m_size > 0)
+            std::memcpy(block, m_data, m_size);
+        BufferPool::release(m_data, m_capacity);
+        m_data = block;
+        m_capacity = capacity;
+    }
+    uint8_t* ret = m_data + m_size;
+    m_size += len;
+    return ret;
+}
+
+void PooledBuffer::reset()
+{
+    BufferPool::release(m_data, m_capacity);
+    m_data = nullptr;
+    m_size = m_capacity = 0;
+}
+
+} // namespace runos
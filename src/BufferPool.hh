@@ -0,0 +1,80 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+
+/**
+ * Thread-local pool of byte buffers with power-of-two size classes.
+ * Keeps storage of serialized OpenFlow messages between writes,
+ * so the send path doesn't hit the allocator in the steady state.
+ */
+class BufferPool {
+public:
+    static constexpr size_t min_block = 256;
+    /** Larger buffers are never cached */
+    static constexpr size_t max_block = 1 << 20;
+    /** Cached blocks per size class and thread */
+    static constexpr size_t max_cached = 16;
+
+    /**
+     * Returns block of at least `size` bytes.
+     * @param capacity Receives real size of the block.
+     */
+    static uint8_t* acquire(size_t size, size_t& capacity);
+
+    /** Returns block to the current thread's pool. */
+    static void release(uint8_t* block, size_t capacity);
+};
+
+/**
+ * Growable byte buffer backed by BufferPool.
+ */
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    ~PooledBuffer() { reset(); }
+
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    void append(const void* data, size_t len);
+    /** Grows by `len` bytes and returns them to be written */
+    uint8_t* extend(size_t len);
+
+    /** Forget contents but keep the storage */
+    void clear() { m_size = 0; }
+    /** Give the storage back to the pool */
+    void reset();
+
+    uint8_t* data() { return m_data; }
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+
+private:
+    uint8_t* m_data {nullptr};
+    size_t m_size {0};
+    size_t m_capacity {0};
+};
+
+} // namespace runos
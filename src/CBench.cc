@@ -37,5 +37,5 @@ void CBench::init(Loader* loader, const Config&)
                                .to_octets()[5] % 3;
             return decision.unicast(out_port)
                            .return_();
-    });
+    }, { ofb_eth_dst });
 }
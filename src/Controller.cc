@@ -17,69 +17,351 @@
 #include "Controller.hh"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <limits>
 #include <unordered_map>
 #include <vector>
 #include <mutex>
 #include <thread>
 #include <sstream>
+#include <string>
 #include <memory>
 #include <functional>
+#include <cstring>
+
+#include <arpa/inet.h>
 
 #include <boost/assert.hpp>
 #include <boost/variant/apply_visitor.hpp>
 #include <boost/variant/static_visitor.hpp>
 #include <boost/variant/get.hpp>
-#include <fluid/OFServer.hh>
 
 #include "types/exception.hh"
 
+#include "OFBundle.hh"
+#include "OFEncode.hh"
 #include "OFMsgUnion.hh"
+#include "OFTransport.hh"
 #include "SwitchConnection.hh"
 
 
 using namespace std::placeholders;
 using namespace runos;
-using namespace fluid_base;
 
 REGISTER_APPLICATION(Controller, {""})
 
+// Barriers sent by Controller::barrier to a single switch,
+// or other requests the switch answers in order, e.g. bundle commits
+// or a meter-mod confirmed by the barrier after it
+class BarrierTracker {
+public:
+    enum class Reply { Confirmed, Error, Lost };
+    typedef std::function<void(Reply)> ReplyHandler;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Pending {
+        uint32_t xid;
+        clock::time_point sent;
+        ReplyHandler done;
+    };
+
+    mutable std::mutex mutex;
+    std::deque<Pending> pending;
+    BarrierLatency latency;
+
+    void record(clock::duration rtt)
+    {
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+        uint64_t us = duration_cast<microseconds>(rtt).count();
+        size_t bucket = 0;
+        while (bucket + 1 < BarrierLatency::nbuckets && (us >> (bucket + 1)))
+            ++bucket;
+        latency.buckets[bucket]++;
+        latency.confirmed++;
+        latency.total_us += us;
+    }
+
+public:
+    // Call before sending the barrier, reply may come at once
+    void add(uint32_t xid, BarrierHandler done)
+    {
+        track(xid, [done](Reply reply) { done(reply == Reply::Confirmed); });
+    }
+
+    // Same as add, but tells an error reply from a lost one
+    void track(uint32_t xid, ReplyHandler done)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back({xid, clock::now(), std::move(done)});
+    }
+
+    // Barriers are answered in order, so earlier ones are done too
+    void complete(uint32_t xid)
+    {
+        std::vector<Pending> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = std::find_if(pending.begin(), pending.end(),
+                    [xid](const Pending& p) { return p.xid == xid; });
+            if (it == pending.end())
+                return;
+            ++it;
+            auto now = clock::now();
+            for (auto p = pending.begin(); p != it; ++p) {
+                record(now - p->sent);
+            }
+            std::move(pending.begin(), it, std::back_inserter(done));
+            pending.erase(pending.begin(), it);
+        }
+        for (auto& p : done) {
+            p.done(Reply::Confirmed);
+        }
+    }
+
+    // Switch responded with error, other requests are still pending
+    void fail(uint32_t xid)
+    {
+        Pending failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = std::find_if(pending.begin(), pending.end(),
+                    [xid](const Pending& p) { return p.xid == xid; });
+            if (it == pending.end())
+                return;
+            failed = std::move(*it);
+            pending.erase(it);
+            latency.failed++;
+        }
+        failed.done(Reply::Error);
+    }
+
+    // Fail barriers sent before `deadline`, all by default
+    void expire(clock::time_point deadline = clock::time_point::max())
+    {
+        std::vector<Pending> failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = std::find_if(pending.begin(), pending.end(),
+                    [deadline](const Pending& p) { return p.sent >= deadline; });
+            std::move(pending.begin(), it, std::back_inserter(failed));
+            pending.erase(pending.begin(), it);
+            latency.failed += failed.size();
+        }
+        for (auto& p : failed) {
+            p.done(Reply::Lost);
+        }
+    }
+
+    BarrierLatency stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return latency;
+    }
+};
+
 class SwitchConnectionImpl : public SwitchConnection {
 public:
-    SwitchConnectionImpl(OFConnection* ofconn_, uint64_t dpid)
+    BarrierTracker barriers;
+    // Bundle opens and commits
+    BarrierTracker bundle_requests;
+
+    SwitchConnectionImpl(OFTransportConnection* ofconn_, uint64_t dpid)
         : SwitchConnection(ofconn_, dpid)
     { }
 
-    void replace(OFConnection* ofconn_)
+    void replace(OFTransportConnection* ofconn_)
     { m_ofconn = ofconn_; }
+
+    void buffered(bool buffered)
+    { m_buffered.store(buffered, std::memory_order_relaxed); }
+
+    void bundles(bool supported)
+    { m_bundles.store(supported, std::memory_order_relaxed); }
+    using SwitchConnection::bundles;
+
+    void meters(bool supported)
+    { m_meters.store(supported, std::memory_order_relaxed); }
+    using SwitchConnection::meters;
+
+    using SwitchConnection::received;
+    using SwitchConnection::parseError;
 };
 
 typedef std::shared_ptr<SwitchConnectionImpl> SwitchConnectionImplPtr;
 typedef std::weak_ptr<SwitchConnectionImpl> SwitchConnectionImplWeakPtr;
 
+// Meter limiting rate of table-miss packet-in's on the switch
+struct PacketInMeter {
+    uint32_t id {0}; // 0 if disabled
+    uint32_t rate {0}; // packets per second
+    uint32_t burst {0};
+};
+
+// Bytes of packet sent to the controller on table-miss
+class MissSendLen {
+    uint16_t m_default {128};
+    // Configured per-table values, take precedence over required ones
+    std::unordered_map<uint8_t, uint16_t> m_overrides;
+    // Declared by packet-in consumers, 0 if unknown
+    std::array<std::atomic<uint16_t>, 256> m_required;
+
+public:
+    MissSendLen()
+    {
+        for (auto& len : m_required)
+            len.store(0, std::memory_order_relaxed);
+    }
+
+    void configure(const Config& config)
+    {
+        m_default = config_get(config, "default", int(m_default));
+        for (const auto& table : config_cd(config, "tables")) {
+            m_overrides[std::stoi(table.first)] =
+                table.second.int_value();
+        }
+    }
+
+    void require(uint8_t table, uint16_t len)
+    { m_required[table].store(len, std::memory_order_relaxed); }
+
+    uint16_t get(uint8_t table) const
+    {
+        auto it = m_overrides.find(table);
+        if (it != m_overrides.end())
+            return it->second;
+        uint16_t len = m_required[table].load(std::memory_order_relaxed);
+        return len ? len : m_default;
+    }
+
+    // Switch-wide value for packet-in's not caused by flow entries
+    uint16_t max() const
+    {
+        uint16_t ret = 0;
+        for (unsigned table = 0; table < m_required.size(); ++table) {
+            if (m_required[table].load(std::memory_order_relaxed) ||
+                m_overrides.count(table))
+                ret = std::max(ret, get(table));
+        }
+        return ret ? ret : m_default;
+    }
+};
+
+// Reasons of asynchronous messages applications subscribed to
+struct AsyncSubscriptions {
+    uint32_t packet_in {0};
+    uint32_t port_status {0};
+    uint32_t flow_removed {0};
+};
+
 struct SwitchBase {
     SwitchConnectionImplPtr connection;
     uint8_t max_table;
+    PacketInMeter meter;
+    const MissSendLen& miss_send_len;
+    const AsyncSubscriptions& async;
+    SwitchAdmission admission;
+    // Packet-in's counted by the last telemetry sample
+    uint64_t sampled_packet_ins {0};
+    double packet_in_rate {0};
+    // Flow tables were cleared by the last reinit()
+    bool wiped {true};
+    // Arguments of reinit() postponed until the switch's setup turn
+    uint32_t n_buffers;
+    bool wipe {true};
 
 public:
-    SwitchBase(OFConnection* ofconn,
+    SwitchBase(OFTransportConnection* ofconn,
             uint64_t dpid,
-            uint8_t max_table)
+            uint32_t n_buffers,
+            uint8_t max_table,
+            PacketInMeter meter,
+            const MissSendLen& miss_send_len,
+            const AsyncSubscriptions& async)
         : connection{ new SwitchConnectionImpl{ofconn, dpid} },
-        max_table(max_table)
+        max_table(max_table),
+        meter(meter),
+        miss_send_len(miss_send_len),
+        async(async),
+        n_buffers(n_buffers)
     {
-        clearTables();
-        for (uint8_t i = 0; i < max_table; ++i){
-            installGoto(i);
-        }
-        installTableMiss(max_table);
+        connection->buffered(n_buffers > 0);
     }
 
-    void reinit() {
-        clearTables();
+    // Flow entries are kept unless `wipe` is set, controller's own ones
+    // are installed again.
+    void reinit(uint32_t n_buffers, bool wipe = true) {
+        connection->buffered(n_buffers > 0);
+        // Table-miss is metered after the switch reports meter support
+        connection->meters(false);
+        wiped = wipe;
+        if (wipe) {
+            clearTables();
+        }
+        setConfig();
+        setAsync();
+        // Rules below may only be added after the cleanup
+        if (wipe) {
+            barrier();
+        }
+        // Kept rules of the previous run are overwritten by ADD
+        // without the overlap check, which would refuse them
+        uint16_t flags = wipe ? uint16_t(of13::OFPFF_CHECK_OVERLAP) : 0;
         for (uint8_t i = 0; i < max_table; i++) {
-            installGoto(i);
+            installGoto(i, flags);
         }
-        installTableMiss(max_table);
+        installTableMiss(max_table, of13::OFPFC_ADD, flags);
+    }
+
+    // Apply changed miss_send_len to the connected switch
+    void updateMissSendLen()
+    {
+        setConfig();
+        // ADD with the overlap check is refused for the existing rule
+        installTableMiss(max_table, of13::OFPFC_MODIFY_STRICT);
+    }
+
+    // Switch supports meters. The last meter-mod is sent with `xid`,
+    // its error tells the meter wasn't added.
+    void installMeter(uint32_t xid, bool burst)
+    {
+        if (not meter.id)
+            return;
+
+        uint16_t flags = of13::OFPMF_PKTPS;
+        if (burst) {
+            flags |= of13::OFPMF_BURST;
+        }
+        if (wiped) {
+            // Meters survive flow table cleanup, replace one left
+            // from the previous run with the current settings
+            of13::MeterMod del(0, of13::OFPMC_DELETE, 0, meter.id);
+            connection->send(del);
+        }
+
+        of13::MeterMod mm(wiped ? xid : 0, of13::OFPMC_ADD, flags, meter.id);
+        mm.add_band(new of13::MeterBandDrop(meter.rate, meter.burst));
+        connection->send(mm);
+
+        if (not wiped) {
+            // Deleting the meter would remove flows using it,
+            // update it in place. Error of the add above is ignored.
+            of13::MeterMod mod(xid, of13::OFPMC_MODIFY, flags, meter.id);
+            mod.add_band(new of13::MeterBandDrop(meter.rate, meter.burst));
+            connection->send(mod);
+        }
+    }
+
+    // Meter is confirmed, limit table-miss packet-in's
+    void enableMeter()
+    {
+        connection->meters(true);
+        installTableMiss(max_table, of13::OFPFC_MODIFY_STRICT);
     }
 
 private:
@@ -103,9 +385,8 @@ private:
         connection->send(fm);
     }
 
-    void installGoto(uint8_t table)
+    void installGoto(uint8_t table, uint16_t flags)
     {
-        barrier();
         of13::FlowMod fm;
         fm.command(of13::OFPFC_ADD);
         fm.buffer_id(OFP_NO_BUFFER);
@@ -114,49 +395,109 @@ private:
         fm.idle_timeout(0);
         fm.hard_timeout(0);
         fm.table_id(table);
-        fm.flags(of13::OFPFF_CHECK_OVERLAP | of13::OFPFF_SEND_FLOW_REM);
+        fm.flags(flags);
         of13::GoToTable go_to_table(table + 1);
         fm.add_instruction(go_to_table);
 
         connection->send(fm);
     }
 
-    void installTableMiss(uint8_t table)
+    void installTableMiss(uint8_t table, uint8_t command,
+                          uint16_t flags = of13::OFPFF_CHECK_OVERLAP)
     {
-        barrier();
         of13::FlowMod fm;
-        fm.command(of13::OFPFC_ADD);
+        fm.command(command);
         fm.buffer_id(OFP_NO_BUFFER);
         fm.priority(0);
         fm.cookie(0);
         fm.idle_timeout(0);
         fm.hard_timeout(0);
         fm.table_id(table);
-        fm.flags(of13::OFPFF_CHECK_OVERLAP | of13::OFPFF_SEND_FLOW_REM);
+        fm.flags(flags);
+        if (meter.id && connection->meters()) {
+            fm.add_instruction(of13::Meter(meter.id));
+        }
         of13::ApplyActions act;
-        of13::OutputAction out(of13::OFPP_CONTROLLER, 128); // TODO : unhardcore
+        of13::OutputAction out(of13::OFPP_CONTROLLER,
+                               sendLen(miss_send_len.get(table)));
         act.add_action(out);
         fm.add_instruction(act);
 
         connection->send(fm);
     }
 
+    // Packets not buffered by the switch are forwarded with packet-out
+    // carrying the data we received, so they can't be truncated.
+    uint16_t sendLen(uint16_t len) const
+    {
+        return connection->buffered() ? len : uint16_t(of13::OFPCML_NO_BUFFER);
+    }
+
+    void setConfig()
+    {
+        of13::SetConfig sc(0, of13::OFPC_FRAG_NORMAL,
+                           sendLen(miss_send_len.max()));
+        connection->send(sc);
+    }
+
+    void setAsync()
+    {
+        // Slaves get port status only, as by default
+        uint32_t packet_in[2] = { async.packet_in, 0 };
+        uint32_t port_status[2] = { async.port_status, async.port_status };
+        uint32_t flow_removed[2] = { async.flow_removed, 0 };
+        of13::SetAsync sa(0, packet_in, port_status, flow_removed);
+        connection->send(sa);
+    }
+
 };
 
 
-class ControllerImpl : public OFServer {
-    const uint32_t min_xid = 0xfff;
+class ControllerImpl : public OFTransportHandler {
     Controller &app;
 
 public:
+    const uint32_t min_xid = 0xfff;
     bool started{false};
     bool cbench;
     Config config;
     Config root_config;
     uint8_t max_table;
 
-    std::unordered_map<uint8_t, CommonHandlers*> handlers;
+    // Indexed by message type, so dispatch is a single load
+    struct Dispatch {
+        std::unique_ptr<CommonHandlers> handlers;
+        std::atomic<uint64_t> received{0};
+        // counters of different types shouldn't share cache line
+        char padding[64 - sizeof(handlers) - sizeof(received)];
+    };
+    std::array<Dispatch, 256> dispatch;
     std::unordered_map<uint64_t, SwitchBase> switches;
+    mutable std::mutex switches_mutex;
+    PacketInAdmission admission;
+    PacketInMeter packet_in_meter;
+    MissSendLen miss_send_len;
+    AsyncSubscriptions async;
+
+    // Keep flow entries of reconnected switches
+    bool reconcile{false};
+    // Table setup waits for Controller::setupSwitch()
+    bool paced_setup{false};
+    // Probe switches for bundle support
+    bool use_bundles{true};
+    // Unanswered barriers are failed after it
+    std::chrono::steady_clock::duration barrier_timeout{std::chrono::seconds(10)};
+    // Packet-in rates are measured, and logged if enabled, this often
+    std::chrono::steady_clock::duration telemetry_interval{std::chrono::seconds(10)};
+    std::chrono::steady_clock::time_point last_telemetry;
+    bool log_telemetry{false};
+    struct CookieSpace {
+        uint64_t base;
+        uint64_t mask;
+        FlowReconciler reconcile;
+    };
+    std::vector<CookieSpace> cookie_spaces;
+    std::vector<SwitchSetupHandler> setup_handlers;
 
     // OFResponse
     std::vector<OFTransaction*> static_ofresponse;
@@ -164,18 +505,29 @@ public:
     uint32_t min_session_xid{min_xid};
     //uint32_t last_xid;
 
-    ControllerImpl(Controller &_app,
-            const char *address,
-            const int port,
-            const int nthreads = 4,
-            const bool secure = false,
-            const class OFServerSettings ofsc = OFServerSettings())
-            : OFServer(address, port, nthreads, secure, ofsc),
-              app(_app)
+    // Sessions are found by the low bits of xid.
+    // Slot is owned by whoever swapped its pointer to `busy`,
+    // only the owner may dereference or delete the session.
+    static constexpr size_t session_slots = 1 << 12;
+    struct SessionSlot {
+        std::atomic<OFSession*> session{nullptr};
+        // Hints to skip foreign slots without taking them
+        std::atomic<uint32_t> xid{0};
+        std::atomic<OFSession::clock::rep> deadline{0};
+    };
+    std::unique_ptr<SessionSlot[]> sessions{new SessionSlot[session_slots]};
+    std::atomic<uint32_t> session_counter{0};
+
+    // Declared last to stop I/O threads before the rest is destroyed
+    std::unique_ptr<OFTransport> transport;
+
+    explicit ControllerImpl(Controller &_app)
+            : app(_app)
               // last_xid(min_xid)
     { }
 
-    void message_callback(OFConnection *ofconn, uint8_t type, void *data, size_t len) override
+    void message_callback(OFTransportConnection *ofconn, uint8_t type,
+                          void *data, size_t len) override
     {
         if (cbench && type == of13::OFPT_PACKET_IN) {
             OFMsg pi(static_cast<uint8_t*>(data));
@@ -185,123 +537,407 @@ public:
             buffer = po.pack();
             ofconn->send(buffer, po.length());
             OFMsg::free_buffer(buffer);
-            free_data(data);
             return;
         }
 
 
-        SwitchBase *ctx = reinterpret_cast<SwitchBase *>(ofconn->get_application_data());
+        SwitchBase *ctx = reinterpret_cast<SwitchBase *>(ofconn->application_data());
 
-        auto it = handlers.find(type);
-        if( it != handlers.end()){
-            it->second->apply(data, ctx->connection);
+        if (ctx == nullptr && type != of13::OFPT_FEATURES_REPLY) {
+            LOG(WARNING) << "Switch send message before feature reply";
+            return;
+        }
+        if (ctx) {
+            ctx->connection->received(type, len);
         }
 
+        // Drop excess packet-in's before spending time on parsing
+        if (type == of13::OFPT_PACKET_IN &&
+            not admission.admit(ctx->admission,
+                                static_cast<uint8_t*>(data), len)) {
+            return;
+        }
 
-        if (ctx == nullptr && type != of13::OFPT_FEATURES_REPLY) {
-            LOG(WARNING) << "Switch send message before feature reply";
-            OFMsg::free_buffer(static_cast<uint8_t *>(data));
+        // Bundle replies are experimenter messages we don't parse
+        if (type == of13::OFPT_EXPERIMENTER &&
+            handleBundleReply(ctx, static_cast<uint8_t*>(data), len)) {
             return;
         }
 
+        // Messages sent by handlers during this callback
+        // are written to the switches at once
+        SendBatch batch;
+
         try {
-            OFMsgUnion msg(type, data, len);
+            // Decode message only once. Handlers, signals and transactions
+            // share this object instead of unpacking the same bytes again.
+            auto msg = std::make_shared<OFMsgUnion>(type, data, len);
+
+            if (type == of13::OFPT_FEATURES_REPLY) {
+                ctx = createSwitchBase(ofconn,
+                                       msg->featuresReply.datapath_id(),
+                                       msg->featuresReply.n_buffers());
+                ofconn->application_data(ctx);
+                ctx->connection->received(type, len);
+                probeBundles(ctx->connection);
+                if (not paced_setup) {
+                    setupSwitch(ctx);
+                }
+            }
+
+            Dispatch& entry = dispatch[type];
+            entry.received.fetch_add(1, std::memory_order_relaxed);
+            if (entry.handlers) {
+                entry.handlers->apply(msg, ctx->connection);
+            }
 
             switch (type) {
             case of13::OFPT_FEATURES_REPLY:
-                ctx = createSwitchBase(ofconn, msg.featuresReply.datapath_id());
-                ofconn->set_application_data(ctx);
-                emit app.switchUp(ctx->connection, msg.featuresReply);
+                emit app.switchUp(ctx->connection, msg->featuresReply);
                 break;
             case of13::OFPT_PORT_STATUS:
-                if (ctx == nullptr) break;
-                emit app.portStatus(ctx->connection, msg.portStatus);
+                emit app.portStatus(ctx->connection, msg->portStatus);
                 break;
             case of13::OFPT_FLOW_REMOVED:
-                emit app.flowRemoved(ctx->connection, msg.flowRemoved);
+                emit app.flowRemoved(ctx->connection, msg->flowRemoved);
                 break;
             default: {
-               uint32_t xid = msg.base()->xid();
+                uint32_t xid = msg->base()->xid();
                 if (xid < min_xid)
                     break;
 
+                if (type == of13::OFPT_BARRIER_REPLY) {
+                    ctx->connection->barriers.complete(xid);
+                } else if (type == of13::OFPT_ERROR) {
+                    ctx->connection->barriers.fail(xid);
+                    ctx->connection->bundle_requests.fail(xid);
+                }
+
                 OFTransaction *transaction = nullptr;
                 if (xid < min_session_xid) {
                     transaction = static_ofresponse[xid - min_xid];
                 } else {
-                    // TODO: session ofresponse's
+                    handleSession(xid, type, ctx, msg);
                 }
 
                 if (transaction) {
-                    auto msg_copy = std::make_shared<OFMsgUnion>(type, data, len);
-
                     if (type == of13::OFPT_ERROR) {
-                        emit transaction->error(ctx->connection, msg_copy);
+                        emit transaction->error(ctx->connection, msg);
                     } else {
-                        emit transaction->response(ctx->connection, msg_copy);
+                        emit transaction->response(ctx->connection, msg);
                     }
                 }
             }
             }
         } catch (const OFMsgParseError &e) {
-            LOG(WARNING) << "Malformed message received from connection " << ofconn->get_id();
+            LOG(WARNING) << "Malformed message received from connection " << ofconn->id();
+            if (ctx) {
+                ctx->connection->parseError();
+            }
         } catch (const OFMsgUnhandledType &e) {
             LOG(WARNING) << "Unhandled message type " << e.msg_type()
-                    << " received from connection " << ofconn->get_id();
+                    << " received from connection " << ofconn->id();
         } catch (const std::exception &e) {
             LOG(ERROR) << "Unhandled exception: " << e.what();
         } catch (...) {
             LOG(ERROR) << "Unhandled exception";
         }
-
-        free_data(data);
     }
 
-    void connection_callback(OFConnection *ofconn, OFConnection::Event type) override
+    void connection_callback(OFTransportConnection *ofconn,
+                             OFTransportConnection::Event type) override
     {
-        auto ctx = reinterpret_cast<SwitchBase*>(ofconn->get_application_data());
+        auto ctx = reinterpret_cast<SwitchBase*>(ofconn->application_data());
 
-        if (type == OFConnection::EVENT_STARTED) {
-            LOG(INFO) << "Connection id=" << ofconn->get_id() << " started";
-            ofconn->set_application_data(nullptr);
+        if (type == OFTransportConnection::EVENT_STARTED) {
+            LOG(INFO) << "Connection id=" << ofconn->id() << " started";
+            ofconn->application_data(nullptr);
         }
 
-        else if (type == OFConnection::EVENT_ESTABLISHED) {
-            LOG(INFO) << "Connection id=" << ofconn->get_id() << " established";
+        else if (type == OFTransportConnection::EVENT_ESTABLISHED) {
+            LOG(INFO) << "Connection id=" << ofconn->id() << " established";
         }
 
-        else if (type == OFConnection::EVENT_FAILED_NEGOTIATION) {
-            LOG(INFO) << "Connection id=" << ofconn->get_id() << ": failed version negotiation";
+        else if (type == OFTransportConnection::EVENT_FAILED_NEGOTIATION) {
+            LOG(INFO) << "Connection id=" << ofconn->id() << ": failed version negotiation";
         }
 
-        else if (type == OFConnection::EVENT_CLOSED) {
-            LOG(INFO) << "Connection id=" << ofconn->get_id() << " closed by the user";
+        else if (type == OFTransportConnection::EVENT_CLOSED) {
+            LOG(INFO) << "Connection id=" << ofconn->id() << " closed by the user";
             if (ctx) {
-                ofconn->set_application_data(nullptr);
+                ofconn->application_data(nullptr);
                 emit app.switchDown(ctx->connection);
                 ctx->connection->replace(nullptr);
+                ctx->connection->barriers.expire();
+                ctx->connection->bundle_requests.expire();
            }
         }
 
-        else if (type == OFConnection::EVENT_DEAD) {
-            LOG(INFO) << "Connection id=" << ofconn->get_id() << " closed due to inactivity";
+        else if (type == OFTransportConnection::EVENT_DEAD) {
+            LOG(INFO) << "Connection id=" << ofconn->id() << " closed due to inactivity";
             if (ctx) {
-                ofconn->set_application_data(nullptr);
+                ofconn->application_data(nullptr);
                 emit app.switchDown(ctx->connection);
                 ctx->connection->replace(nullptr);
+                ctx->connection->barriers.expire();
+                ctx->connection->bundle_requests.expire();
            }
         }
     }
+    /**
+     * Reserve slot and xid for a new session.
+     * Returns nullptr if all slots are in use.
+     */
+    SessionSlot* reserveSession(uint32_t& xid)
+    {
+        for (size_t attempt = 0; attempt < session_slots; ++attempt) {
+            xid = nextXid();
+            SessionSlot& slot = sessions[xid & (session_slots - 1)];
+
+            OFSession* expected = nullptr;
+            if (slot.session.compare_exchange_strong(expected, busy()))
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    // Switch supports bundles if it opens one,
+    // the probe is discarded then
+    void probeBundles(SwitchConnectionImplPtr conn)
+    {
+        static constexpr uint32_t probe_id = 0xffffffff;
+        conn->bundles(false);
+        if (not use_bundles)
+            return;
+
+        uint32_t xid = nextXid();
+        SwitchConnectionImplWeakPtr weak = conn;
+        conn->bundle_requests.add(xid, [weak](bool supported) {
+            auto conn = weak.lock();
+            if (not conn || not conn->alive())
+                return;
+            conn->bundles(supported);
+            LOG(INFO) << "Switch " << conn->dpid()
+                      << (supported ? " supports" : " doesn't support")
+                      << " bundles";
+            if (supported) {
+                uint8_t discard[OFBundle::control_len];
+                OFBundle::control(discard, 0, probe_id,
+                                  OFBundle::DISCARD_REQUEST, 0);
+                conn->send(discard, sizeof(discard));
+            }
+        });
+
+        uint8_t open[OFBundle::control_len];
+        OFBundle::control(open, xid, probe_id, OFBundle::OPEN_REQUEST,
+                          OFBundle::ATOMIC | OFBundle::ORDERED);
+        conn->send(open, sizeof(open));
+    }
+
+    // Switch without meters would refuse the metered table-miss
+    // and send no packet-in's, it gets the unmetered one
+    void probeMeters(SwitchBase* ctx)
+    {
+        if (not packet_in_meter.id)
+            return;
+
+        of13::MultipartRequestMeterFeatures req;
+        app.request(ctx->connection, req, &app,
+            [ctx](SwitchConnectionPtr conn,
+                  std::shared_ptr<OFMsgUnion> reply,
+                  bool)
+            {
+                auto base = reply->base();
+                if (base->type() != of13::OFPT_MULTIPART_REPLY ||
+                    static_cast<of13::MultipartReply*>(base)->mpart_type()
+                        != of13::OFPMP_METER_FEATURES)
+                    return;
+                auto features = reply->multipartReplyMeterFeatures.meter_features();
+                bool supported = features.max_meter() > 0 &&
+                    (features.band_types() & (1 << of13::OFPMBT_DROP)) &&
+                    (features.capabilities() & of13::OFPMF_PKTPS);
+                // Burst size is left to the switch if it can't be set
+                bool burst = features.capabilities() & of13::OFPMF_BURST;
+                LOG(INFO) << "Switch " << conn->dpid()
+                          << (supported ? " supports" : " doesn't support")
+                          << " packet-in meter";
+                if (supported && conn->alive())
+                    addMeter(ctx, burst);
+            },
+            [](SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion>)
+            {
+                LOG(INFO) << "Switch " << conn->dpid()
+                          << " doesn't support meters";
+            });
+    }
+
+    // Table-miss may refer to the meter only after the switch has
+    // added it: the barrier after the meter-mod confirms it, an error
+    // for the meter-mod means the switch refused it
+    void addMeter(SwitchBase* ctx, bool burst)
+    {
+        uint64_t dpid = ctx->connection->dpid();
+        uint32_t xid = nextXid();
+        ctx->connection->barriers.track(xid,
+                [ctx, dpid](BarrierTracker::Reply reply) {
+            typedef BarrierTracker::Reply Reply;
+            if (reply == Reply::Confirmed) {
+                ctx->enableMeter();
+            } else if (reply == Reply::Error) {
+                LOG(WARNING) << "Switch " << dpid
+                             << " refused packet-in meter";
+            }
+        });
+        ctx->installMeter(xid, burst);
+        app.barrier(ctx->connection, [](bool) { });
+    }
+
+    bool handleBundleReply(SwitchBase* ctx, const uint8_t* data, size_t len)
+    {
+        uint32_t bundle_id;
+        OFBundle::ControlType type;
+        if (not OFBundle::parseControl(data, len, bundle_id, type))
+            return false;
+
+        if (type == OFBundle::OPEN_REPLY || type == OFBundle::COMMIT_REPLY) {
+            uint32_t xid;
+            std::memcpy(&xid, data + 4, sizeof(xid));
+            ctx->connection->bundle_requests.complete(ntohl(xid));
+        }
+        return true;
+    }
+
+    // Unique xid of a request which isn't a static transaction
+    uint32_t nextXid()
+    {
+        const uint32_t range =
+            std::numeric_limits<uint32_t>::max() - min_session_xid;
+        return min_session_xid + session_counter.fetch_add(1) % range;
+    }
+
+    void publishSession(SessionSlot* slot, OFSession* session)
+    {
+        slot->xid.store(session->xid(), std::memory_order_relaxed);
+        slot->deadline.store(session->deadline().time_since_epoch().count(),
+                             std::memory_order_relaxed);
+        slot->session.store(session, std::memory_order_release);
+    }
+
+    void handleSession(uint32_t xid, uint8_t type, SwitchBase* ctx,
+                       const std::shared_ptr<OFMsgUnion>& msg)
+    {
+        SessionSlot& slot = sessions[xid & (session_slots - 1)];
+
+        OFSession* session = slot.session.load(std::memory_order_acquire);
+        if (session == nullptr || session == busy() ||
+            slot.xid.load(std::memory_order_relaxed) != xid)
+            return;
+        if (not slot.session.compare_exchange_strong(session, busy()))
+            return; // timed out right now
+
+        if (session->xid() != xid ||
+            session->connection()->dpid() != ctx->connection->dpid()) {
+            slot.session.store(session, std::memory_order_release);
+            return;
+        }
+
+        if (type == of13::OFPT_ERROR) {
+            emit session->error(ctx->connection, msg);
+        } else {
+            bool more = false;
+            if (type == of13::OFPT_MULTIPART_REPLY) {
+                auto mpart = static_cast<of13::MultipartReply*>(msg->base());
+                more = mpart->flags() & of13::OFPMPF_REPLY_MORE;
+            }
+            emit session->reply(ctx->connection, msg, more);
+            if (more) {
+                slot.session.store(session, std::memory_order_release);
+                return;
+            }
+        }
+
+        slot.session.store(nullptr, std::memory_order_release);
+        session->deleteLater();
+    }
+
+    // Updates packet-in rates and logs counters of busy switches
+    void sampleTelemetry()
+    {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - last_telemetry).count();
+        last_telemetry = now;
+
+        std::lock_guard<std::mutex> lock(switches_mutex);
+        for (auto& sw : switches) {
+            SwitchBase& base = sw.second;
+            auto telemetry = base.connection->telemetry();
+            uint64_t packet_ins =
+                telemetry.received.messages[of13::OFPT_PACKET_IN];
+            base.packet_in_rate = (packet_ins - base.sampled_packet_ins) / seconds;
+            base.sampled_packet_ins = packet_ins;
+
+            if (not log_telemetry || not base.connection->alive())
+                continue;
+
+            const auto& in = telemetry.received.messages;
+            size_t busiest = std::max_element(in.begin(), in.end()) - in.begin();
+            LOG(INFO) << "Switch " << sw.first
+                      << ": received " << telemetry.received.totalMessages()
+                      << " messages (" << telemetry.received.totalBytes() << " bytes)"
+                      << ", mostly of type " << busiest
+                      << "; sent " << telemetry.sent.totalMessages()
+                      << " messages (" << telemetry.sent.totalBytes() << " bytes)"
+                      << "; packet-in " << base.packet_in_rate << "/s"
+                      << "; queued " << telemetry.transport.queued_bytes << " bytes"
+                      << "; echo rtt " << telemetry.transport.echo_rtt_us << " us"
+                      << "; parse errors " << telemetry.parse_errors;
+        }
+    }
+
+    void expireSessions()
+    {
+        auto now = OFSession::clock::now();
+        auto now_rep = now.time_since_epoch().count();
+
+        for (size_t i = 0; i < session_slots; ++i) {
+            SessionSlot& slot = sessions[i];
+            OFSession* session = slot.session.load(std::memory_order_acquire);
+            if (session == nullptr || session == busy() ||
+                slot.deadline.load(std::memory_order_relaxed) > now_rep)
+                continue;
+            if (not slot.session.compare_exchange_strong(session, busy()))
+                continue;
+
+            if (session->deadline() > now) {
+                // slot was reused after we read the hint
+                slot.session.store(session, std::memory_order_release);
+                continue;
+            }
+
+            slot.session.store(nullptr, std::memory_order_release);
+            VLOG(5) << "Request xid=" << session->xid() << " to switch "
+                    << session->connection()->dpid() << " timed out";
+            emit session->timeout(session->connection());
+            session->deleteLater();
+        }
+    }
+
 private:
-    SwitchBase *createSwitchBase(OFConnection *ofconn, uint64_t dpid)
+    static OFSession* busy()
+    {
+        static char tag;
+        return reinterpret_cast<OFSession*>(&tag);
+    }
+
+    SwitchBase *createSwitchBase(OFTransportConnection *ofconn, uint64_t dpid,
+                                 uint32_t n_buffers)
     {
 
         auto it = switches.find(dpid);
         if (it != switches.end())
             goto ret;
         {
-            static std::mutex mutex;
-            std::lock_guard<std::mutex> lock(mutex);
+            std::lock_guard<std::mutex> lock(switches_mutex);
 
             it = switches.find(dpid);
             if (it != switches.end())
@@ -311,8 +947,13 @@ private:
                                   std::forward_as_tuple(dpid),
                                   std::forward_as_tuple(ofconn,
                                                         dpid,
-                                                        max_table))
+                                                        n_buffers,
+                                                        max_table,
+                                                        packet_in_meter,
+                                                        miss_send_len,
+                                                        async))
                           .first;
+            admission.init(it->second.admission);
             return &it->second;
         }
 
@@ -321,38 +962,151 @@ private:
         if (ctx->connection->alive()) {
             LOG(ERROR) << "Overwriting switchscope on active connection";
         }
+        ctx->connection->barriers.expire();
+        ctx->connection->bundle_requests.expire();
         ctx->connection->replace(ofconn);
-        ctx->reinit();
+        ctx->connection->buffered(n_buffers > 0);
+        ctx->n_buffers = n_buffers;
+        ctx->wipe = not reconcile;
+        admission.init(ctx->admission);
         return ctx;
     }
 
+public:
+    // Table setup of a connected switch, done by switch-manager
+    // when the switch's bring-up turn comes if setup is paced
+    void setupSwitch(SwitchBase* ctx)
+    {
+        if (not ctx->connection->alive())
+            return;
+        ctx->reinit(ctx->n_buffers, ctx->wipe);
+        probeMeters(ctx);
+        if (not ctx->wipe) {
+            reconcileFlows(ctx->connection);
+        }
+        for (auto& handler : setup_handlers) {
+            handler(ctx->connection, ctx->wipe);
+        }
+    }
+
+private:
+
+    // Hand entries found on the switch to owners of their cookies
+    void reconcileFlows(SwitchConnectionPtr conn)
+    {
+        for (const CookieSpace& space : cookie_spaces) {
+            of13::MultipartRequestFlow req;
+            req.table_id(of13::OFPTT_ALL);
+            req.out_port(of13::OFPP_ANY);
+            req.out_group(of13::OFPG_ANY);
+            req.cookie(space.base);  // match: cookie & mask == field.cookie & mask
+            req.cookie_mask(space.mask);
+            req.flags(0);
+
+            // Reconciler gets entries part by part as they arrive,
+            // a reply of other type is rejected before
+            auto reconcile = space.reconcile;
+            auto received = std::make_shared<size_t>(0);
+            app.request(conn, req, &app,
+                [reconcile, received](SwitchConnectionPtr conn,
+                                      std::shared_ptr<OFMsgUnion> reply,
+                                      bool more)
+                {
+                    auto base = reply->base();
+                    if (base->type() != of13::OFPT_MULTIPART_REPLY ||
+                        static_cast<of13::MultipartReply*>(base)->mpart_type()
+                            != of13::OFPMP_FLOW) {
+                        LOG(ERROR) << "Unexpected reply to flow stats request"
+                                   << " from switch " << conn->dpid();
+                        return;
+                    }
+                    auto entries = MultipartEntries<of13::FlowStats>::of(*reply);
+                    *received += entries.size();
+                    reconcile(conn, std::move(entries));
+                    if (not more) {
+                        VLOG(5) << "Reconciled " << *received
+                                << " flows of switch " << conn->dpid();
+                    }
+                },
+                [received](SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion>)
+                {
+                    LOG(WARNING) << "Switch " << conn->dpid()
+                                 << " refused flow stats, only " << *received
+                                 << " flows are reconciled";
+                },
+                [received](SwitchConnectionPtr conn)
+                {
+                    LOG(WARNING) << "Flow stats of switch " << conn->dpid()
+                                 << " timed out, only " << *received
+                                 << " flows are reconciled";
+                });
+        }
+    }
+
 };
 
 /* Application interface */
 void Controller::init(Loader*, const Config& rootConfig)
 {
     const Config& config = config_cd(rootConfig, "controller");
-    impl.reset(new ControllerImpl{
-            *this,
-            config_get(config, "address", "0.0.0.0").c_str(),
-            config_get(config, "port", 6653),
-            config_get(config, "nthreads", 4),
-            config_get(config, "secure", false),
-            OFServerSettings()
-                    .supported_version(of13::OFP_VERSION)
-                    .keep_data_ownership(false)
-                    .echo_interval(config_get(config, "echo_interval", 15))
-                    .liveness_check(config_get(config, "liveness_check", true))
-    });
+    impl.reset(new ControllerImpl{*this});
+
+    OFTransport::Settings settings;
+    settings.address = config_get(config, "address", "0.0.0.0");
+    settings.port = config_get(config, "port", 6653);
+    settings.nthreads = config_get(config, "nthreads", 4);
+    settings.secure = config_get(config, "secure", false);
+    settings.echo_interval = config_get(config, "echo_interval", 15);
+    settings.liveness_check = config_get(config, "liveness_check", true);
+
+    auto transport_config = config_cd(config, "transport");
+    settings.read_buffer =
+        config_get(transport_config, "read-buffer", 256 * 1024);
+
+    auto tls_config = config_cd(config, "tls");
+    settings.tls_cert = config_get(tls_config, "cert", "");
+    settings.tls_key = config_get(tls_config, "key", settings.tls_cert);
+    settings.tls_ca = config_get(tls_config, "ca", "");
+    settings.ktls = config_get(tls_config, "ktls", true);
+    settings.tls_resumption = config_get(tls_config, "resumption", true);
+    impl->transport = OFTransport::create(
+            config_get(transport_config, "backend", "fluid"),
+            settings, *impl);
     impl->config = config;
     impl->root_config = rootConfig;
     impl->max_table = config_get(config, "tables.max_table", 0);
+    impl->admission.configure(config_cd(config, "admission"));
+    impl->miss_send_len.configure(config_cd(config, "miss-send-len"));
+    impl->reconcile = config_get(config, "reconcile", false);
+    impl->use_bundles = config_get(config, "bundles", true);
+    impl->barrier_timeout =
+        std::chrono::seconds(config_get(config, "barrier-timeout", 10));
+
+    auto telemetry_config = config_cd(config, "telemetry");
+    impl->telemetry_interval = std::chrono::seconds(
+        std::max(config_get(telemetry_config, "interval", 10), 1));
+    impl->log_telemetry = config_get(telemetry_config, "log", false);
+
+    auto meter_config = config_cd(config, "packet-in-meter");
+    int meter_rate = config_get(meter_config, "rate", 0);
+    if (meter_rate > 0) {
+        impl->packet_in_meter.id = config_get(meter_config, "id", 1);
+        impl->packet_in_meter.rate = meter_rate;
+        int meter_burst = config_get(meter_config, "burst", 0);
+        impl->packet_in_meter.burst =
+            meter_burst > 0 ? meter_burst : std::max(meter_rate / 10, 1);
+    }
 }
 
 void Controller::startUp(Loader*)
 {
-    impl->start(/* block: */ false);
+    if (not impl->transport->start()) {
+        LOG(ERROR) << "Can't start OpenFlow transport";
+    }
     impl->started = true;
+    impl->last_telemetry = std::chrono::steady_clock::now();
+    // Check session timeouts
+    startTimer(100);
     impl->cbench = config_get(impl->config, "cbench", false);
 }
 
@@ -361,7 +1115,96 @@ void Controller::__register_handler__(uint8_t t, CommonHandlers* h)
     if (impl->started) {
         LOG(ERROR) << "Register handler after startup";
     }
-    impl->handlers.emplace(t, h);
+    impl->dispatch[t].handlers.reset(h);
+}
+
+CommonHandlers* Controller::__handlers__(uint8_t t) const
+{
+    return impl->dispatch[t].handlers.get();
+}
+
+std::unordered_map<uint64_t, AdmissionStats> Controller::admissionStats() const
+{
+    std::unordered_map<uint64_t, AdmissionStats> ret;
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    for (const auto& sw : impl->switches) {
+        ret.emplace(sw.first, sw.second.admission.stats());
+    }
+    return ret;
+}
+
+uint32_t Controller::packetInMeter() const
+{
+    return impl->packet_in_meter.id;
+}
+
+void Controller::subscribeAsync(uint8_t type, uint32_t reasons)
+{
+    if (impl->started) {
+        LOG(ERROR) << "Subscribing to asynchronous messages after startup";
+        return;
+    }
+
+    switch (type) {
+    case of13::OFPT_PACKET_IN:
+        impl->async.packet_in |= reasons;
+        break;
+    case of13::OFPT_PORT_STATUS:
+        impl->async.port_status |= reasons;
+        break;
+    case of13::OFPT_FLOW_REMOVED:
+        impl->async.flow_removed |= reasons;
+        break;
+    default:
+        LOG(ERROR) << "Message type " << unsigned(type) << " isn't asynchronous";
+    }
+}
+
+void Controller::registerSetupHandler(SwitchSetupHandler handler)
+{
+    if (impl->started) {
+        LOG(ERROR) << "Registering setup handler after startup";
+        return;
+    }
+    impl->setup_handlers.push_back(std::move(handler));
+}
+
+void Controller::registerCookieSpace(uint64_t base, uint64_t mask,
+                                     FlowReconciler reconcile)
+{
+    if (impl->started) {
+        LOG(ERROR) << "Registering cookie space after startup";
+        return;
+    }
+    impl->cookie_spaces.push_back({base & mask, mask, reconcile});
+}
+
+uint16_t Controller::missSendLen(uint8_t table) const
+{
+    return impl->miss_send_len.get(table);
+}
+
+void Controller::requireMissSendLen(uint8_t table, uint16_t len)
+{
+    uint16_t old_len = impl->miss_send_len.get(table);
+    impl->miss_send_len.require(table, len);
+    if (impl->miss_send_len.get(table) == old_len)
+        return;
+
+    LOG(INFO) << "Sending " << impl->miss_send_len.get(table)
+              << " bytes of table-miss packets in table " << unsigned(table);
+
+    // Switches connected before the requirement was known
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    for (auto& sw : impl->switches) {
+        if (sw.second.connection->alive())
+            sw.second.updateMissSendLen();
+    }
+}
+
+uint64_t Controller::messagesReceived(uint8_t type) const
+{
+    return impl->dispatch[type].received.load(std::memory_order_relaxed);
 }
 
 OFTransaction* Controller::registerStaticTransaction(Application *caller)
@@ -379,12 +1222,160 @@ OFTransaction* Controller::registerStaticTransaction(Application *caller)
     QObject::connect(ret, &QObject::destroyed, [xid, this]() {
         static std::mutex mutex;
         std::lock_guard<std::mutex> lock(mutex);
-        impl->static_ofresponse[xid] = 0;
+        impl->static_ofresponse[xid - impl->min_xid] = 0;
     });
 
     return ret;
 }
 
+bool Controller::request(SwitchConnectionPtr conn, OFMsg& msg, QObject* context,
+                         OFSession::ReplyHandler on_reply,
+                         OFSession::ErrorHandler on_error,
+                         OFSession::TimeoutHandler on_timeout,
+                         std::chrono::milliseconds timeout)
+{
+    uint32_t xid;
+    auto slot = impl->reserveSession(xid);
+    if (not slot) {
+        LOG(ERROR) << "Too many pending requests, dropping request to switch "
+                   << conn->dpid();
+        return false;
+    }
+
+    auto session = new OFSession(xid, conn, OFSession::clock::now() + timeout);
+    // Lives in the context thread to be deleted by its event loop
+    session->moveToThread(context->thread());
+
+    if (on_reply)
+        QObject::connect(session, &OFSession::reply, context, on_reply);
+    if (on_error)
+        QObject::connect(session, &OFSession::error, context, on_error);
+    if (on_timeout)
+        QObject::connect(session, &OFSession::timeout, context, on_timeout);
+
+    impl->publishSession(slot, session);
+
+    msg.xid(xid);
+    conn->send(msg);
+    return true;
+}
+
+void Controller::timerEvent(QTimerEvent*)
+{
+    impl->expireSessions();
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - impl->last_telemetry >= impl->telemetry_interval) {
+        impl->sampleTelemetry();
+    }
+
+    auto deadline = now - impl->barrier_timeout;
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    for (auto& sw : impl->switches) {
+        sw.second.connection->barriers.expire(deadline);
+        sw.second.connection->bundle_requests.expire(deadline);
+    }
+}
+
+void Controller::barrier(SwitchConnectionPtr conn, BarrierHandler done)
+{
+    if (not conn->alive()) {
+        done(false);
+        return;
+    }
+
+    // Every connection is created by createSwitchBase
+    auto impl_conn = static_cast<SwitchConnectionImpl*>(conn.get());
+    uint32_t xid = impl->nextXid();
+    impl_conn->barriers.add(xid, std::move(done));
+
+    conn->send(OFEncode::barrier_len, [xid](uint8_t* buf) {
+        OFEncode::barrier(buf, xid);
+    });
+}
+
+void Controller::commitBundle(SendBundle& bundle, BundleHandler done)
+{
+    const uint16_t flags = OFBundle::ATOMIC | OFBundle::ORDERED;
+
+    for (auto& part : bundle.take()) {
+        // Every connection is created by createSwitchBase
+        auto conn = static_cast<SwitchConnectionImpl*>(part.conn);
+        uint64_t dpid = conn->dpid();
+        if (not conn->alive()) {
+            done(dpid, BundleResult::Lost);
+            continue;
+        }
+
+        // Callback is kept by the connection itself.
+        // Only an error from a live switch means it refused the bundle,
+        // lost connection or timeout tell nothing about it.
+        uint32_t commit_xid = impl->nextXid();
+        conn->bundle_requests.track(commit_xid,
+                [conn, dpid, done](BarrierTracker::Reply reply) {
+            typedef BarrierTracker::Reply Reply;
+            if (reply == Reply::Confirmed) {
+                done(dpid, BundleResult::Committed);
+            } else if (reply == Reply::Error && conn->alive()) {
+                if (conn->bundles()) {
+                    LOG(WARNING) << "Switch " << dpid << " rejected bundle,"
+                                 << " using barriers from now on";
+                    conn->bundles(false);
+                }
+                done(dpid, BundleResult::Rejected);
+            } else {
+                done(dpid, BundleResult::Lost);
+            }
+        });
+
+        uint8_t open[OFBundle::control_len];
+        uint8_t commit[OFBundle::control_len];
+        OFBundle::control(open, impl->nextXid(), part.id,
+                          OFBundle::OPEN_REQUEST, flags);
+        OFBundle::control(commit, commit_xid, part.id,
+                          OFBundle::COMMIT_REQUEST, flags);
+
+        // Pipelined without waiting for the open reply. Switch answers
+        // both open and commit, only the commit reply is tracked:
+        // a failed open makes the commit fail as well.
+        SendBatch batch;
+        conn->send(open, sizeof(open));
+        conn->send(part.data.data(), part.data.size());
+        conn->send(commit, sizeof(commit));
+    }
+}
+
+std::unordered_map<uint64_t, BarrierLatency> Controller::barrierLatency() const
+{
+    std::unordered_map<uint64_t, BarrierLatency> ret;
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    for (const auto& sw : impl->switches) {
+        ret.emplace(sw.first, sw.second.connection->barriers.stats());
+    }
+    return ret;
+}
+
+std::unordered_map<uint64_t, OFTransportStats> Controller::transportStats() const
+{
+    std::unordered_map<uint64_t, OFTransportStats> ret;
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    for (const auto& sw : impl->switches) {
+        ret.emplace(sw.first, sw.second.connection->transportStats());
+    }
+    return ret;
+}
+
+std::unordered_map<uint64_t, ConnectionTelemetry> Controller::telemetry() const
+{
+    std::unordered_map<uint64_t, ConnectionTelemetry> ret;
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    for (const auto& sw : impl->switches) {
+        auto& telemetry = ret[sw.first] = sw.second.connection->telemetry();
+        telemetry.packet_in_rate = sw.second.packet_in_rate;
+    }
+    return ret;
+}
+
 uint8_t Controller::getTable(const char* name) const
 {
     auto config = config_cd(impl->root_config, "tables");
@@ -393,6 +1384,20 @@ uint8_t Controller::getTable(const char* name) const
     return table;
 }
 
+void Controller::pacedSetup()
+{
+    impl->paced_setup = true;
+}
+
+void Controller::setupSwitch(SwitchConnectionPtr conn)
+{
+    std::lock_guard<std::mutex> lock(impl->switches_mutex);
+    auto it = impl->switches.find(conn->dpid());
+    if (it != impl->switches.end()) {
+        impl->setupSwitch(&it->second);
+    }
+}
+
 uint8_t Controller::maxTable() const
 {
     return impl->max_table;
@@ -17,14 +17,22 @@
 #pragma once
 
 #include "Common.hh"
+#include "Admission.hh"
 #include "Application.hh"
 #include "Loader.hh"
+#include "OFMsgUnion.hh"
 #include "OFTransaction.hh"
 #include "SwitchConnection.hh"
 
 #include "api/PacketMissHandler.hh"
 #include "SwitchConnectionFwd.hh"
 
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 using runos::SwitchConnectionPtr;
@@ -32,22 +40,136 @@ using runos::PacketMissHandlerFactory;
 using runos::FloodImplementation;
 using runos::OfMessageHandler;
 
+/**
+ * Handler that keeps the decoded message alive after it returns,
+ * e.g. to process it on another thread.
+ */
+using OfSharedMessageHandler =
+    std::function< void(std::shared_ptr<OFMsgUnion> msg, SwitchConnectionPtr) >;
+
+/**
+ * Gets flow entries of a claimed cookie space found on a reconnected switch.
+ * Called once per part of the flow stats reply, so entries of a large
+ * table are never held at once.
+ */
+using FlowReconciler =
+    std::function< void(SwitchConnectionPtr, std::vector<of13::FlowStats> entries) >;
+
+/**
+ * Called after controller's table setup of a switch is sent, rules sent
+ * to the switch before it may be deleted by the setup.
+ * `wiped` tells whether the setup deleted all flow entries.
+ */
+using SwitchSetupHandler =
+    std::function< void(SwitchConnectionPtr, bool wiped) >;
+
+/**
+ * Called when barrier is answered (`confirmed` is true) or can't be
+ * answered anymore: connection is lost or the switch doesn't reply in time.
+ */
+using BarrierHandler = std::function< void(bool confirmed) >;
+
+/**
+ * Outcome of a bundle sent to a switch.
+ */
+enum class BundleResult {
+    Committed, // switch applied the bundle
+    Rejected,  // switch answered the commit with an error, nothing applied
+    Lost       // connection is lost or the switch doesn't reply in time
+};
+
+/**
+ * Called when bundle sent to switch `dpid` is answered or can't be
+ * answered anymore.
+ */
+using BundleHandler = std::function< void(uint64_t dpid, BundleResult result) >;
+
+/**
+ * Histogram of barrier round trip times of a switch, i.e. how long
+ * it takes for the preceding flow-mods to be applied.
+ */
+struct BarrierLatency {
+    // buckets[i] counts barriers answered in [2^i, 2^(i+1)) microseconds,
+    // the last one also counts slower ones
+    static constexpr size_t nbuckets = 24;
+    std::array<uint64_t, nbuckets> buckets {};
+    uint64_t confirmed {0};
+    uint64_t failed {0};
+    uint64_t total_us {0};
+};
+
+/**
+ * Maps message class decoded by OFMsgUnion to its OpenFlow type.
+ * Only these classes may be used with Controller::registerHandler.
+ */
+template<class ofMessage>
+struct OFMsgType;
+
+#define RUNOS_OFMSG_TYPE(cls, ofpt) \
+    template<> struct OFMsgType<of13::cls> \
+        : std::integral_constant<uint8_t, of13::ofpt> { }
+
+RUNOS_OFMSG_TYPE(Error, OFPT_ERROR);
+RUNOS_OFMSG_TYPE(FeaturesReply, OFPT_FEATURES_REPLY);
+RUNOS_OFMSG_TYPE(GetConfigReply, OFPT_GET_CONFIG_REPLY);
+RUNOS_OFMSG_TYPE(PacketIn, OFPT_PACKET_IN);
+RUNOS_OFMSG_TYPE(FlowRemoved, OFPT_FLOW_REMOVED);
+RUNOS_OFMSG_TYPE(PortStatus, OFPT_PORT_STATUS);
+RUNOS_OFMSG_TYPE(MultipartReply, OFPT_MULTIPART_REPLY);
+RUNOS_OFMSG_TYPE(BarrierReply, OFPT_BARRIER_REPLY);
+RUNOS_OFMSG_TYPE(QueueGetConfigReply, OFPT_QUEUE_GET_CONFIG_REPLY);
+RUNOS_OFMSG_TYPE(RoleReply, OFPT_ROLE_REPLY);
+RUNOS_OFMSG_TYPE(GetAsyncReply, OFPT_GET_ASYNC_REPLY);
+
+#undef RUNOS_OFMSG_TYPE
+
+/**
+ * Extracts entries of type Entry from a part of multipart reply.
+ * Only these types may be used with Controller::requestEntries.
+ */
+template<class Entry>
+struct MultipartEntries;
+
+#define RUNOS_MULTIPART_ENTRIES(cls, ofpmp, member, getter) \
+    template<> struct MultipartEntries<of13::cls> { \
+        static constexpr uint16_t type = of13::ofpmp; \
+        static std::vector<of13::cls> of(OFMsgUnion& reply) \
+        { return reply.member.getter(); } \
+    }
+
+RUNOS_MULTIPART_ENTRIES(FlowStats, OFPMP_FLOW, multipartReplyFlow, flow_stats);
+RUNOS_MULTIPART_ENTRIES(PortStats, OFPMP_PORT_STATS, multipartReplyPortStats, port_stats);
+RUNOS_MULTIPART_ENTRIES(TableStats, OFPMP_TABLE, multipartReplyTable, table_stats);
+RUNOS_MULTIPART_ENTRIES(QueueStats, OFPMP_QUEUE, multipartReplyQueue, queue_stats);
+RUNOS_MULTIPART_ENTRIES(Port, OFPMP_PORT_DESC, multipartReplyPortDescription, ports);
+
+#undef RUNOS_MULTIPART_ENTRIES
+
 struct CommonHandlers{
-    virtual void apply(void *data, SwitchConnectionPtr connection) = 0;
+    /**
+     * Dispatch already decoded message.
+     * Message is shared with signals and transactions, so handlers
+     * must not assume exclusive ownership of it.
+     */
+    virtual void apply(const std::shared_ptr<OFMsgUnion>& msg,
+                       const SwitchConnectionPtr& connection) = 0;
     virtual ~CommonHandlers(){}
 };
 
 template <class ofMessage>
 class Handlers : public CommonHandlers{
-    class OFMsgParseError : std::exception { };
     std::vector<OfMessageHandler<ofMessage>> handlers;
+    std::vector<OfSharedMessageHandler> shared_handlers;
 public:
-    void apply(void *data, SwitchConnectionPtr connection) override{
-        ofMessage msg;
-        if( msg.unpack(static_cast<uint8_t *>(data)) != 0 ){
-            throw OFMsgParseError();
+    void apply(const std::shared_ptr<OFMsgUnion>& msg,
+               const SwitchConnectionPtr& connection) override{
+        // OFMsgUnion constructs the concrete type in place,
+        // so base() always points to ofMessage here
+        ofMessage& typed = static_cast<ofMessage&>(*msg->base());
+        for (const auto& h : handlers){
+            h(typed, connection);
         }
-        for (auto h : handlers){
+        for (const auto& h : shared_handlers){
             h(msg, connection);
         }
     }
@@ -68,14 +190,23 @@ public:
     void startUp(Loader* loader) override;
 
     /**
-    * Register handler of openflow message
+    * Register handler of openflow message.
+    * ofMessage should be one of the types decoded by OFMsgUnion,
+    * handler gets a reference to the message shared by all consumers.
     */
     template<class ofMessage>
     void registerHandler(OfMessageHandler<ofMessage> handler){
-        static Handlers<ofMessage> handlers;
-        ofMessage tmp;
-        __register_handler__(tmp.type(), &handlers);
-        handlers.handlers.push_back(handler);
+        handlers_of<ofMessage>().handlers.push_back(handler);
+    }
+
+    /**
+    * Register handler that gets ownership of the decoded message.
+    * Called on the connection's I/O thread after ordinary handlers,
+    * so messages of one switch are delivered in order.
+    */
+    template<class ofMessage>
+    void registerSharedHandler(OfSharedMessageHandler handler){
+        handlers_of<ofMessage>().shared_handlers.push_back(handler);
     }
 
     /**
@@ -92,11 +223,185 @@ public:
      */
     OFTransaction* registerStaticTransaction(Application* caller);
 
+    /**
+     * Send request with a unique xid and get callbacks for its replies.
+     * Unlike static transactions, any number of requests may be in
+     * flight, each reply is delivered to the request it belongs to.
+     *
+     * Callbacks are invoked in the thread of `context` and dropped
+     * if it is destroyed. Exactly one of them is the last one:
+     * reply with `more == false`, error or timeout.
+     *
+     * @param msg OpenFlow message (xid will be overwritten).
+     * @return false if too many requests are in flight, nothing is sent.
+     */
+    bool request(SwitchConnectionPtr conn, OFMsg& msg, QObject* context,
+                 OFSession::ReplyHandler on_reply,
+                 OFSession::ErrorHandler on_error = nullptr,
+                 OFSession::TimeoutHandler on_timeout = nullptr,
+                 std::chrono::milliseconds timeout = std::chrono::seconds(10));
+
+    /**
+     * Sends multipart request and streams entries of its reply.
+     * `on_entry` is called for every entry as soon as the reply part
+     * holding it arrives, so memory is bounded by a single part
+     * (at most 64 KiB) whatever the size of the switch's tables.
+     * `on_done` is called last, `complete` is false if the request failed,
+     * timed out or the reply wasn't of the requested type.
+     *
+     * Callbacks are invoked in the thread of `context`, see request().
+     * @return false if nothing is sent, `on_done` isn't called.
+     */
+    template<class Entry>
+    bool requestEntries(SwitchConnectionPtr conn, OFMsg& msg, QObject* context,
+                        std::function<void(SwitchConnectionPtr, Entry&)> on_entry,
+                        std::function<void(SwitchConnectionPtr, bool complete)> on_done,
+                        std::chrono::milliseconds timeout = std::chrono::seconds(10))
+    {
+        // Parts after a malformed one are ignored
+        auto failed = std::make_shared<bool>(false);
+        return request(conn, msg, context,
+            [on_entry, on_done, failed](SwitchConnectionPtr conn,
+                                        std::shared_ptr<OFMsgUnion> reply,
+                                        bool more)
+            {
+                auto base = reply->base();
+                if (not *failed &&
+                    (base->type() != of13::OFPT_MULTIPART_REPLY ||
+                     static_cast<of13::MultipartReply*>(base)->mpart_type()
+                        != MultipartEntries<Entry>::type)) {
+                    LOG(ERROR) << "Unexpected reply to multipart request from switch "
+                               << conn->dpid();
+                    *failed = true;
+                }
+                if (not *failed) {
+                    for (Entry& entry : MultipartEntries<Entry>::of(*reply)) {
+                        on_entry(conn, entry);
+                    }
+                }
+                if (not more) {
+                    on_done(conn, not *failed);
+                }
+            },
+            [on_done](SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion>)
+            { on_done(conn, false); },
+            [on_done](SwitchConnectionPtr conn)
+            { on_done(conn, false); },
+            timeout);
+    }
+
+    /**
+     * Sends barrier request to the switch, `done` is called when it is
+     * answered, so everything sent to the switch before is applied.
+     * `done` is called on the connection's I/O thread
+     * (or on the calling one if the switch is down) and must be quick.
+     * Replies to other barriers are not affected.
+     */
+    void barrier(SwitchConnectionPtr conn, BarrierHandler done);
+
+    /**
+      * Barrier round trip times of every switch seen since startup.
+      */
+    std::unordered_map<uint64_t, BarrierLatency> barrierLatency() const;
+
+    /**
+      * Sends messages collected by `bundle` to every switch as a single
+      * atomic and ordered bundle: open, messages and commit in one write
+      * without waiting for replies. `done` is called once per switch
+      * on the I/O thread.
+      * Switch rejecting a bundle gets plain messages from then on.
+      */
+    void commitBundle(SendBundle& bundle, BundleHandler done);
+
+    /**
+      * Traffic and TLS counters of every connected switch.
+      */
+    std::unordered_map<uint64_t, OFTransportStats> transportStats() const;
+
+    /**
+      * Control channel counters of every switch seen since startup:
+      * messages by type, packet-in rate, send queue, echo RTT.
+      */
+    std::unordered_map<uint64_t, ConnectionTelemetry> telemetry() const;
+
     /**
       * get the max number of using table
       */
     uint8_t maxTable() const;
 
+    /**
+      * Meter limiting table-miss packet-in's on switches supporting
+      * meters, see SwitchConnection::meters(). 0 if metering is disabled.
+      */
+    uint32_t packetInMeter() const;
+
+    /**
+      * Asks switches to send asynchronous messages of `type`
+      * (OFPT_PACKET_IN, OFPT_PORT_STATUS or OFPT_FLOW_REMOVED) with
+      * reasons in `reasons` bitmask, a bit (1 << reason) per reason.
+      * Subscriptions of all applications are sent to every switch
+      * with OFPT_SET_ASYNC, messages nobody subscribed to are filtered out.
+      * Must be called before startup.
+      */
+    void subscribeAsync(uint8_t type, uint32_t reasons);
+
+    /**
+      * Calls `handler` after every table setup, see setupSwitch().
+      * Applications installing rules on every switch should start
+      * on a switch only then. Called on the thread doing the setup.
+      * Must be called before startup.
+      */
+    void registerSetupHandler(SwitchSetupHandler handler);
+
+    /**
+      * Claims flow entries having (cookie & mask) == base.
+      * If "reconcile" is enabled, tables of a known switch aren't wiped
+      * when it reconnects. Instead entries of every claimed space are
+      * passed to its `reconcile`, which must delete the ones it doesn't own.
+      * Entries outside of claimed spaces are kept.
+      */
+    void registerCookieSpace(uint64_t base, uint64_t mask,
+                             FlowReconciler reconcile);
+
+    /**
+      * Number of packet bytes sent to controller on table-miss in `table`.
+      * Per-table values from "miss-send-len" config take precedence,
+      * then the one required by applications, then configured default.
+      */
+    uint16_t missSendLen(uint8_t table) const;
+
+    /**
+      * Declares how many bytes of table-miss packets from `table`
+      * application needs to process them.
+      * Already connected switches are reconfigured.
+      */
+    void requireMissSendLen(uint8_t table, uint16_t len);
+
+    /**
+      * Leaves table setup of connected switches to setupSwitch()
+      * instead of doing it on connection, so it can be paced.
+      * Must be called before startup.
+      */
+    void pacedSetup();
+
+    /**
+      * Sends controller's table setup to the connected switch:
+      * configuration, goto rules and table-miss. Flow entries are wiped
+      * first unless the switch reconnected with "reconcile" enabled.
+      * Done on connection unless pacedSetup() was called.
+      */
+    void setupSwitch(SwitchConnectionPtr conn);
+
+    /**
+      * Number of messages of given OpenFlow type received from all switches.
+      */
+    uint64_t messagesReceived(uint8_t type) const;
+
+    /**
+      * Packet-in admission counters of every switch seen since startup.
+      */
+    std::unordered_map<uint64_t, AdmissionStats> admissionStats() const;
+
 signals:
 
     /**
@@ -120,7 +425,24 @@ signals:
       */
     void flowRemoved(SwitchConnectionPtr ofconnl, of13::FlowRemoved fr);
 
+protected:
+    void timerEvent(QTimerEvent*) override;
+
 private:
     std::unique_ptr<class ControllerImpl> impl;
     void __register_handler__(uint8_t t, CommonHandlers *h);
+
+    CommonHandlers* __handlers__(uint8_t t) const;
+
+    template<class ofMessage>
+    Handlers<ofMessage>& handlers_of(){
+        constexpr uint8_t type = OFMsgType<ofMessage>::value;
+        auto ret = static_cast<Handlers<ofMessage>*>(__handlers__(type));
+        if (not ret) {
+            ret = new Handlers<ofMessage>;
+            // owned by controller
+            __register_handler__(type, ret);
+        }
+        return *ret;
+    }
 };
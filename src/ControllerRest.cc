@@ -0,0 +1,180 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ControllerRest.hh"
+#include "Controller.hh"
+#include "RestListener.hh"
+
+#include <boost/lexical_cast.hpp>
+
+REGISTER_APPLICATION(ControllerRest, {"controller", "rest-listener", ""})
+
+static json11::Json toJson(const AdmissionStats &stats)
+{
+    // json11 has no integers wider than int
+    return json11::Json::object{
+        {"admitted", double(stats.admitted)},
+        {"admitted_control", double(stats.admitted_control)},
+        {"dropped_port", double(stats.dropped_port)},
+        {"dropped_switch", double(stats.dropped_switch)},
+        {"dropped_global", double(stats.dropped_global)},
+        {"dropped_control", double(stats.dropped_control)}
+    };
+}
+
+static json11::Json toJson(const BarrierLatency &latency)
+{
+    json11::Json::array buckets;
+    for (uint64_t count : latency.buckets) {
+        buckets.push_back(double(count));
+    }
+    return json11::Json::object{
+        {"confirmed", double(latency.confirmed)},
+        {"failed", double(latency.failed)},
+        {"total_us", double(latency.total_us)},
+        {"buckets_log2_us", buckets}
+    };
+}
+
+static json11::Json toJson(const OFTransportStats &stats)
+{
+    return json11::Json::object{
+        {"bytes_in", double(stats.bytes_in)},
+        {"bytes_out", double(stats.bytes_out)},
+        {"secure", stats.secure},
+        {"resumed", stats.resumed},
+        {"ktls_tx", stats.ktls_tx},
+        {"ktls_rx", stats.ktls_rx},
+        {"user_crypto_bytes", double(stats.user_crypto_bytes)}
+    };
+}
+
+static json11::Json toJson(const MessageCounters &counters)
+{
+    // Types never seen are omitted
+    json11::Json::object types;
+    for (size_t i = 0; i < MessageCounters::ntypes; ++i) {
+        if (counters.messages[i] == 0)
+            continue;
+        types[std::to_string(i)] = json11::Json::object{
+            {"messages", double(counters.messages[i])},
+            {"bytes", double(counters.bytes[i])}
+        };
+    }
+    return json11::Json::object{
+        {"messages", double(counters.totalMessages())},
+        {"bytes", double(counters.totalBytes())},
+        {"types", types}
+    };
+}
+
+static json11::Json toJson(const ConnectionTelemetry &telemetry)
+{
+    return json11::Json::object{
+        {"received", toJson(telemetry.received)},
+        {"sent", toJson(telemetry.sent)},
+        {"packet_in_rate", telemetry.packet_in_rate},
+        {"parse_errors", double(telemetry.parse_errors)},
+        {"queued_bytes", double(telemetry.transport.queued_bytes)},
+        {"echo_rtt_us", double(telemetry.transport.echo_rtt_us)}
+    };
+}
+
+void ControllerRest::init(Loader *loader, const Config &)
+{
+    ctrl_ = Controller::get(loader);
+    RestListener::get(loader)->registerRestHandler(this);
+    acceptPath(Method::GET, "admission");
+    acceptPath(Method::GET, "barrier-latency");
+    acceptPath(Method::GET, "transport");
+    acceptPath(Method::GET, "telemetry");
+}
+
+json11::Json ControllerRest::handleGET(std::vector<std::string> params, std::string)
+{
+    if (params[0] == "admission")
+        return admission();
+    if (params[0] == "barrier-latency")
+        return barrierLatency();
+    if (params[0] == "transport")
+        return transport();
+    if (params[0] == "telemetry")
+        return telemetry();
+
+    return json11::Json::object{
+        {"controller-rest", "incorrect request"}
+    };
+}
+
+json11::Json ControllerRest::admission() const
+{
+    AdmissionStats total;
+    json11::Json::object switches;
+
+    for (const auto &sw : ctrl_->admissionStats()) {
+        total += sw.second;
+        switches[boost::lexical_cast<std::string>(sw.first)] = toJson(sw.second);
+    }
+
+    return json11::Json::object{
+        {"total", toJson(total)},
+        {"switches", switches}
+    };
+}
+
+json11::Json ControllerRest::barrierLatency() const
+{
+    json11::Json::object switches;
+    for (const auto &sw : ctrl_->barrierLatency()) {
+        switches[boost::lexical_cast<std::string>(sw.first)] = toJson(sw.second);
+    }
+    return json11::Json::object{
+        {"switches", switches}
+    };
+}
+
+json11::Json ControllerRest::transport() const
+{
+    int handshakes = 0, resumed = 0, ktls = 0;
+    json11::Json::object switches;
+
+    for (const auto &sw : ctrl_->transportStats()) {
+        if (sw.second.secure) {
+            ++handshakes;
+            resumed += sw.second.resumed;
+            ktls += sw.second.ktls_tx && sw.second.ktls_rx;
+        }
+        switches[boost::lexical_cast<std::string>(sw.first)] = toJson(sw.second);
+    }
+
+    return json11::Json::object{
+        {"handshakes", handshakes},
+        {"resumed", resumed},
+        {"ktls", ktls},
+        {"switches", switches}
+    };
+}
+
+json11::Json ControllerRest::telemetry() const
+{
+    json11::Json::object switches;
+    for (const auto &sw : ctrl_->telemetry()) {
+        switches[boost::lexical_cast<std::string>(sw.first)] = toJson(sw.second);
+    }
+    return json11::Json::object{
+        {"switches", switches}
+    };
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/** @file */
+#pragma once
+
+#include "Common.hh"
+#include "Application.hh"
+#include "Loader.hh"
+#include "Rest.hh"
+#include "json11.hpp"
+
+/**
+ * REST interface to the controller internals.
+ *
+ * GET /api/controller-rest/admission
+ *  packet-in admission counters: total and per switch
+ *
+ * GET /api/controller-rest/barrier-latency
+ *  histograms of barrier round trip times per switch
+ *
+ * GET /api/controller-rest/transport
+ *  OpenFlow bytes, TLS resumption and kernel TLS offload per switch
+ *
+ * GET /api/controller-rest/telemetry
+ *  messages and bytes by OpenFlow type in both directions, packet-in rate,
+ *  send queue depth, echo RTT and parse errors per switch
+ */
+class ControllerRest : public Application, RestHandler
+{
+SIMPLE_APPLICATION(ControllerRest, "controller-rest")
+public:
+    void init(Loader *loader, const Config& rootConfig) override;
+    bool eventable() override { return false; }
+    AppType type() override { return AppType::None; }
+
+    json11::Json handleGET(std::vector<std::string> params, std::string body) override;
+
+private:
+    class Controller *ctrl_;
+
+    json11::Json admission() const;
+    json11::Json barrierLatency() const;
+    json11::Json transport() const;
+    json11::Json telemetry() const;
+};
@@ -44,6 +44,18 @@ Decision Decision::hard_timeout(duration seconds) const
     return ret;
 }
 
+bool Decision::notify_removed() const
+{
+    return base().notify_removed;
+}
+
+Decision Decision::notify_removed(bool notify) const
+{
+    Decision ret{*this};
+    ret.base().notify_removed = notify || ret.notify_removed();
+    return ret;
+}
+
 Decision Decision::unicast(uint32_t port) const
 {
     if (boost::get<Undefined>(&m_data) == nullptr) {
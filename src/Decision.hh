@@ -39,6 +39,7 @@ public:
         bool return_ { false };
         duration idle_timeout { duration::max() };
         duration hard_timeout { duration::max() };
+        bool notify_removed { false };
         Base() noexcept = default;
     };
 
@@ -132,6 +133,10 @@ public:
     duration hard_timeout() const;
     Decision hard_timeout(duration seconds) const;
 
+    // defaults to false, once requested by any handler stays on
+    bool notify_removed() const;
+    Decision notify_removed(bool notify) const;
+
     // overwrites: unicast, broadcast
     Decision unicast(uint32_t port) const;
 
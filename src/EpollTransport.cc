@@ -0,0 +1,951 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EpollTransport.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <glog/logging.h>
+
+namespace runos {
+
+namespace {
+
+typedef std::chrono::steady_clock clock;
+
+constexpr uint8_t OFP_VERSION = 0x04;
+constexpr uint8_t OFPT_HELLO = 0;
+constexpr uint8_t OFPT_ERROR = 1;
+constexpr uint8_t OFPT_ECHO_REQUEST = 2;
+constexpr uint8_t OFPT_ECHO_REPLY = 3;
+constexpr uint8_t OFPT_FEATURES_REQUEST = 5;
+constexpr uint8_t OFPT_FEATURES_REPLY = 6;
+constexpr uint16_t OFPET_HELLO_FAILED = 0;
+constexpr uint16_t OFPHFC_INCOMPATIBLE = 0;
+constexpr uint16_t OFPHET_VERSIONBITMAP = 1;
+
+constexpr size_t header_len = 8;
+constexpr size_t max_message = 0xffff;
+// Connection is dropped if switch doesn't read what we send
+constexpr size_t max_pending_output = 64 << 20;
+constexpr int max_events = 256;
+// Xid of echo requests sent by the transport
+constexpr uint32_t echo_xid = 0;
+// Connections not finishing TLS handshake in time are dropped
+constexpr std::chrono::seconds handshake_timeout{10};
+
+uint16_t load16(const uint8_t* p)
+{
+    uint16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+uint32_t load32(const uint8_t* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+void store16(uint8_t* p, uint16_t v)
+{
+    v = htons(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+void store32(uint8_t* p, uint32_t v)
+{
+    v = htonl(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+void header(uint8_t* p, uint8_t type, uint16_t len, uint32_t xid)
+{
+    p[0] = OFP_VERSION;
+    p[1] = type;
+    store16(p + 2, len);
+    store32(p + 4, xid);
+}
+
+// Hello message (with a version bitmap if present) allows OpenFlow 1.3
+bool supports_of13(const uint8_t* msg, size_t len)
+{
+    if (msg[0] < OFP_VERSION)
+        return false;
+
+    for (size_t off = header_len; off + 4 <= len; ) {
+        uint16_t type = load16(msg + off);
+        uint16_t elem_len = load16(msg + off + 2);
+        if (elem_len < 4 || off + elem_len > len)
+            break;
+        if (type == OFPHET_VERSIONBITMAP && elem_len >= 8) {
+            return load32(msg + off + 4) & (1u << OFP_VERSION);
+        }
+        off += (elem_len + 7) / 8 * 8;
+    }
+    return true;
+}
+
+void send_hello(OFTransportConnection* conn)
+{
+    uint8_t hello[header_len + 8];
+    header(hello, OFPT_HELLO, sizeof(hello), 0);
+    store16(hello + header_len, OFPHET_VERSIONBITMAP);
+    store16(hello + header_len + 2, 8);
+    store32(hello + header_len + 4, 1u << OFP_VERSION);
+    conn->send(hello, sizeof(hello));
+}
+
+std::string tls_error()
+{
+    unsigned long err = ERR_get_error();
+    if (err == 0)
+        return errno ? std::strerror(errno) : "connection closed";
+    char buf[256];
+    ERR_error_string_n(err, buf, sizeof(buf));
+    ERR_clear_error();
+    return buf;
+}
+
+SSL_CTX* tls_context(const OFTransport::Settings& settings)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == nullptr) {
+        LOG(ERROR) << "Can't create TLS context: " << tls_error();
+        return nullptr;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // AES-GCM and ChaCha20-Poly1305 are the ciphers kernel TLS implements
+    SSL_CTX_set_ciphersuites(ctx, "TLS_AES_128_GCM_SHA256:"
+                                  "TLS_AES_256_GCM_SHA384:"
+                                  "TLS_CHACHA20_POLY1305_SHA256");
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                          SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if (settings.ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        LOG(WARNING) << "OpenSSL is built without kernel TLS support";
+#endif
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, settings.tls_cert.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, settings.tls_key.c_str(),
+                                    SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        LOG(ERROR) << "Can't load TLS certificate " << settings.tls_cert
+                   << " and key " << settings.tls_key << ": " << tls_error();
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    if (not settings.tls_ca.empty()) {
+        if (SSL_CTX_load_verify_locations(ctx, settings.tls_ca.c_str(),
+                                          nullptr) != 1) {
+            LOG(ERROR) << "Can't load TLS CA " << settings.tls_ca << ": "
+                       << tls_error();
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER |
+                                SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+    } else {
+        LOG(WARNING) << "TLS CA isn't set, switch certificates aren't verified";
+    }
+
+    // Tickets are encrypted with keys of this context, which is shared
+    // by all I/O threads, so a switch may resume on any of them.
+    static const unsigned char sid_context[] = "runos";
+    SSL_CTX_set_session_id_context(ctx, sid_context, sizeof(sid_context) - 1);
+    if (settings.tls_resumption) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, 16384);
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_num_tickets(ctx, 0);
+    }
+
+    return ctx;
+}
+
+} // anonymous namespace
+
+class EpollTransport::Connection final : public OFTransportConnection {
+public:
+    enum class State { Handshake, Hello, Features, Running };
+    enum class Handshake { Done, Again, Failed };
+
+    // Takes ownership of `ssl`, which is null for plain connections
+    Connection(int fd, int id, int epfd, size_t read_buffer, SSL* ssl)
+        : state(ssl ? State::Handshake : State::Hello)
+        , rsize(read_buffer)
+        , rbuf(new uint8_t[read_buffer])
+        , last_rx(clock::now())
+        , echo_sent(last_rx)
+        , fd(fd)
+        , m_id(id)
+        , epfd(epfd)
+        , ssl(ssl)
+        , secure(ssl != nullptr)
+    { }
+
+    int id() const override
+    { return m_id; }
+
+    bool alive() const override
+    { return m_alive.load(std::memory_order_relaxed); }
+
+    uint8_t version() const override
+    { return negotiated_version.load(std::memory_order_relaxed); }
+
+    void send(const void* data, size_t len) override
+    {
+        auto p = static_cast<const uint8_t*>(data);
+        std::lock_guard<std::mutex> lock(wmutex);
+        if (fd < 0 || not alive())
+            return;
+        bytes_out.fetch_add(len, std::memory_order_relaxed);
+
+        // Output is held back until TLS handshake completes
+        if (wsent == wbuf.size() && not handshaking()) {
+            wbuf.clear();
+            wsent = 0;
+            ssize_t n = write_some(p, len);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    PLOG(WARNING) << "Connection id=" << m_id << ": write failed";
+                    fail();
+                    return;
+                }
+                n = 0;
+            }
+            p += n;
+            len -= n;
+            if (len == 0)
+                return;
+        }
+
+        if (wbuf.size() - wsent + len > max_pending_output) {
+            LOG(WARNING) << "Connection id=" << m_id
+                         << " doesn't read its messages, closing it";
+            fail();
+            return;
+        }
+        wbuf.insert(wbuf.end(), p, p + len);
+        if (not handshaking())
+            watch_output(true);
+    }
+
+    void close() override
+    {
+        std::lock_guard<std::mutex> lock(wmutex);
+        if (fd >= 0)
+            fail();
+    }
+
+    // Called by the I/O thread on EPOLLOUT
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(wmutex);
+        if (fd < 0)
+            return;
+
+        while (wsent < wbuf.size()) {
+            ssize_t n = write_some(wbuf.data() + wsent, wbuf.size() - wsent);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    PLOG(WARNING) << "Connection id=" << m_id << ": write failed";
+                    fail();
+                }
+                return;
+            }
+            wsent += n;
+        }
+        wbuf.clear();
+        wsent = 0;
+        watch_output(false);
+    }
+
+    // Called by the I/O thread to read into `buf`, same as recv()
+    ssize_t read_some(uint8_t* buf, size_t len)
+    {
+        if (not secure)
+            return ::recv(fd, buf, len, 0);
+
+        // OpenSSL objects can't be used by two threads at once,
+        // so TLS reads take the write lock too
+        std::lock_guard<std::mutex> lock(wmutex);
+        if (fd < 0)
+            return 0;
+        ERR_clear_error();
+        errno = 0;
+        int n = SSL_read(ssl, buf, int(std::min(len, size_t(INT_MAX))));
+        if (n > 0 && not ktls_rx)
+            user_crypto_bytes += n;
+        return n > 0 ? n : tls_failure(n, "read");
+    }
+
+    // Data decrypted by OpenSSL and not read yet
+    bool pending()
+    {
+        if (not secure)
+            return false;
+        std::lock_guard<std::mutex> lock(wmutex);
+        return fd >= 0 && SSL_pending(ssl) > 0;
+    }
+
+    // Called by the I/O thread on any event in Handshake state
+    Handshake handshake()
+    {
+        std::lock_guard<std::mutex> lock(wmutex);
+        if (fd < 0)
+            return Handshake::Failed;
+
+        ERR_clear_error();
+        errno = 0;
+        int ret = SSL_do_handshake(ssl);
+        if (ret == 1) {
+            resumed = SSL_session_reused(ssl);
+#ifdef BIO_get_ktls_send
+            ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl));
+            ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#endif
+            handshake_done = true;
+            return Handshake::Done;
+        }
+
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            watch_output(false);
+            return Handshake::Again;
+        case SSL_ERROR_WANT_WRITE:
+            watch_output(true);
+            return Handshake::Again;
+        default:
+            if (not dead) {
+                LOG(WARNING) << "Connection id=" << m_id
+                             << ": TLS handshake failed: " << tls_error();
+            }
+            return Handshake::Failed;
+        }
+    }
+
+    OFTransportStats stats() const override
+    {
+        OFTransportStats ret;
+        ret.bytes_in = bytes_in.load(std::memory_order_relaxed);
+        ret.bytes_out = bytes_out.load(std::memory_order_relaxed);
+        ret.echo_rtt_us = echo_rtt_us.load(std::memory_order_relaxed);
+        ret.secure = secure;
+
+        std::lock_guard<std::mutex> lock(wmutex);
+        ret.queued_bytes = wbuf.size() - wsent;
+        ret.resumed = resumed;
+        ret.ktls_tx = ktls_tx;
+        ret.ktls_rx = ktls_rx;
+        ret.user_crypto_bytes = user_crypto_bytes;
+        return ret;
+    }
+
+    // Called by the I/O thread when connection is gone
+    void release()
+    {
+        std::lock_guard<std::mutex> lock(wmutex);
+        m_alive = false;
+        if (ssl) {
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        fd = -1;
+        wbuf.clear();
+        wbuf.shrink_to_fit();
+        rbuf.reset();
+    }
+
+    int socket() const
+    { return fd; }
+
+    State state;
+    // Liveness check timed out
+    bool dead{false};
+    std::atomic<uint8_t> negotiated_version{0};
+    // Counted by the I/O thread
+    std::atomic<uint64_t> bytes_in{0};
+
+    // Unparsed input is [rbegin, rend)
+    const size_t rsize;
+    std::unique_ptr<uint8_t[]> rbuf;
+    size_t rbegin{0};
+    size_t rend{0};
+
+    clock::time_point last_rx;
+    // Echo request is sent every echo interval, at most one is pending
+    clock::time_point echo_sent;
+    bool echo_pending{false};
+    std::atomic<uint32_t> echo_rtt_us{0};
+
+private:
+    // Guarded by wmutex, -1 after release()
+    int fd;
+    const int m_id;
+    const int epfd;
+    std::atomic<bool> m_alive{true};
+
+    mutable std::mutex wmutex;
+    std::vector<uint8_t> wbuf;
+    size_t wsent{0};
+    bool watching_output{false};
+    std::atomic<uint64_t> bytes_out{0};
+
+    // TLS session, guarded by wmutex
+    SSL* ssl;
+    const bool secure;
+    bool handshake_done{false};
+    bool resumed{false};
+    bool ktls_tx{false};
+    bool ktls_rx{false};
+    uint64_t user_crypto_bytes{0};
+
+    bool handshaking() const
+    { return secure && not handshake_done; }
+
+    // Same as send(), called with wmutex held
+    ssize_t write_some(const uint8_t* p, size_t len)
+    {
+        if (not secure)
+            return ::send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        ERR_clear_error();
+        errno = 0;
+        int n = SSL_write(ssl, p, int(std::min(len, size_t(INT_MAX))));
+        if (n > 0 && not ktls_tx)
+            user_crypto_bytes += n;
+        return n > 0 ? n : tls_failure(n, "write");
+    }
+
+    // Maps failed TLS read or write to the result of recv() or send()
+    ssize_t tls_failure(int ret, const char* op)
+    {
+        switch (SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (errno == 0)
+                return 0;
+            return -1;
+        default:
+            LOG(WARNING) << "Connection id=" << m_id << ": TLS " << op
+                         << " failed: " << tls_error();
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    // I/O thread sees hangup and releases the connection
+    void fail()
+    {
+        m_alive = false;
+        if (secure && handshake_done) {
+            // Best effort close_notify, socket isn't waited for
+            SSL_shutdown(ssl);
+        }
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    void watch_output(bool enable)
+    {
+        if (watching_output == enable)
+            return;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | (enable ? uint32_t(EPOLLOUT) : 0u);
+        ev.data.ptr = this;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        watching_output = enable;
+    }
+};
+
+struct EpollTransport::Worker {
+    int epfd{-1};
+    int listen_fd{-1};
+    int wake_fd{-1};
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    // Closed connections are freed a tick later, so threads still
+    // holding them see a dead connection instead of freed memory.
+    std::vector<std::unique_ptr<Connection>> released;
+    std::vector<std::unique_ptr<Connection>> releasing;
+
+    ~Worker()
+    {
+        if (listen_fd >= 0) ::close(listen_fd);
+        if (wake_fd >= 0) ::close(wake_fd);
+        if (epfd >= 0) ::close(epfd);
+    }
+};
+
+EpollTransport::EpollTransport(const Settings& settings,
+                               OFTransportHandler& handler)
+    : settings(settings)
+    , handler(handler)
+{
+    // Largest message must fit after compaction
+    this->settings.read_buffer =
+        std::max(this->settings.read_buffer, 2 * max_message);
+}
+
+EpollTransport::~EpollTransport()
+{
+    stop();
+}
+
+bool EpollTransport::secure() const
+{
+    return tls_ctx != nullptr;
+}
+
+bool EpollTransport::listen(Worker& w)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+
+    addrinfo* addrs = nullptr;
+    std::string port = std::to_string(settings.port);
+    int err = getaddrinfo(settings.address.c_str(), port.c_str(),
+                          &hints, &addrs);
+    if (err) {
+        LOG(ERROR) << "Can't listen on " << settings.address << ": "
+                   << gai_strerror(err);
+        return false;
+    }
+    std::unique_ptr<addrinfo, decltype(&freeaddrinfo)> guard(addrs, freeaddrinfo);
+
+    int fd = ::socket(addrs->ai_family,
+                      SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        PLOG(ERROR) << "Can't create listening socket";
+        return false;
+    }
+    w.listen_fd = fd;
+
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        PLOG(ERROR) << "Can't share port " << settings.port;
+        return false;
+    }
+    if (::bind(fd, addrs->ai_addr, addrs->ai_addrlen) < 0 ||
+        ::listen(fd, SOMAXCONN) < 0) {
+        PLOG(ERROR) << "Can't listen on " << settings.address
+                    << ":" << settings.port;
+        return false;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w.listen_fd;
+    epoll_ctl(w.epfd, EPOLL_CTL_ADD, fd, &ev);
+    return true;
+}
+
+bool EpollTransport::start()
+{
+    int nthreads = std::max(settings.nthreads, 1);
+
+    if (settings.secure) {
+        tls_ctx = tls_context(settings);
+        if (tls_ctx == nullptr)
+            return false;
+    }
+
+    for (int i = 0; i < nthreads; ++i) {
+        std::unique_ptr<Worker> w{new Worker};
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->epfd < 0 || w->wake_fd < 0) {
+            PLOG(ERROR) << "Can't create epoll instance";
+            stop();
+            return false;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &w->wake_fd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake_fd, &ev);
+
+        if (not listen(*w)) {
+            stop();
+            return false;
+        }
+        workers.push_back(std::move(w));
+    }
+
+    for (auto& w : workers) {
+        Worker* worker = w.get();
+        worker->thread = std::thread([this, worker]() { run(*worker); });
+    }
+
+    LOG(INFO) << "Listening on " << settings.address << ":" << settings.port
+              << " with " << nthreads << " epoll threads"
+              << (secure() ? " (TLS)" : "");
+    return true;
+}
+
+void EpollTransport::stop()
+{
+    for (auto& w : workers) {
+        w->stopping = true;
+        uint64_t one = 1;
+        if (::write(w->wake_fd, &one, sizeof(one)) < 0) {
+            PLOG(WARNING) << "Can't wake up I/O thread";
+        }
+    }
+    for (auto& w : workers) {
+        if (w->thread.joinable())
+            w->thread.join();
+        for (auto& c : w->connections) {
+            c.second->release();
+        }
+    }
+    workers.clear();
+
+    if (tls_ctx) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = nullptr;
+    }
+}
+
+void EpollTransport::run(Worker& w)
+{
+    epoll_event events[max_events];
+    auto next_tick = clock::now() + std::chrono::seconds(1);
+
+    while (not w.stopping) {
+        auto now = clock::now();
+        if (now >= next_tick) {
+            tick(w);
+            next_tick = now + std::chrono::seconds(1);
+        }
+        int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          next_tick - now).count();
+
+        int n = epoll_wait(w.epfd, events, max_events, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            PLOG(ERROR) << "epoll_wait failed, I/O thread stopped";
+            break;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            void* tag = events[i].data.ptr;
+            if (tag == &w.wake_fd) {
+                uint64_t value;
+                while (::read(w.wake_fd, &value, sizeof(value)) > 0);
+                continue;
+            }
+            if (tag == &w.listen_fd) {
+                accept(w);
+                continue;
+            }
+
+            auto conn = static_cast<Connection*>(tag);
+            if (conn->socket() < 0)
+                continue;
+            if (conn->state == Connection::State::Handshake) {
+                handshake(w, conn);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT)
+                conn->flush();
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                read(w, conn);
+        }
+    }
+}
+
+void EpollTransport::accept(Worker& w)
+{
+    for (;;) {
+        int fd = accept4(w.listen_fd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                PLOG(WARNING) << "Can't accept connection";
+            }
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        SSL* ssl = nullptr;
+        if (secure()) {
+            ssl = SSL_new(tls_ctx);
+            if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1) {
+                LOG(ERROR) << "Can't create TLS session: " << tls_error();
+                SSL_free(ssl);
+                ::close(fd);
+                continue;
+            }
+            SSL_set_accept_state(ssl);
+        }
+
+        int id = ++last_id;
+        auto conn = new Connection(fd, id, w.epfd, settings.read_buffer, ssl);
+        w.connections.emplace(id, std::unique_ptr<Connection>(conn));
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        epoll_ctl(w.epfd, EPOLL_CTL_ADD, fd, &ev);
+
+        handler.connection_callback(conn, OFTransportConnection::EVENT_STARTED);
+
+        if (conn->state == Connection::State::Handshake) {
+            // Switch speaks first, nothing to do until it does
+            continue;
+        }
+        send_hello(conn);
+    }
+}
+
+void EpollTransport::handshake(Worker& w, Connection* conn)
+{
+    switch (conn->handshake()) {
+    case Connection::Handshake::Again:
+        return;
+    case Connection::Handshake::Failed:
+        finalize(w, conn, conn->dead ? OFTransportConnection::EVENT_DEAD
+                                     : OFTransportConnection::EVENT_CLOSED);
+        return;
+    case Connection::Handshake::Done:
+        break;
+    }
+
+    auto stats = conn->stats();
+    VLOG(1) << "Connection id=" << conn->id() << ": TLS established"
+            << (stats.resumed ? ", resumed" : "")
+            << (stats.ktls_tx ? ", kernel TLS tx" : "")
+            << (stats.ktls_rx ? ", kernel TLS rx" : "");
+
+    conn->state = Connection::State::Hello;
+    conn->last_rx = clock::now();
+    // Messages sent while handshaking
+    conn->flush();
+    send_hello(conn);
+}
+
+void EpollTransport::read(Worker& w, Connection* conn)
+{
+    // Keep room for the largest message
+    if (conn->rsize - conn->rend < max_message) {
+        std::memmove(conn->rbuf.get(), conn->rbuf.get() + conn->rbegin,
+                     conn->rend - conn->rbegin);
+        conn->rend -= conn->rbegin;
+        conn->rbegin = 0;
+    }
+
+    // Read once per event, so busy switches can't starve others
+    ssize_t n = conn->read_some(conn->rbuf.get() + conn->rend,
+                                conn->rsize - conn->rend);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) {
+        finalize(w, conn, conn->dead ? OFTransportConnection::EVENT_DEAD
+                                     : OFTransportConnection::EVENT_CLOSED);
+        return;
+    }
+    conn->rend += n;
+    conn->bytes_in.fetch_add(n, std::memory_order_relaxed);
+    conn->last_rx = clock::now();
+
+    while (conn->alive() && conn->rend - conn->rbegin >= header_len) {
+        uint8_t* msg = conn->rbuf.get() + conn->rbegin;
+        size_t len = load16(msg + 2);
+        if (len < header_len) {
+            LOG(WARNING) << "Connection id=" << conn->id()
+                         << " sent malformed message, closing it";
+            conn->close();
+            return;
+        }
+        if (conn->rend - conn->rbegin < len)
+            break;
+
+        conn->rbegin += len;
+        dispatch(conn, msg, len);
+    }
+
+    if (conn->rbegin == conn->rend) {
+        conn->rbegin = conn->rend = 0;
+    }
+
+    // epoll doesn't know about records OpenSSL has already read
+    if (conn->alive() && conn->pending()) {
+        read(w, conn);
+    }
+}
+
+void EpollTransport::dispatch(Connection* conn, uint8_t* msg, size_t len)
+{
+    uint8_t type = msg[1];
+    uint32_t xid = load32(msg + 4);
+
+    if (type == OFPT_ECHO_REQUEST) {
+        msg[1] = OFPT_ECHO_REPLY;
+        conn->send(msg, len);
+        return;
+    }
+    if (type == OFPT_ECHO_REPLY) {
+        if (conn->echo_pending && xid == echo_xid) {
+            auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+                           conn->last_rx - conn->echo_sent);
+            conn->echo_rtt_us.store(std::max<int64_t>(rtt.count(), 1),
+                                    std::memory_order_relaxed);
+            conn->echo_pending = false;
+        }
+        return;
+    }
+
+    switch (conn->state) {
+    case Connection::State::Handshake:
+        // Not reached, OpenFlow starts after the handshake
+        return;
+
+    case Connection::State::Hello:
+        if (type != OFPT_HELLO || not supports_of13(msg, len)) {
+            uint8_t error[header_len + 4];
+            header(error, OFPT_ERROR, sizeof(error), xid);
+            store16(error + header_len, OFPET_HELLO_FAILED);
+            store16(error + header_len + 2, OFPHFC_INCOMPATIBLE);
+            conn->send(error, sizeof(error));
+            handler.connection_callback(
+                conn, OFTransportConnection::EVENT_FAILED_NEGOTIATION);
+            conn->close();
+            return;
+        }
+        conn->negotiated_version = OFP_VERSION;
+        conn->state = Connection::State::Features;
+        {
+            uint8_t request[header_len];
+            header(request, OFPT_FEATURES_REQUEST, sizeof(request), 0);
+            conn->send(request, sizeof(request));
+        }
+        return;
+
+    case Connection::State::Features:
+        if (type != OFPT_FEATURES_REPLY)
+            return;
+        conn->state = Connection::State::Running;
+        handler.connection_callback(conn,
+                                    OFTransportConnection::EVENT_ESTABLISHED);
+        break;
+
+    case Connection::State::Running:
+        if (type == OFPT_HELLO)
+            return;
+        break;
+    }
+
+    handler.message_callback(conn, type, msg, len);
+}
+
+void EpollTransport::tick(Worker& w)
+{
+    w.released.clear();
+    std::swap(w.released, w.releasing);
+
+    auto now = clock::now();
+    auto interval = std::chrono::seconds(settings.echo_interval);
+
+    for (auto& entry : w.connections) {
+        Connection* conn = entry.second.get();
+        if (conn->state == Connection::State::Handshake) {
+            if (not conn->dead && now - conn->last_rx >= handshake_timeout) {
+                LOG(WARNING) << "Connection id=" << conn->id()
+                             << ": TLS handshake timed out";
+                conn->dead = true;
+                conn->close();
+            }
+            continue;
+        }
+        if (settings.echo_interval <= 0 || conn->dead)
+            continue;
+
+        if (settings.liveness_check && now - conn->last_rx >= 2 * interval) {
+            // Hangup is seen on the next loop iteration
+            conn->dead = true;
+            conn->close();
+        } else if (now - conn->echo_sent >= interval) {
+            // Busy connections are probed too, to measure round trip time.
+            // Unanswered request is replaced by the new one.
+            uint8_t echo[header_len];
+            header(echo, OFPT_ECHO_REQUEST, sizeof(echo), echo_xid);
+            conn->send(echo, sizeof(echo));
+            conn->echo_sent = now;
+            conn->echo_pending = true;
+        }
+    }
+}
+
+void EpollTransport::finalize(Worker& w, Connection* conn,
+                              OFTransportConnection::Event event)
+{
+    handler.connection_callback(conn, event);
+    conn->release();
+
+    auto it = w.connections.find(conn->id());
+    w.releasing.push_back(std::move(it->second));
+    w.connections.erase(it);
+}
+
+} // namespace runos
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "OFTransport.hh"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+struct ssl_ctx_st;
+
+namespace runos {
+
+/**
+ * OpenFlow 1.3 transport running an epoll loop per I/O thread.
+ *
+ * Every thread has its own listening socket bound to the same port
+ * with SO_REUSEPORT, so the kernel spreads incoming connections
+ * between threads and a connection is served by the thread which
+ * accepted it for its whole life.
+ *
+ * Messages are framed in place in a per-connection read buffer
+ * and passed to the handler without copying. Writes go straight
+ * to the socket, the rest is queued and flushed on EPOLLOUT.
+ *
+ * Secure connections are served by OpenSSL with a context shared
+ * by all threads. When OpenSSL and the kernel support it, record
+ * encryption is moved to kernel TLS after the handshake, and the
+ * socket is written and read as if it was a plain one.
+ */
+class EpollTransport final : public OFTransport {
+public:
+    EpollTransport(const Settings& settings, OFTransportHandler& handler);
+    ~EpollTransport();
+
+    bool start() override;
+    void stop() override;
+
+private:
+    struct Worker;
+    class Connection;
+
+    Settings settings;
+    OFTransportHandler& handler;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<int> last_id{0};
+    ssl_ctx_st* tls_ctx{nullptr};
+
+    bool secure() const;
+    bool listen(Worker& worker);
+    void run(Worker& worker);
+    void accept(Worker& worker);
+    void handshake(Worker& worker, Connection* conn);
+    void read(Worker& worker, Connection* conn);
+    void dispatch(Connection* conn, uint8_t* msg, size_t len);
+    void tick(Worker& worker);
+    void finalize(Worker& worker, Connection* conn,
+                  OFTransportConnection::Event event);
+};
+
+} // namespace runos
@@ -48,6 +48,14 @@ static bool equalflows(of13::FlowStats &one,
             );
 }
 
+// Flows differing in these can't be equal
+static uint64_t flowkey(of13::FlowStats &flow)
+{
+    return flow.cookie() ^
+           uint64_t(flow.table_id()) << 56 ^
+           uint64_t(flow.priority()) << 40;
+}
+
 uint64_t RuleIDs::last_event = 0;
 
 uint64_t RuleIDs::getLastID()
@@ -207,9 +215,6 @@ void FlowManager::init(Loader *loader, const Config &rootConfig)
 
     RestListener::get(loader)->registerRestHandler(this);
 
-    transaction = ctrl->registerStaticTransaction(this);
-    connect(transaction, &OFTransaction::response, this, &FlowManager::onResponse);
-
     acceptPath(Method::GET, "[0-9]+");
     acceptPath(Method::DELETE, "[0-9]+/[0-9]+");
 }
@@ -261,6 +266,9 @@ void FlowManager::onSwitchDown(Switch *dp)
 
 void FlowManager::cleanSwitchRules(Switch *dp)
 {
+    // Parts of the reply still in flight are ignored
+    polls.erase(dp->id());
+
     Rules rules = all_switches_rules[dp->id()];
     for (Rule* rule : rules) {
         addEvent(Event::Delete, rule);
@@ -269,28 +277,50 @@ void FlowManager::cleanSwitchRules(Switch *dp)
     all_switches_rules[dp->id()].clear();
 }
 
-void FlowManager::updateSwitchRules(Switch *dp,
-                    std::vector<of13::FlowStats> flows)
+void FlowManager::onFlowEntry(uint64_t dpid, uint64_t poll,
+                              of13::FlowStats& flow)
+{
+    auto it = polls.find(dpid);
+    if (it == polls.end() || it->second.id != poll)
+        return;
+
+    auto& unseen = it->second.unseen;
+    auto range = unseen.equal_range(flowkey(flow));
+    for (auto rule = range.first; rule != range.second; ++rule) {
+        if (equalflows(flow, rule->second->flow)) {
+            rule->second->seen = poll;
+            unseen.erase(rule);
+            return;
+        }
+    }
+
+    Rule *rule = new Rule(dpid, flow);
+    rule->seen = poll;
+    all_switches_rules[dpid].push_back(rule);
+    addEvent(Event::Add, rule);
+}
+
+void FlowManager::onFlowPollDone(uint64_t dpid, uint64_t poll, bool complete)
 {
-    Rules& rules = all_switches_rules[dp->id()];
+    auto it = polls.find(dpid);
+    if (it == polls.end() || it->second.id != poll)
+        return;
+    polls.erase(it);
+
+    // Rules missing from a partial reply may still be on the switch
+    if (not complete)
+        return;
+
+    Rules& rules = all_switches_rules[dpid];
     auto end = std::remove_if(rules.begin(), rules.end(),
-        [&flows, this](Rule *rule)->bool{
-            for (auto it = flows.begin(); it != flows.end(); it++){
-                if (equalflows(*it,rule->flow)){
-                    flows.erase(it);
-                    return false;
-                }
-            }
+        [poll, this](Rule *rule)->bool{
+            if (rule->seen == poll)
+                return false;
             addEvent(Event::Delete, rule);
             rule->active = false;
             return true;
         });
     rules.erase(end, rules.end());
-    for (auto flow : flows){
-        Rule *rule = new Rule(dp->id(), flow);
-        rules.push_back(rule);
-        addEvent(Event::Add, rule);
-    }
 }
 
 void FlowManager::onSwitchUp(Switch* dp)
@@ -350,6 +380,11 @@ void FlowManager::timerEvent(QTimerEvent *)
 }
 
 void FlowManager::sendFlowRequest(Switch* dp){
+    uint64_t dpid = dp->id();
+    // Don't pile up requests to a switch with a huge table
+    if (polls.count(dpid))
+        return;
+
     of13::MultipartRequestFlow mprf;
     mprf.table_id(of13::OFPTT_ALL);
     mprf.out_port(of13::OFPP_ANY);
@@ -357,11 +392,23 @@ void FlowManager::sendFlowRequest(Switch* dp){
     mprf.cookie(0x0);  // match: cookie & mask == field.cookie & mask
     mprf.cookie_mask(0x0);
     mprf.flags(0);
-    transaction->request(dp->connection(), mprf);
-}
 
-void FlowManager::onResponse(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> _reply){
-    of13::MultipartReplyFlow reply = _reply->multipartReplyFlow;
-    Switch *sw = sw_m->getSwitch(conn->dpid());
-    updateSwitchRules(sw, reply.flow_stats());
+    uint64_t poll = ++last_poll;
+    Poll& state = polls[dpid];
+    state.id = poll;
+    state.unseen.clear();
+    for (Rule* rule : all_switches_rules[dpid]) {
+        state.unseen.emplace(flowkey(rule->flow), rule);
+    }
+
+    bool sent = ctrl->requestEntries<of13::FlowStats>(dp->connection(), mprf, this,
+        [this, poll](SwitchConnectionPtr conn, of13::FlowStats& flow) {
+            onFlowEntry(conn->dpid(), poll, flow);
+        },
+        [this, poll](SwitchConnectionPtr conn, bool complete) {
+            onFlowPollDone(conn->dpid(), poll, complete);
+        });
+    if (not sent) {
+        polls.erase(dpid);
+    }
 }
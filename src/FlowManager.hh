@@ -54,6 +54,8 @@ private:
 
     of13::FlowStats flow;
     bool active;
+    // Last poll which found the rule on the switch
+    uint64_t seen{0};
     void action_list(ActionList acts, std::vector<int> &out_port,
                    json11::Json::array &sets) const;
     json11::Json::object SetField(of13::OXMTLV *) const;
@@ -93,7 +95,6 @@ public:
 
 protected slots:
     void onSwitchDown(Switch* dp);
-    void onResponse(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> reply);
     void onSwitchUp(Switch* dp);
 protected:
     void deleteRule(Switch *sw, Rule* rule);
@@ -111,7 +112,17 @@ private:
     std::unordered_map<uint64_t, Rules> all_switches_rules;
     //std::unordered_map<Flow*, Rule*> all_flows_rules;
 
+    // Flow stats request in progress, entries are matched to known
+    // rules as reply parts arrive
+    struct Poll {
+        uint64_t id;
+        // Known rules not yet found in the reply, by flowkey()
+        std::unordered_multimap<uint64_t, Rule*> unseen;
+    };
+    std::unordered_map<uint64_t, Poll> polls;
+    uint64_t last_poll{0};
+
     void cleanSwitchRules(Switch  *dp);
-    void updateSwitchRules(Switch *dp, std::vector<of13::FlowStats> flows);
-    OFTransaction* transaction;
+    void onFlowEntry(uint64_t dpid, uint64_t poll, of13::FlowStats& flow);
+    void onFlowPollDone(uint64_t dpid, uint64_t poll, bool complete);
 };
@@ -35,6 +35,8 @@ REGISTER_APPLICATION(HostManager, {"maple","switch-manager", "rest-listener", ""
 struct HostImpl {
     uint64_t id;
     std::string mac;
+    // Location is updated by Maple workers while others read it
+    mutable std::mutex mutex;
     ipv4addr ip;
     uint64_t switchID;
     uint32_t switchPort;
@@ -63,13 +65,22 @@ std::string Host::mac() const
 { return m->mac; }
 
 std::string Host::ip() const
-{ return boost::lexical_cast<std::string>(m->ip); }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    return boost::lexical_cast<std::string>(m->ip);
+}
 
 uint64_t Host::switchID() const
-{ return m->switchID; }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    return m->switchID;
+}
 
 uint32_t Host::switchPort() const
-{ return m->switchPort; }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    return m->switchPort;
+}
 
 json11::Json Host::to_json() const
 {
@@ -100,16 +111,28 @@ json11::Json Host::formFloodlightJSON()
 }
 
 void Host::switchID(uint64_t id)
-{ m->switchID = id; }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    m->switchID = id;
+}
 
 void Host::switchPort(uint32_t port)
-{ m->switchPort = port; }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    m->switchPort = port;
+}
 
 void Host::ip(std::string ip)
-{ m->ip = ipv4addr(ip); }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    m->ip = ipv4addr(ip);
+}
 
 void Host::ip(ipv4addr ip)
-{ m->ip = ipv4addr(ip); }
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    m->ip = ipv4addr(ip);
+}
 
 HostManager::HostManager()
 {
@@ -145,30 +168,37 @@ void HostManager::init(Loader *loader, const Config &config)
                     host_ip = ipv4addr(tpkt.watch(ofb_arp_spa));
                 }
 
-                if (isSwitch(host_mac))
-                    return decision;
-
                 uint32_t in_port = tpkt.watch(ofb_in_port);
-                if (in_port > of13::OFPP_MAX)
-                    return decision;
-
-                if (not findMac(host_mac)) {
-                    Switch* sw =
-                        m_switch_manager->getSwitch(tpkt.watch(of_switch_id));
-                    addHost(sw, host_ip, host_mac, in_port);
+                uint64_t dpid = tpkt.watch(of_switch_id);
+
+                // Called by Maple workers of different switches at once
+                Host* discovered = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (isSwitch(host_mac))
+                        return decision;
+
+                    if (in_port > of13::OFPP_MAX)
+                        return decision;
+
+                    auto it = m->hosts.find(host_mac);
+                    if (it == m->hosts.end()) {
+                        discovered = addHost(dpid, host_ip, host_mac, in_port);
+                    } else if (host_ip != "0.0.0.0") {
+                        it->second->ip(host_ip);
+                    }
+                }
 
+                if (discovered) {
                     LOG(INFO) << "Host discovered. MAC: " << host_mac
                               << ", IP: " << host_ip
-                              << ", Switch ID: " << sw->id() << ", port: " << in_port;
-                } else {
-                    Host* h = getHost(host_mac);
-                    if (host_ip != "0.0.0.0") {
-                        h->ip(host_ip);
-                    }
+                              << ", Switch ID: " << dpid << ", port: " << in_port;
+                    emit hostDiscovered(discovered);
                 }
 
                 return decision;
-        }
+        }, { ofb_in_port, ofb_eth_type, ofb_eth_src,
+             ofb_ipv4_src, ofb_arp_spa, of_switch_id }
     );
 
     QObject::connect(m_switch_manager, &SwitchManager::switchDiscovered,
@@ -187,6 +217,7 @@ void HostManager::onSwitchDiscovered(Switch* dp)
 
 void HostManager::onSwitchDown(Switch *dp)
 {
+    std::lock_guard<std::mutex> lock(mutex);
     delHostForSwitch(dp);
     for (of13::Port port : dp->ports()) {
         auto pos = std::find(switch_macs.begin(), switch_macs.end(), port.hw_addr().to_string());
@@ -195,15 +226,14 @@ void HostManager::onSwitchDown(Switch *dp)
     }
 }
 
-void HostManager::addHost(Switch* sw, ipv4addr ip, std::string mac, uint32_t port)
+// Must be called with mutex held, caller emits hostDiscovered
+Host* HostManager::addHost(uint64_t dpid, ipv4addr ip, std::string mac, uint32_t port)
 {
-    std::lock_guard<std::mutex> lk(mutex);
-
     Host* dev = createHost(mac, ip);
-    attachHost(mac, sw->id(), port);
+    attachHost(mac, dpid, port);
     addEvent(Event::Add, dev);
     dev->connectedSince(time(NULL));
-    emit hostDiscovered(dev);
+    return dev;
 }
 
 Host* HostManager::createHost(std::string mac, ipv4addr ip)
@@ -213,13 +243,6 @@ Host* HostManager::createHost(std::string mac, ipv4addr ip)
     return dev;
 }
 
-bool HostManager::findMac(std::string mac)
-{
-    if (m->hosts.count(mac) > 0)
-        return true;
-    return false;
-}
-
 bool HostManager::isSwitch(std::string mac)
 {
     for (auto sw_mac : switch_macs) {
@@ -250,6 +273,7 @@ void HostManager::delHostForSwitch(Switch *dp)
 
 Host* HostManager::getHost(std::string mac)
 {
+    std::lock_guard<std::mutex> lock(mutex);
     if (m->hosts.count(mac) > 0)
         return m->hosts[mac];
     else
@@ -259,6 +283,7 @@ Host* HostManager::getHost(std::string mac)
 Host* HostManager::getHost(ipv4addr ip)
 {
     auto string_ip = boost::lexical_cast<std::string>(ip);
+    std::lock_guard<std::mutex> lock(mutex);
     for (auto it : m->hosts) {
         if (it.second->ip() == string_ip)
             return it.second;
@@ -268,11 +293,13 @@ Host* HostManager::getHost(ipv4addr ip)
 
 void HostManager::newPort(Switch *, of13::Port port)
 {
+    std::lock_guard<std::mutex> lock(mutex);
     switch_macs.push_back(port.hw_addr().to_string());
 }
 
 std::unordered_map<std::string, Host*> HostManager::hosts()
 {
+    std::lock_guard<std::mutex> lock(mutex);
     return m->hosts;
 }
 
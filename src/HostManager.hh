@@ -92,11 +92,11 @@ private:
     struct HostManagerImpl* m;
     std::vector<std::string> switch_macs;
     SwitchManager* m_switch_manager;
+    // Guards hosts and switch_macs, the handler runs on Maple workers
     std::mutex mutex;
 
-    void addHost(Switch* sw, ipv4addr ip, std::string mac, uint32_t port);
+    Host* addHost(uint64_t dpid, ipv4addr ip, std::string mac, uint32_t port);
     Host* createHost(std::string mac, ipv4addr ip);
-    bool findMac(std::string mac);
     bool isSwitch(std::string mac);
     void attachHost(std::string mac, uint64_t id, uint32_t port);
     void delHostForSwitch(Switch* dp);
@@ -147,7 +147,7 @@ void LinkDiscovery::init(Loader *loader, const Config &rootConfig)
                 return decision
                     .inspect(sizeof(lldp_packet), handler)
                     .return_();
-        });
+        }, { ofb_eth_type });
 }
 
 void LinkDiscovery::startUp(Loader *)
@@ -285,6 +285,7 @@ void LinkDiscovery::timerEvent(QTimerEvent*)
     }
 
     // Send LLDP packets to all known links
+    SendBatch batch;
     for (Switch* sw : m_switch_manager->switches()) {
         for (of13::Port &port : sw->ports()) {
             if (port.port_no() > of13::OFPP_MAX)
@@ -18,6 +18,7 @@
 
 #include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <mutex>
 #include <thread>
@@ -25,6 +26,9 @@
 #include <memory>
 #include <functional>
 #include <iterator>
+#include <queue>
+#include <chrono>
+#include <atomic>
 
 #include <boost/assert.hpp>
 #include <boost/variant/apply_visitor.hpp>
@@ -43,6 +47,8 @@
 #include "Flow.hh"
 #include "PacketParser.hh"
 #include "FluidOXMAdapter.hh"
+#include "OFEncode.hh"
+#include "ShardedExecutor.hh"
 
 //hash for pairs
 namespace std{
@@ -108,9 +114,21 @@ struct unhandled_packet: runtime_error
 {
 };
 
+// Packed packet-out waiting for the rules it relies on
+struct DeferredPacketOut {
+    SwitchConnectionPtr conn;
+    std::vector<uint8_t> data;
+};
+
+class InstallGroup;
+
 class FlowImpl final : public Flow
                      , public maple::Flow
 {
+public:
+    typedef std::chrono::steady_clock clock;
+
+private:
     struct SwitchInfo
     {
         SwitchConnectionPtr conn;
@@ -137,21 +155,52 @@ class FlowImpl final : public Flow
     std::unordered_map<uint64_t, SwitchInfo> m_switches;
 
     uint8_t m_table{0};
+    uint32_t m_meter{0}; // meter instruction, 0 for none
+    // Inspected packets may be forwarded later by packet-out,
+    // so they are sent in full by switches without buffers
+    bool m_forwardable{false};
+    // Switches don't notify us about removal, expire it by our clock
+    clock::time_point m_deadline{clock::time_point::max()};
     Decision m_decision {DecisionImpl()};
     oxm::field_set m_mods;
 
     maple::Installer m_installer; // Installer of flow through maple trace tree
     //underlying installed by install method
 
+    // Sent by install after its rules are confirmed by barriers
+    std::vector<DeferredPacketOut> m_packet_outs;
+
+    // Actions of the rules installed by the last activate()
+    struct FastPath {
+        std::unordered_map<uint64_t, ActionList> actions;
+        std::weak_ptr<InstallGroup> group;
+    };
+    // Read by I/O threads with std::atomic_load, never copied
+    struct FastPathRef {
+        std::shared_ptr<const FastPath> ptr;
+
+        FastPathRef() = default;
+        FastPathRef(const FastPathRef&) { }
+        FastPathRef& operator=(const FastPathRef&)
+        {
+            std::atomic_store(&ptr, std::shared_ptr<const FastPath>());
+            return *this;
+        }
+    };
+    std::unordered_map<uint64_t, ActionList> m_installed;
+    FastPathRef m_fast_path;
+
     bool installTrigger{false}; // true if flow is installing now
     friend class MapleBackend; // need diactivate this trigger, on miss flow
 
     class DecisionCompiler : public boost::static_visitor<void> {
         ActionList& ret;
         uint64_t dpid;
+        bool full_packet;
     public:
-        explicit DecisionCompiler(ActionList& ret, uint64_t dpid)
-            : ret(ret), dpid(dpid)
+        explicit DecisionCompiler(ActionList& ret, uint64_t dpid,
+                                  bool full_packet = false)
+            : ret(ret), dpid(dpid), full_packet(full_packet)
         { }
 
         void operator()(const Decision::Undefined&) const
@@ -183,7 +232,8 @@ class FlowImpl final : public Flow
         {
             DVLOG(30) << "Added rule inpecting. Len : " << int(i.send_bytes_len);
             ret.add_action(new of13::OutputAction(of13::OFPP_CONTROLLER,
-                                                  i.send_bytes_len));
+                        full_packet ? uint16_t(of13::OFPCML_NO_BUFFER)
+                                    : i.send_bytes_len));
         }
 
         void operator()(const Decision::Custom& c) const
@@ -200,51 +250,73 @@ class FlowImpl final : public Flow
             ret.add_action(new of13::SetFieldAction(new FluidOXMAdapter(f)));
         }
 
-        boost::apply_visitor(DecisionCompiler(ret, dpid), m_decision.data());
+        bool full_packet = m_forwardable &&
+                           not m_switches.at(dpid).conn->buffered();
+        boost::apply_visitor(DecisionCompiler(ret, dpid, full_packet),
+                             m_decision.data());
         return ret;
     }
 
     void packet_out(uint16_t priority,
                     const oxm::field_set& match,
-                    uint64_t dpid)
+                    uint64_t dpid,
+                    bool defer = false)
     {
         auto &scope = m_switches.at(dpid);
         if (scope.packet_in){
-            of13::PacketOut po;
-            po.xid(scope.xid);
-            po.buffer_id(scope.buffer_id);
-            po.actions(actions(dpid));
-            po.in_port(scope.in_port);
+            ActionList acts = actions(dpid);
+            OFEncode::PacketOut po;
+            po.xid = scope.xid;
+            po.buffer_id = scope.buffer_id;
+            po.actions = &acts;
+            po.in_port = scope.in_port;
 
             if (scope.buffer_id == OFP_NO_BUFFER && scope.packet_data != nullptr) {
-                po.data(scope.packet_data, scope.data_len);
+                po.data = scope.packet_data;
+                po.data_len = scope.data_len;
             }
 
-            scope.conn->send(po);
+            size_t len = OFEncode::length(po);
+            if (defer) {
+                // packet data is owned by packet-in, pack it now
+                std::vector<uint8_t> packed(len);
+                OFEncode::encode(po, packed.data());
+                m_packet_outs.push_back({scope.conn, std::move(packed)});
+            } else {
+                scope.conn->send(len, [&po](uint8_t* buf) {
+                    OFEncode::encode(po, buf);
+                });
+            }
 
             scope.packet_data = nullptr;
             scope.data_len = 0;
             }
     }
 
-    void flow_mod(uint16_t priority,
-                  const oxm::field_set& match,
-                  uint64_t dpid)
+    // Sends the rule, returns its actions
+    ActionList flow_mod(uint16_t priority,
+                        const oxm::field_set& match,
+                        uint64_t dpid,
+                        uint8_t command = of13::OFPFC_ADD)
     {
         using std::chrono::duration_cast;
         using std::chrono::seconds;
         auto &scope = m_switches.at(dpid);
-        of13::FlowMod fm;
+        of13::Match of_match = make_of_match(match);
+        ActionList ret = actions(dpid);
+        OFEncode::FlowMod fm;
 
-        fm.command(of13::OFPFC_ADD);
-        fm.xid(scope.xid);
+        fm.command = command;
+        fm.xid = scope.xid;
 
-        fm.buffer_id(scope.buffer_id);
+        // Buffered packet is released by the deferred packet-out,
+        // after the rules downstream are confirmed too
+        fm.buffer_id = OFP_NO_BUFFER;
 
-        fm.table_id(m_table);
-        fm.priority(priority);
-        fm.cookie(cookie());
-        fm.match(make_of_match(match));
+        fm.table_id = m_table;
+        fm.priority = priority;
+        fm.cookie = cookie();
+        fm.match = &of_match;
 
         auto ito = m_decision.idle_timeout();
         auto hto = m_decision.hard_timeout();
@@ -252,29 +324,39 @@ class FlowImpl final : public Flow
         long long hto_seconds = duration_cast<seconds>(hto).count();
 
         if (ito == Decision::duration::max())
-            fm.idle_timeout(0);
+            fm.idle_timeout = 0;
         else
-            fm.idle_timeout(std::min(ito_seconds, 65535LL));
+            fm.idle_timeout = std::min(ito_seconds, 65535LL);
 
         if (hto == Decision::duration::max())
-            fm.hard_timeout(0);
+            fm.hard_timeout = 0;
         else
-            fm.hard_timeout(std::min(hto_seconds, 65535LL));
+            fm.hard_timeout = std::min(hto_seconds, 65535LL);
 
-        fm.flags( of13::OFPFF_CHECK_OVERLAP |
-                  of13::OFPFF_SEND_FLOW_REM );
+        uint16_t flags = of13::OFPFF_CHECK_OVERLAP;
+        if (send_flow_removed())
+            flags |= of13::OFPFF_SEND_FLOW_REM;
+        fm.flags = flags;
 
-        of13::ApplyActions applyActions;
-        applyActions.actions(actions(dpid));
-        fm.add_instruction(applyActions);
+        // Switches without meters would refuse the rule
+        if (m_meter && scope.conn->meters()) {
+            fm.meter = m_meter;
+        }
+        fm.actions = &ret;
 
-        scope.conn->send(fm);
+        // Encoded straight into the batch of the switch
+        scope.conn->send(OFEncode::length(fm), [&fm](uint8_t* buf) {
+            OFEncode::encode(fm, buf);
+        });
+        return ret;
     }
 
 public:
-    void install(uint16_t priority,
+    // Returns true if the rule was sent, `sent` gets its actions
+    bool install(uint16_t priority,
                  const oxm::field_set& match,
-                 uint64_t dpid)
+                 uint64_t dpid,
+                 ActionList& sent)
     {
         BOOST_ASSERT(installTrigger);
 
@@ -284,30 +366,59 @@ public:
         auto& scope = m_switches.at(dpid);
 
         if (state() == State::Evicted && not scope.packet_in)
-            return;
+            return false;
 
+        bool sent_rule = false;
         if (m_decision.idle_timeout() <= Decision::duration::zero()) {
             packet_out(priority, match, dpid);
         } else {
-            if (scope.packet_in && scope.buffer_id == OFP_NO_BUFFER) {
-                // Send packet if buffer is not supported
-                packet_out(priority, match, dpid);
+            if (scope.packet_in) {
+                // Send packet, by its buffer_id or data,
+                // when switches on its path have the rules
+                packet_out(priority, match, dpid, /* defer: */ true);
             }
-            flow_mod(priority, match, dpid);
+            sent = flow_mod(priority, match, dpid);
+            sent_rule = true;
+            if (not boost::get<Decision::Inspect>(&m_decision.data()) &&
+                not m_installed.count(dpid))
+                m_installed.emplace(dpid, sent);
         }
 
         scope.packet_in = false;
         scope.xid = 0;
         scope.buffer_id = OFP_NO_BUFFER;
         scope.in_port = of13::OFPP_CONTROLLER;
+        return sent_rule;
     }
 
-    void install(uint16_t priority,
+    bool install(uint16_t priority,
                  const oxm::field_set& match,
-                 SwitchConnectionPtr conn)
+                 SwitchConnectionPtr conn,
+                 ActionList& sent)
+    {
+        m_switches.emplace(conn->dpid(), conn);
+        return install(priority, match, conn->dpid(), sent);
+    }
+
+    // Changes actions of the rule sent by install() before
+    void modify(uint16_t priority,
+                const oxm::field_set& match,
+                SwitchConnectionPtr conn)
     {
         m_switches.emplace(conn->dpid(), conn);
-        install(priority, match, conn->dpid());
+        flow_mod(priority, match, conn->dpid(), of13::OFPFC_MODIFY_STRICT);
+    }
+
+    // Whether install() would send a rule to the switch,
+    // `actions` get its actions
+    bool rule(SwitchConnectionPtr conn, ActionList& actions)
+    {
+        if (state() == State::Evicted ||
+            m_decision.idle_timeout() <= Decision::duration::zero())
+            return false;
+        m_switches.emplace(conn->dpid(), conn);
+        actions = this->actions(conn->dpid());
+        return true;
     }
 
     void installer(maple::Installer installer)
@@ -315,8 +426,17 @@ public:
         m_installer = std::move(installer);
     }
 
+    std::vector<DeferredPacketOut> take_packet_outs()
+    {
+        std::vector<DeferredPacketOut> ret;
+        ret.swap(m_packet_outs);
+        return ret;
+    }
+
     void activate()
     {
+        withdraw();
+        m_installed.clear();
         installTrigger = true;
         m_installer();
         if (not disposable()) {
@@ -325,12 +445,74 @@ public:
             m_state = State::Evicted;
         }
         installTrigger = false;
+
+        auto hto = m_decision.hard_timeout();
+        if (send_flow_removed() || hto == Decision::duration::max()) {
+            m_deadline = clock::time_point::max();
+        } else {
+            // switch counts it in whole seconds
+            m_deadline = clock::now() + std::min(hto, Decision::duration(65535));
+        }
+    }
+
+    // Lets I/O threads answer packets of the flow by the installed
+    // actions until `group` is confirmed, see answer()
+    void publish(const std::shared_ptr<InstallGroup>& group)
+    {
+        if (not group || m_state != State::Active || m_installed.empty())
+            return;
+        auto fast = std::make_shared<FastPath>();
+        fast->actions.swap(m_installed);
+        fast->group = group;
+        std::atomic_store(&m_fast_path.ptr,
+                          std::shared_ptr<const FastPath>(std::move(fast)));
+    }
+
+    void withdraw()
+    {
+        std::atomic_store(&m_fast_path.ptr, std::shared_ptr<const FastPath>());
+    }
+
+    // Called on I/O thread
+    bool answer(of13::PacketIn& pi, SwitchConnectionPtr conn) const;
+
+    // Expire flow removed by hard timeout without notifying us
+    bool expire(clock::time_point now)
+    {
+        if (m_state == State::Active && m_deadline <= now)
+            m_state = State::Expired;
+        return m_state == State::Expired;
+    }
+
+    clock::time_point deadline() const
+    { return m_deadline; }
+
+    bool notify_removed() const
+    { return m_decision.notify_removed(); }
+
+    // Switches report removal of the rules. Flows expiring by idle
+    // timeout only can't be expired by our clock, they need it too.
+    bool send_flow_removed() const
+    {
+        return m_decision.notify_removed() ||
+               (m_decision.hard_timeout() == Decision::duration::max() &&
+                m_decision.idle_timeout() != Decision::duration::max());
     }
 
     explicit FlowImpl(uint8_t table)
         : m_table(table)
     { }
 
+    void meter(uint32_t meter_id)
+    {
+        m_meter = meter_id;
+    }
+
+    void forwardable(bool forwardable)
+    {
+        m_forwardable = forwardable;
+    }
+
     void mods(oxm::field_set mod)
     {
         BOOST_ASSERT(state() != State::Active);
@@ -340,6 +522,7 @@ public:
     void decision(Decision d)
     {
         //BOOST_ASSERT(state() != State::Active);
+        withdraw();
         m_decision = std::move(d);
     }
 
@@ -373,6 +556,7 @@ public:
 
     void flow_removed(of13::FlowRemoved& fr)
     {
+        withdraw();
         switch (fr.reason()) {
         case of13::OFPRR_DELETE:
         case of13::OFPRR_METER_DELETE:
@@ -413,6 +597,15 @@ public:
         }
     }
 
+    // Ingress port of the decision on every switch it spans
+    std::vector<std::pair<uint64_t, uint32_t>> in_ports()
+    {
+        if (auto custom = boost::get<Decision::Custom>(&m_decision.data())) {
+            return custom->body->in_ports();
+        }
+        return {};
+    }
+
     std::vector<std::pair<oxm::field<>,
                           oxm::field<>>>
     virtual_fields(oxm::mask<> by, oxm::mask<> what) const override
@@ -443,10 +636,117 @@ typedef std::weak_ptr<FlowImpl> FlowImplWeakPtr;
 
 
 
+// Packet-outs held until every switch confirmed the rules
+// installed together with them
+class InstallGroup {
+    std::mutex mutex;
+    size_t remaining;
+    std::vector<DeferredPacketOut> packet_outs;
+    // Set when a switch rejected the bundle carrying the rules,
+    // its reply comes before the barrier one
+    std::shared_ptr<std::atomic<bool>> rejected;
+
+    bool dropped() const
+    { return rejected && rejected->load(); }
+
+public:
+    explicit InstallGroup(size_t switches,
+                          std::shared_ptr<std::atomic<bool>> rejected = nullptr)
+        : remaining(switches), rejected(std::move(rejected))
+    { }
+
+    static void send(std::vector<DeferredPacketOut>& packet_outs)
+    {
+        for (auto& po : packet_outs) {
+            po.conn->send(po.data.data(), po.data.size());
+        }
+    }
+
+    // Called on I/O threads. Failed barriers release packets too,
+    // packets of a rejected bundle are dropped.
+    void confirmed()
+    {
+        std::vector<DeferredPacketOut> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--remaining > 0)
+                return;
+            ready.swap(packet_outs);
+        }
+        if (dropped()) {
+            VLOG(5) << "Dropping " << ready.size()
+                    << " packet-outs of the rejected bundle";
+            return;
+        }
+        send(ready);
+    }
+
+    void defer(std::vector<DeferredPacketOut>& more)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (remaining > 0) {
+                std::move(more.begin(), more.end(),
+                          std::back_inserter(packet_outs));
+                return;
+            }
+        }
+        if (not dropped())
+            send(more);
+    }
+
+    // Called on I/O threads.
+    // @return false if the rules are already confirmed
+    bool hold(DeferredPacketOut po)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (remaining == 0 || dropped())
+            return false;
+        packet_outs.push_back(std::move(po));
+        return true;
+    }
+};
+
+bool FlowImpl::answer(of13::PacketIn& pi, SwitchConnectionPtr conn) const
+{
+    auto fast = std::atomic_load(&m_fast_path.ptr);
+    if (not fast)
+        return false;
+    auto group = fast->group.lock();
+    auto actions = fast->actions.find(conn->dpid());
+    if (not group || actions == fast->actions.end())
+        return false;
+
+    of13::PacketOut po;
+    po.xid(pi.xid());
+    po.buffer_id(pi.buffer_id());
+    po.actions(actions->second);
+    po.in_port(pi.match().in_port()->value());
+    if (pi.buffer_id() == OFP_NO_BUFFER) {
+        po.data(pi.data(), pi.data_len());
+    }
+
+    uint8_t* buf = po.pack();
+    DeferredPacketOut deferred {conn, std::vector<uint8_t>(buf, buf + po.length())};
+    OFMsg::free_buffer(buf);
+    return group->hold(std::move(deferred));
+}
+
 class MapleBackend : public maple::Backend {
     std::unordered_map<uint64_t, SwitchConnectionPtr> connections;
     uint8_t table{0};
     FlowImplPtr miss;
+    Controller* ctrl;
+
+    // Switches got flow-mods since the last barrier
+    std::unordered_set<uint64_t> touched;
+    // Barriers of the current install
+    std::shared_ptr<InstallGroup> pending;
+    // Modifications of switches supporting bundles, see begin_bundle
+    std::unique_ptr<SendBundle> bundle;
+    unsigned bundle_depth{0};
+    // Rejection flag of the last committed bundle for the next barrier
+    std::shared_ptr<std::atomic<bool>> bundle_rejected;
 
     //set of miss rules by their identificator and hash
     // hash by string : match={...}prio=...
@@ -454,6 +754,31 @@ class MapleBackend : public maple::Backend {
     mutable std::unordered_set<std::pair<uint64_t, size_t>> miss_rules;
     std::unordered_map<uint64_t, SwitchConnectionPtr> conections;
 
+    // Rule as it was sent to a switch
+    struct ShadowRule {
+        unsigned priority;
+        oxm::field_set match;
+        std::vector<uint8_t> actions; // packed
+    };
+    // Rules of a flow on a switch by rule_key()
+    typedef std::unordered_map<std::string, ShadowRule> ShadowRules;
+    // Rules by cookie and switch
+    typedef std::unordered_map<uint64_t,
+                std::unordered_map<uint64_t, ShadowRules>> ShadowTable;
+
+    // Rules sent to switches and not deleted since. Rules removed
+    // by timeouts stay here until their flows are forgotten.
+    ShadowTable shadow;
+    // Rules of reconnected switches kept without wipe, moved back
+    // to the shadow when the switch reports them, see reconciled()
+    ShadowTable reconciling;
+    // Switches which may have rules missing in the shadow
+    std::unordered_set<uint64_t> unknown;
+    // Rules given since begin_sync() and their flows,
+    // null if not syncing
+    std::unique_ptr<ShadowTable> wanted;
+    std::unordered_map<uint64_t, FlowImplPtr> wanted_flows;
+
     oxm::switch_id of_switch_id = oxm::switch_id();
 
     static FlowImplPtr flow_cast(maple::FlowPtr flow)
@@ -474,9 +799,10 @@ class MapleBackend : public maple::Backend {
                 switches.insert(sw.first);
             }
         } else {
-            // decision define switches
+            // decision define switches, other shards serve the rest
             for (auto sw : flow->switches()){
-                switches.insert(sw);
+                if (connections.count(sw))
+                    switches.insert(sw);
             }
         }
         auto ids = matchs.included().equal_range(of_switch_id);
@@ -505,21 +831,285 @@ class MapleBackend : public maple::Backend {
         return std::move(result);
     }
 
+    static std::string rule_key(unsigned priority,
+                                oxm::field_set const& match)
+    {
+        std::stringstream tmp;
+        tmp << "prio=" << priority
+            << "match={" << match << "}";
+        return tmp.str();
+    }
+
+    static void put(ShadowTable& table, uint64_t cookie, uint64_t dpid,
+                    unsigned priority, oxm::field_set const& match,
+                    ActionList& actions)
+    {
+        std::vector<uint8_t> packed(actions.length());
+        actions.pack(packed.data());
+        table[cookie][dpid][rule_key(priority, match)]
+            = ShadowRule{priority, match, std::move(packed)};
+    }
+
+    static const ShadowRules* find(const ShadowTable& table,
+                                   uint64_t cookie, uint64_t dpid)
+    {
+        auto flow = table.find(cookie);
+        if (flow == table.end())
+            return nullptr;
+        auto sw = flow->second.find(dpid);
+        if (sw == flow->second.end())
+            return nullptr;
+        return &sw->second;
+    }
+
+    static void erase(ShadowTable& table, uint64_t cookie, uint64_t dpid,
+                      const std::string& key)
+    {
+        auto flow = table.find(cookie);
+        if (flow == table.end())
+            return;
+        auto sw = flow->second.find(dpid);
+        if (sw == flow->second.end())
+            return;
+        sw->second.erase(key);
+        if (sw->second.empty())
+            flow->second.erase(sw);
+        if (flow->second.empty())
+            table.erase(flow);
+    }
+
+    void erase(uint64_t cookie, uint64_t dpid, const std::string& key)
+    {
+        erase(shadow, cookie, dpid, key);
+        erase(reconciling, cookie, dpid, key);
+    }
+
+    // Moves rules of the switch to `to`, drops them if it's null
+    static void take(ShadowTable& from, uint64_t dpid, ShadowTable* to)
+    {
+        for (auto it = from.begin(); it != from.end(); ) {
+            auto sw = it->second.find(dpid);
+            if (sw != it->second.end()) {
+                if (to)
+                    (*to)[it->first].emplace(dpid, std::move(sw->second));
+                it->second.erase(sw);
+            }
+            if (it->second.empty())
+                it = from.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    // Drops rules of the switch from the shadow
+    void erase(uint64_t dpid)
+    {
+        take(shadow, dpid, nullptr);
+        take(reconciling, dpid, nullptr);
+    }
+
+    // Matches are compared encoded, fields parsed from
+    // a switch reply aren't the ones we've sent
+    static bool same_match(const oxm::field_set& match,
+                           of13::Match reported)
+    {
+        of13::Match ours = make_of_match(match);
+        if (ours.length() != reported.length())
+            return false;
+        std::vector<uint8_t> a(ours.length()), b(reported.length());
+        ours.pack(a.data());
+        reported.pack(b.data());
+        return a == b;
+    }
+
+    void delete_rule(uint64_t dpid, uint64_t cookie,
+                     unsigned priority, oxm::field_set const& match)
+    {
+        DVLOG(20) << "Removing prio=" << priority
+                  << ", match={" << match << "}"
+                  << " cookie = " << std::setbase(16) << cookie
+                  << " on switch " << std::setbase(10) << dpid;
+
+        of13::FlowMod fm;
+        fm.command(of13::OFPFC_DELETE_STRICT);
+        fm.table_id(table);
+        fm.priority(priority);
+        fm.cookie(cookie);
+        fm.cookie_mask(~0ULL);
+        fm.match(make_of_match(match));
+        fm.out_port(of13::OFPP_ANY);
+        fm.out_group(of13::OFPG_ANY);
+        if (auto conn = connection(dpid)) {
+            conn->send(fm);
+            touched.insert(dpid);
+        }
+    }
+
+    // Deletes rules installed by install() for the flow
+    void remove_rules(unsigned priority,
+                      oxm::expirementer::full_field_set const& _matchs,
+                      FlowImplPtr flow)
+    {
+        std::set<uint64_t> switches = compute_switches(_matchs, flow);
+        auto matchs = _matchs;
+        matchs.erase(oxm::mask<>(of_switch_id));
+        for (uint64_t dpid : switches) {
+            for (auto& match : matchs.included().fields()) {
+                delete_rule(dpid, flow->cookie(), priority, match);
+                erase(flow->cookie(), dpid, rule_key(priority, match));
+            }
+        }
+    }
+
+    // Deletes rules of all flows matching `match`
+    void wipe(uint64_t dpid, oxm::field_set const& match)
+    {
+        of13::FlowMod fm;
+        fm.command(of13::OFPFC_DELETE);
+
+        fm.table_id(table);
+        fm.cookie(Flow::cookie_space().first);
+        fm.cookie_mask(Flow::cookie_space().second);
+        fm.match(make_of_match(match));
+
+        fm.out_port(of13::OFPP_ANY);
+        fm.out_group(of13::OFPG_ANY);
+
+        if (auto conn = connection(dpid)) {
+            conn->send(fm);
+            touched.insert(dpid);
+        }
+
+        erase(dpid);
+        // Shadow can't tell which rules the match covers
+        if (not match.empty())
+            unknown.insert(dpid);
+    }
+
+    bool switch_test(oxm::field<> const& test) const
+    {
+        oxm::type test_type = test.type();
+        return test_type.ns() == of_switch_id.ns() &&
+               test_type.id() == of_switch_id.id();
+    }
+
+    // id for same rule with different switches
+    static std::pair<uint64_t, size_t>
+    barrier_id(unsigned priority,
+               oxm::expirementer::full_field_set const& match,
+               uint64_t id)
+    {
+        std::stringstream tmp;
+        tmp << "match={" << match << "}"
+            << "prio=" << priority;
+        return {id, std::hash<std::string>()(tmp.str())};
+    }
+
 public:
-    explicit MapleBackend(uint8_t table)
-        : table(table), miss{new FlowImpl(table) }
+    // Called on I/O thread when a live switch answered the bundle
+    // commit with an error and its rules have to be installed again
+    std::function<void(uint64_t dpid)> bundle_failed;
+
+    MapleBackend(uint8_t table, uint32_t miss_meter, Controller* ctrl)
+        : table(table), miss{new FlowImpl(table) }, ctrl(ctrl)
+    {
+        miss_send_len(128);
+        // Missed packets go through the pipeline and may be sent back
+        miss->forwardable(true);
+        // Barrier rules send misses to controller, limit them
+        // by the same meter as switch table-miss
+        miss->meter(miss_meter);
+    }
+
+    // Bytes of missed packet sent by barrier rules
+    void miss_send_len(uint16_t len)
+    {
+        miss->decision( DecisionImpl{}.inspect(len,
+                    [](Packet&, FlowPtr){return false;} ));
+    }
+
+    // Null if the switch isn't served by this backend
+    SwitchConnectionPtr connection(uint64_t dpid) const
+    {
+        auto it = connections.find(dpid);
+        return it != connections.end() ? it->second : nullptr;
+    }
+
+    // Switch without `wiped` tables keeps rules reconciliation doesn't
+    // delete, they are known again as the switch reports them
+    void add_switch(SwitchConnectionPtr conn, bool wiped)
+    {
+        uint64_t dpid = conn->dpid();
+        connections.emplace(dpid, conn);
+        if (wiped) {
+            forget_switch(dpid);
+        } else {
+            take(reconciling, dpid, nullptr);
+            take(shadow, dpid, &reconciling);
+        }
+    }
+
+    // Entry of the reconnected switch is kept, so is its rule
+    void reconciled(uint64_t dpid, of13::FlowStats& entry)
+    {
+        auto flow = reconciling.find(entry.cookie());
+        if (flow == reconciling.end())
+            return;
+        auto sw = flow->second.find(dpid);
+        if (sw == flow->second.end())
+            return;
+        for (auto it = sw->second.begin(); it != sw->second.end(); ++it) {
+            if (it->second.priority != entry.priority() ||
+                not same_match(it->second.match, entry.match()))
+                continue;
+            shadow[flow->first][dpid].insert(std::move(*it));
+            sw->second.erase(it);
+            if (sw->second.empty())
+                flow->second.erase(sw);
+            if (flow->second.empty())
+                reconciling.erase(flow);
+            return;
+        }
+    }
+
+    // Rules of the switch are replaced by the next sync,
+    // e.g. after it rejected a bundle
+    void forget_switch(uint64_t dpid)
     {
-        miss->decision( DecisionImpl{}.inspect(128,
-                    [](Packet&, FlowPtr){return false;} )); // TODO: unhardcode
+        erase(dpid);
+        unknown.insert(dpid);
     }
 
-    void add_switch(SwitchConnectionPtr conn)
+    // Flow has no rules on switches anymore
+    void forget_flow(uint64_t cookie)
     {
-        connections.emplace(conn->dpid(), conn);
+        shadow.erase(cookie);
+        reconciling.erase(cookie);
     }
 
     uint64_t miss_cookie() const { return miss->cookie(); }
 
+    // Barriers of the last install, null if it sent no rules
+    const std::shared_ptr<InstallGroup>& install_group() const
+    { return pending; }
+
+    void begin_install()
+    {
+        pending.reset();
+    }
+
+    // Send packet-outs after the barriers of the current install
+    void release(std::vector<DeferredPacketOut> packet_outs)
+    {
+        if (packet_outs.empty())
+            return;
+        if (pending) {
+            pending->defer(packet_outs);
+        } else {
+            InstallGroup::send(packet_outs);
+        }
+    }
+
     virtual void install(unsigned priority,
                          oxm::expirementer::full_field_set const& _matchs,
                          maple::FlowPtr flow_) override
@@ -533,12 +1123,27 @@ public:
         auto matchs = _matchs;
         matchs.erase(oxm::mask<>(of_switch_id));
         for (uint64_t dpid : switches){
+            auto conn = connection(dpid);
+            if (not conn)
+                continue;
             for (auto& match : matchs.included().fields()){
+                ActionList actions;
+                if (wanted) {
+                    // Sent by end_sync() if switch doesn't have it
+                    if (flow->rule(conn, actions)) {
+                        put(*wanted, flow->cookie(), dpid, priority, match, actions);
+                        wanted_flows.emplace(flow->cookie(), flow);
+                    }
+                    continue;
+                }
                 DVLOG(20) << "Installing prio=" << priority
                          << ", match={" << match << "}"
                          << " => cookie = " << std::setbase(16) << flow->cookie() << " on switch " << dpid;
-                flow->install(priority, match, connections[dpid]);
+                if (flow->install(priority, match, conn, actions))
+                    put(shadow, flow->cookie(), dpid, priority, match, actions);
             }
+            if (not wanted)
+                touched.insert(dpid);
         }
     }
 
@@ -547,21 +1152,10 @@ public:
                               oxm::field<> const& test,
                               uint64_t id)
     {
-        oxm::type test_type = test.type();
-        if (test_type.ns() == of_switch_id.ns() &&
-            test_type.id () == of_switch_id.id()){
+        if (switch_test(test))
             return;
-        }
-        size_t hash;
-        std::stringstream tmp;
-        tmp << "match={" << match << "}"
-            << "prio="<<priority;
-        std::string tmp_str = tmp.str();
-        std::hash<std::string> tmp_hash;
-        hash = tmp_hash(tmp_str);
 
-        // id for same rule with different switches
-        std::pair<uint64_t, size_t> full_id = {id, hash};
+        auto full_id = barrier_id(priority, match, id);
         auto it = miss_rules.find(full_id);
         if (it == miss_rules.end()){
             DVLOG(20) << "barrier rule install"
@@ -574,6 +1168,39 @@ public:
         }
     }
 
+    virtual void remove_barrier_rule(unsigned priority,
+                                     oxm::expirementer::full_field_set const& _matchs,
+                                     oxm::field<> const& test,
+                                     uint64_t id) override
+    {
+        if (switch_test(test))
+            return;
+        // Rule may be installed while the cache was cleared
+        miss_rules.erase(barrier_id(priority, _matchs, id));
+
+        remove_rules(priority, _matchs, miss);
+    }
+
+    void remove(unsigned priority,
+                oxm::expirementer::full_field_set const& matchs,
+                maple::FlowPtr flow) override
+    {
+        remove_rules(priority, matchs, flow_cast(flow));
+    }
+
+    void reinstall(unsigned priority,
+                   oxm::expirementer::full_field_set const& matchs,
+                   maple::FlowPtr flow_) override
+    {
+        auto flow = flow_cast(flow_);
+        // Rules of other flows have expired or weren't installed
+        if (flow->state() != Flow::State::Active || flow->disposable())
+            return;
+        flow->installTrigger = true;
+        install(priority, matchs, flow);
+        flow->installTrigger = false;
+    }
+
     void remove(oxm::field_set const& _match) override
     {
         DVLOG(20) << "Removing flows matching {" << _match << "}" << " on switch ";
@@ -584,24 +1211,14 @@ public:
         auto match = _match;
         match.erase(oxm::mask<>(of_switch_id));
 
-        of13::FlowMod fm;
-        fm.command(of13::OFPFC_DELETE);
-
-        fm.table_id(table);
-        fm.cookie(Flow::cookie_space().first);
-        fm.cookie_mask(Flow::cookie_space().second);
-        fm.match(make_of_match(match));
-
-        fm.out_port(of13::OFPP_ANY);
-        fm.out_group(of13::OFPG_ANY);
-
         auto dpid = _match.load(oxm::mask<>(of_switch_id));
         if (dpid.wildcard()){
-            for (auto& conn : connections)
-                conn.second->send(fm);
+            for (auto& conn : connections) {
+                wipe(conn.first, match);
+            }
         } else {
             auto tmp = bits<64>(dpid.value_bits());
-            connections[tmp.to_ullong()]->send(fm);
+            wipe(tmp.to_ullong(), match);
         }
     }
 
@@ -629,13 +1246,31 @@ public:
         fm.out_port(of13::OFPP_ANY);
         fm.out_group(of13::OFPG_ANY);
 
+        std::vector<uint64_t> switches;
         auto dpid = _match.load(oxm::mask<>(of_switch_id));
         if (dpid.wildcard()){
-            for (auto& conn : connections)
-                conn.second->send(fm);
+            for (auto& conn : connections) {
+                switches.push_back(conn.first);
+            }
         } else {
             auto tmp = bits<64>(dpid.value_bits());
-            connections[tmp.to_ullong()]->send(fm);
+            switches.push_back(tmp.to_ullong());
+        }
+
+        std::vector<uint64_t> cookies;
+        for (auto& flow : shadow) {
+            cookies.push_back(flow.first);
+        }
+        auto key = rule_key(priority, match);
+        for (uint64_t sw : switches) {
+            auto conn = connection(sw);
+            if (not conn)
+                continue; // served by other shard
+            conn->send(fm);
+            touched.insert(sw);
+            for (uint64_t cookie : cookies) {
+                erase(cookie, sw, key);
+            }
         }
     }
 
@@ -660,13 +1295,152 @@ public:
 
         for (auto conn : connections){
             conn.second->send(fm);
+            touched.insert(conn.first);
+        }
+        forget_flow(flow->cookie());
+    }
+
+    void begin_sync() override
+    {
+        wanted.reset(new ShadowTable);
+        wanted_flows.clear();
+        // Every barrier rule is given again
+        miss_rules.clear();
+    }
+
+    // Rules of the shadow missing in `wanted` are deleted, then
+    // new rules are added and the ones with other actions modified.
+    // Unknown switches lose all our rules and get the wanted ones,
+    // rules of reconnected switches not reported yet are added again.
+    void end_sync() override
+    {
+        if (not wanted)
+            return;
+        std::unique_ptr<ShadowTable> next = std::move(wanted);
+        std::unordered_map<uint64_t, FlowImplPtr> flows;
+        flows.swap(wanted_flows);
+
+        size_t deleted = 0, added = 0, modified = 0;
+
+        for (uint64_t dpid : unknown) {
+            if (connections.count(dpid))
+                wipe(dpid, oxm::field_set{});
         }
+        for (auto& flow : shadow) {
+            uint64_t cookie = flow.first;
+            for (auto& sw : flow.second) {
+                uint64_t dpid = sw.first;
+                if (unknown.count(dpid) || not connections.count(dpid))
+                    continue;
+                const ShadowRules* keep = find(*next, cookie, dpid);
+                for (auto& rule : sw.second) {
+                    if (keep && keep->count(rule.first))
+                        continue;
+                    delete_rule(dpid, cookie,
+                                rule.second.priority, rule.second.match);
+                    ++deleted;
+                }
+            }
+        }
+        // New rule may take place of the deleted one
+        barrier();
+
+        for (auto& flow : *next) {
+            FlowImplPtr impl = flows.at(flow.first);
+            for (auto& sw : flow.second) {
+                uint64_t dpid = sw.first;
+                auto conn = connection(dpid);
+                if (not conn)
+                    continue;
+                const ShadowRules* had = unknown.count(dpid) ? nullptr
+                                       : find(shadow, flow.first, dpid);
+                for (auto& rule : sw.second) {
+                    auto it = had ? had->find(rule.first)
+                                  : ShadowRules::const_iterator();
+                    if (had && it != had->end()) {
+                        if (it->second.actions == rule.second.actions)
+                            continue;
+                        impl->modify(rule.second.priority,
+                                     rule.second.match, conn);
+                        ++modified;
+                    } else {
+                        ActionList actions;
+                        impl->installTrigger = true;
+                        impl->install(rule.second.priority,
+                                      rule.second.match, conn, actions);
+                        impl->installTrigger = false;
+                        ++added;
+                    }
+                    touched.insert(dpid);
+                }
+            }
+        }
+
+        shadow.swap(*next);
+        unknown.clear();
+        // Rules not reported until now were added again
+        reconciling.clear();
+        VLOG(10) << "Synced rules: " << added << " added, "
+                 << modified << " modified, " << deleted << " deleted";
+    }
+
+    void begin_bundle() override
+    {
+        // Nested bundles join the outermost one
+        if (bundle_depth++ == 0)
+            bundle.reset(new SendBundle);
+    }
+
+    void commit_bundle() override
+    {
+        if (bundle_depth == 0 || --bundle_depth > 0)
+            return;
+        auto failed = bundle_failed;
+        auto rejected = std::make_shared<std::atomic<bool>>(false);
+        bundle_rejected = rejected;
+        // Lost switches get their rules again when they reconnect
+        ctrl->commitBundle(*bundle,
+                [failed, rejected](uint64_t dpid, BundleResult result) {
+            if (result != BundleResult::Rejected)
+                return;
+            rejected->store(true);
+            if (failed)
+                failed(dpid);
+        });
+        bundle.reset();
     }
 
     void barrier() override
     {
-        for (auto conn : connections){
-            conn.second->send(of13::BarrierRequest());
+        // Switches not modified since the last barrier don't need one.
+        // Bundle keeps its messages in order, switches collecting one
+        // get the barrier after commit.
+        std::vector<SwitchConnectionPtr> targets;
+        size_t missing = 0;
+        auto rejected = std::move(bundle_rejected);
+        for (auto it = touched.begin(); it != touched.end(); ) {
+            auto conn = connections.find(*it);
+            if (conn == connections.end()) {
+                ++missing;
+            } else if (bundle && conn->second->bundles()) {
+                ++it;
+                continue;
+            } else {
+                targets.push_back(conn->second);
+            }
+            it = touched.erase(it);
+        }
+        if (targets.empty() && missing == 0)
+            return;
+
+        auto group = std::make_shared<InstallGroup>(targets.size() + missing,
+                                                    std::move(rejected));
+        pending = group;
+        for (size_t i = 0; i < missing; ++i) {
+            group->confirmed();
+        }
+        for (auto& conn : targets) {
+            ctrl->barrier(conn, [group](bool) { group->confirmed(); });
         }
     }
 };
@@ -674,32 +1448,113 @@ public:
 typedef boost::error_info< struct tag_pi_handler, std::string >
     errinfo_packetin_handler;
 
+/*
+ * Independent Maple instance serving a subset of switches.
+ * All methods are called from the single worker thread owning the shard,
+ * so backend, trace tree and flows need no locking.
+ */
+struct MapleShard {
+    const MapleImpl& owner;
+    MapleBackend backend;
+    maple::Runtime<DecisionImpl, FlowImpl> runtime;
+    std::unordered_map<uint64_t, FlowImplPtr> flows;
+    uint8_t handler_table;
+
+    // Hard timeouts of flows switches don't report removal of,
+    // entry may be outdated if flow was installed again
+    typedef std::pair<FlowImpl::clock::time_point, uint64_t> Deadline;
+    std::priority_queue<Deadline, std::vector<Deadline>,
+                        std::greater<Deadline>> deadlines;
+
+    MapleShard(const MapleImpl& owner, uint8_t handler_table, uint32_t miss_meter);
+
+    bool isTableMiss(of13::PacketIn& pi) const
+    {
+        if (pi.reason() == of13::OFPR_NO_MATCH)
+            return true;
+        if (pi.reason() == of13::OFPR_ACTION &&
+            pi.cookie() == backend.miss_cookie())
+            return true;
+        return false;
+    }
+
+    void processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connection);
+    void installRoute(of13::PacketIn& pi, uint64_t dpid);
+    bool answerPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connection);
+    void processFlowRemoved(of13::FlowRemoved& fr);
+    void expireFlows();
+    void reconcile(SwitchConnectionPtr conn,
+                   std::vector<of13::FlowStats>& entries);
+
+private:
+    void installRemote(const FlowImplPtr& flow, of13::PacketIn& pi,
+                       uint64_t from);
+
+    void activate(const FlowImplPtr& flow)
+    {
+        backend.begin_install();
+        flow->activate();
+        backend.release(flow->take_packet_outs());
+        flow->publish(backend.install_group());
+        if (flow->deadline() != FlowImpl::clock::time_point::max())
+            deadlines.emplace(flow->deadline(), flow->cookie());
+    }
+};
+
 struct runos::MapleImpl {
     bool started{false};
     Maple &app;
+    Controller* ctrl{nullptr};
     Config config;
 
-    MapleBackend backend;
-    maple::Runtime<DecisionImpl, FlowImpl> runtime;
     PacketMissPipeline pipeline;
-    std::unordered_map<uint64_t, FlowImplPtr> flows;
     uint8_t handler_table;
 
     std::unordered_map<std::string, PacketMissHandler> handlers;
+    // Bytes of packet read by handler, missing if not declared
+    std::unordered_map<std::string, size_t> handler_depth;
+
+    std::vector<std::unique_ptr<MapleShard>> shards;
+    // Time spent by a shard on trace tree gc every second
+    std::chrono::milliseconds gc_budget{2};
+    // Declared last to join workers before shards are destroyed
+    std::unique_ptr<ShardedExecutor> workers;
 
     MapleImpl(Maple& maple,
               uint8_t handler_table=0)
         : app(maple)
-        , backend{handler_table}
-        , runtime{std::bind(&MapleImpl::process, this, _1, _2), backend}
         , handler_table(handler_table)
     {  }
 
-    void createSwitchScope(SwitchConnectionPtr conn)
+    void startWorkers(unsigned nthreads, uint32_t miss_meter)
     {
-        backend.add_switch(conn);
+        workers.reset(new ShardedExecutor(nthreads, "maple"));
+        for (unsigned i = 0; i < workers->size(); ++i) {
+            shards.emplace_back(new MapleShard(*this, handler_table, miss_meter));
+            // Switch falls back to barriers, its rules are installed
+            // again without the rejected bundle
+            shards.back()->backend.bundle_failed = [this](uint64_t dpid) {
+                dispatch(dpid, [dpid](MapleShard& shard) {
+                    shard.backend.forget_switch(dpid);
+                    shard.runtime.commit();
+                });
+            };
+        }
     }
 
+    // Run fn on the worker owning the switch.
+    // Preserves order of calls made for the same dpid from one thread.
+    void dispatch(uint64_t dpid, std::function<void(MapleShard&)> fn) const
+    {
+        unsigned i = workers->shard(dpid);
+        MapleShard* shard = shards[i].get();
+        workers->post(i, [shard, fn]() {
+            // Flow-mods, packet-outs and barriers of one packet-in
+            // go to the switch in a single write
+            SendBatch batch;
+            fn(*shard);
+        });
+    }
 
     DecisionImpl process(Packet& pkt, FlowImplPtr flow) const
     {
@@ -717,21 +1572,31 @@ struct runos::MapleImpl {
         return ret;
     }
 
-    bool isTableMiss(of13::PacketIn& pi) const
+    // Bytes of missed packet needed by the pipeline, 0 if unknown
+    size_t pipelineDepth() const
     {
-        if (pi.reason() == of13::OFPR_NO_MATCH)
-            return true;
-        if (pi.reason() == of13::OFPR_ACTION &&
-            pi.cookie() == backend.miss_cookie())
-            return true;
-        return false;
+        size_t ret = 0;
+        for (auto& handler: pipeline) {
+            auto it = handler_depth.find(handler.first);
+            if (it == handler_depth.end()) {
+                LOG(WARNING) << "Packet-in handler " << handler.first
+                             << " doesn't declare fields it reads";
+                return 0;
+            }
+            ret = std::max(ret, it->second);
+        }
+        return ret;
     }
-
-    void processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connection);
-    void processFlowRemoved(of13::FlowRemoved& fr);
 };
 
-void MapleImpl::processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connection)
+MapleShard::MapleShard(const MapleImpl& owner, uint8_t handler_table, uint32_t miss_meter)
+    : owner(owner)
+    , backend{handler_table, miss_meter, owner.ctrl}
+    , runtime{std::bind(&MapleImpl::process, &owner, _1, _2), backend}
+    , handler_table(handler_table)
+{ }
+
+void MapleShard::processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connection)
 {
     DVLOG(10) << "Packet-in on switch " << connection->dpid()
               << (isTableMiss(pi) ? " (miss)" : " (inspect)");
@@ -744,7 +1609,7 @@ void MapleImpl::processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connecti
     DVLOG(30) << "flow cookie is : " << std::setbase(16)
               << flow->cookie() << " packet cookie : " << pi.cookie();
     // Delete flow if it doesn't found or expired
-    if (flow == nullptr || flow->state() == Flow::State::Expired) {
+    if (flow == nullptr || flow->expire(FlowImpl::clock::now())) {
         flow = std::make_shared<FlowImpl>(handler_table);
         flows[flow->cookie()] = flow;
     }
@@ -781,7 +1646,8 @@ void MapleImpl::processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connecti
             }
             flow->mods( std::move(mpkt.mods()) );
             flow->installer(installer);
-            flow->activate(); // this is needed way to install flow
+            activate(flow); // this is needed way to install flow
+            installRemote(flow, pi, connection->dpid());
         }
         break;
 
@@ -791,15 +1657,16 @@ void MapleImpl::processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connecti
 
         case Flow::State::Active:
         {
-            DLOG_IF(ERROR, isTableMiss(pi))
+            // Flow removed silently by idle timeout or deletion
+            DLOG_IF(ERROR, isTableMiss(pi) && flow->notify_removed())
                 << "Table-miss on active non-inspect flow, "
                 << "cookie = " << std::setbase(16) << flow->cookie()
                 << ", reason = " << unsigned(pi.reason()) << " disposable : " << flow->disposable();
             // BOOST_ASSERT(not isTableMiss(pi));
             if (not isTableMiss(pi)){
-                flow->decision(process(pkt, flow));
+                flow->decision(owner.process(pkt, flow));
             } else {
-                flow->activate();
+                activate(flow);
             }
             // Maybe this packet arrived on switch when maple reload table, but may be from remowed flows
             // TODO: implement FSM of flow
@@ -809,7 +1676,137 @@ void MapleImpl::processPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connecti
     }
 }
 
-void MapleImpl::processFlowRemoved(of13::FlowRemoved& fr)
+// A shard installs rules only on its own switches. Switches of a route
+// served by other shards get their part from those shards at once,
+// as if the packet arrived there, rather than on their own miss.
+void MapleShard::installRemote(const FlowImplPtr& flow, of13::PacketIn& pi,
+                               uint64_t from)
+{
+    // Disposable decisions install nothing
+    if (flow->disposable())
+        return;
+
+    const ShardedExecutor& workers = *owner.workers;
+    for (auto& hop : flow->in_ports()) {
+        uint64_t dpid = hop.first;
+        if (workers.shard(dpid) == workers.shard(from))
+            continue;
+
+        auto remote = std::make_shared<of13::PacketIn>(
+                0, OFP_NO_BUFFER, pi.total_len(), of13::OFPR_NO_MATCH,
+                pi.table_id(), pi.cookie());
+        remote->add_oxm_field(new of13::InPort(hop.second));
+        remote->data(pi.data(), pi.data_len());
+
+        owner.dispatch(dpid, [remote, dpid](MapleShard& shard) {
+            shard.installRoute(*remote, dpid);
+        });
+    }
+}
+
+// Same as processPacketIn without the packet, which is already
+// forwarded by the shard it arrived to
+void MapleShard::installRoute(of13::PacketIn& pi, uint64_t dpid)
+{
+    if (not backend.connection(dpid))
+        return;
+
+    PacketParser pkt { pi, dpid };
+    std::shared_ptr<FlowImpl> flow = runtime(pkt);
+    if (flow == nullptr || flow->expire(FlowImpl::clock::now())) {
+        flow = std::make_shared<FlowImpl>(handler_table);
+        flows[flow->cookie()] = flow;
+    }
+
+    switch (flow->state()) {
+    case Flow::State::Egg:
+    case Flow::State::Idle:
+    case Flow::State::Evicted:
+        break;
+    default:
+        return;
+    }
+
+    DVLOG(10) << "Installing route part on switch " << dpid;
+    ModTrackingPacket mpkt {pkt};
+    maple::Installer installer;
+    try {
+        std::tie(flow, installer) = runtime.augment(mpkt, flow);
+    } catch (maple::priority_exceeded& e) {
+        // Switch gets the rules on its own miss
+        return;
+    }
+    flow->mods( std::move(mpkt.mods()) );
+    flow->installer(installer);
+    activate(flow);
+}
+
+// Called on I/O thread. Packets of a flow missing its rules while they
+// are being installed are sent after the rules without the worker,
+// which would install them again otherwise.
+bool MapleShard::answerPacketIn(of13::PacketIn& pi, SwitchConnectionPtr connection)
+{
+    if (not isTableMiss(pi))
+        return false;
+    try {
+        PacketParser pkt { pi, connection->dpid() };
+        std::shared_ptr<FlowImpl> flow = runtime(pkt);
+        return flow && flow->answer(pi, connection);
+    } catch (...) {
+        // worker reports it
+        return false;
+    }
+}
+
+void MapleShard::expireFlows()
+{
+    auto now = FlowImpl::clock::now();
+    while (not deadlines.empty() && deadlines.top().first <= now) {
+        auto it = flows.find(deadlines.top().second);
+        deadlines.pop();
+        if (it != flows.end() && it->second->expire(now)) {
+            backend.forget_flow(it->first);
+            flows.erase(it);
+        }
+    }
+}
+
+// Delete entries of flows we don't know or have expired,
+// e.g. installed before the switch reconnected.
+// Rules of kept entries are known to the backend again.
+void MapleShard::reconcile(SwitchConnectionPtr conn,
+                           std::vector<of13::FlowStats>& entries)
+{
+    auto now = FlowImpl::clock::now();
+    size_t removed = 0;
+
+    for (of13::FlowStats& entry : entries) {
+        auto it = flows.find(entry.cookie());
+        if (entry.cookie() == backend.miss_cookie() ||
+            (it != flows.end() && not it->second->expire(now))) {
+            backend.reconciled(conn->dpid(), entry);
+            continue;
+        }
+
+        of13::FlowMod fm;
+        fm.command(of13::OFPFC_DELETE_STRICT);
+        fm.table_id(entry.table_id());
+        fm.priority(entry.priority());
+        fm.cookie(entry.cookie());
+        fm.cookie_mask(~0ULL);
+        fm.match(entry.match());
+        fm.buffer_id(OFP_NO_BUFFER);
+        fm.out_port(of13::OFPP_ANY);
+        fm.out_group(of13::OFPG_ANY);
+        conn->send(fm);
+        ++removed;
+    }
+
+    LOG(INFO) << "Reconciled flows of switch " << conn->dpid() << ": "
+              << entries.size() - removed << " kept, " << removed << " removed";
+}
+
+void MapleShard::processFlowRemoved(of13::FlowRemoved& fr)
 {
     auto it = flows.find( fr.cookie() );
     if (it == flows.end())
@@ -817,8 +1814,13 @@ void MapleImpl::processFlowRemoved(of13::FlowRemoved& fr)
     auto flow = it->second;
 
     flow->flow_removed(fr);
-    if (flow->state() == Flow::State::Expired)
+    // Idle flow is traced again by its next packet,
+    // so gc() may prune its leaf meanwhile
+    if (flow->state() == Flow::State::Expired ||
+        flow->state() == Flow::State::Idle) {
+        backend.forget_flow(it->first);
         flows.erase(it);
+    }
 }
 
 
@@ -828,19 +1830,65 @@ void Maple::init(Loader* loader, const Config& root_config)
     uint8_t handler_table = ctrl->getTable("maple");
     impl.reset(new MapleImpl(*this, handler_table));
     impl->config = config_cd(root_config, "maple");
-    ctrl->registerHandler<of13::PacketIn>(
-            [=](of13::PacketIn &pi, SwitchConnectionPtr conn){
-                //TODO : create a copy of packetIn
-                impl->processPacketIn(pi, conn);
+
+    // One worker per OpenFlow I/O thread unless configured explicitly
+    int nthreads = config_get(impl->config, "nthreads",
+            config_get(config_cd(root_config, "controller"), "nthreads", 4));
+    impl->ctrl = ctrl;
+    impl->startWorkers(std::max(nthreads, 1), ctrl->packetInMeter());
+    LOG(INFO) << "Maple uses " << impl->shards.size() << " worker threads";
+    impl->gc_budget = std::chrono::milliseconds(
+            config_get(impl->config, "gc-budget", 2));
+
+    // Flow-removed is requested only by decisions needing it and
+    // flows expiring by idle timeout, see FlowImpl::send_flow_removed
+    ctrl->subscribeAsync(of13::OFPT_PACKET_IN,
+                         1 << of13::OFPR_NO_MATCH | 1 << of13::OFPR_ACTION);
+    ctrl->subscribeAsync(of13::OFPT_FLOW_REMOVED,
+                         1 << of13::OFPRR_IDLE_TIMEOUT |
+                         1 << of13::OFPRR_HARD_TIMEOUT |
+                         1 << of13::OFPRR_DELETE |
+                         1 << of13::OFPRR_GROUP_DELETE |
+                         1 << of13::OFPRR_METER_DELETE);
+
+    // Flows of reconnected switch are checked by its shard
+    auto cookie_space = Flow::cookie_space();
+    ctrl->registerCookieSpace(cookie_space.first, cookie_space.second,
+            [=](SwitchConnectionPtr conn, std::vector<of13::FlowStats> entries){
+                auto shared = std::make_shared<std::vector<of13::FlowStats>>(
+                        std::move(entries));
+                impl->dispatch(conn->dpid(), [conn, shared](MapleShard& shard){
+                    shard.reconcile(conn, *shared);
+                });
+            });
+
+    // Switch gets rules only after controller's table setup, which
+    // would delete them. Packet-in's come after the setup's table-miss,
+    // so registration is queued to the shard before them.
+    ctrl->registerSetupHandler(
+            [=](SwitchConnectionPtr conn, bool wiped){
+                impl->dispatch(conn->dpid(), [conn, wiped](MapleShard& shard){
+                    shard.backend.add_switch(conn, wiped);
+                });
+            });
+    ctrl->registerSharedHandler<of13::PacketIn>(
+            [=](std::shared_ptr<OFMsgUnion> msg, SwitchConnectionPtr conn){
+                auto& shard = *impl->shards[impl->workers->shard(conn->dpid())];
+                if (shard.answerPacketIn(msg->packetIn, conn))
+                    return;
+                impl->dispatch(conn->dpid(), [msg, conn](MapleShard& shard){
+                    shard.processPacketIn(msg->packetIn, conn);
+                });
             });
-    ctrl->registerHandler<of13::FlowRemoved>(
-            [=](of13::FlowRemoved &fr, SwitchConnectionPtr conn){
-                impl->processFlowRemoved(fr);
+    ctrl->registerSharedHandler<of13::FlowRemoved>(
+            [=](std::shared_ptr<OFMsgUnion> msg, SwitchConnectionPtr conn){
+                impl->dispatch(conn->dpid(), [msg](MapleShard& shard){
+                    shard.processFlowRemoved(msg->flowRemoved);
+                });
             });
-    QObject::connect(ctrl, &Controller::switchUp, this, &Maple::onSwitchUp);
 }
 
-void Maple::startUp(Loader*)
+void Maple::startUp(Loader* loader)
 {
     auto config = impl->config;
 
@@ -859,12 +1907,39 @@ void Maple::startUp(Loader*)
     }
     // TODO: print unused handlers
 
+    // Ask switches for as much of missed packets as pipeline reads
+    auto ctrl = Controller::get(loader);
+    if (size_t depth = impl->pipelineDepth()) {
+        // Table-miss rule of the last table sends packets to us too
+        for (uint8_t table : { impl->handler_table, ctrl->maxTable() }) {
+            ctrl->requireMissSendLen(table, depth);
+        }
+    }
+    uint16_t miss_send_len = ctrl->missSendLen(impl->handler_table);
+    for (unsigned i = 0; i < impl->shards.size(); ++i) {
+        MapleShard* shard = impl->shards[i].get();
+        impl->workers->post(i, [shard, miss_send_len]() {
+            shard->backend.miss_send_len(miss_send_len);
+        });
+    }
+    LOG(INFO) << "Maple reads " << miss_send_len << " bytes of missed packets";
+
+    startTimer(1000);
     impl->started = true;
 }
 
-void Maple::onSwitchUp(SwitchConnectionPtr conn, of13::FeaturesReply fr)
+void Maple::timerEvent(QTimerEvent*)
 {
-    impl->createSwitchScope(conn);
+    for (unsigned i = 0; i < impl->shards.size(); ++i) {
+        MapleShard* shard = impl->shards[i].get();
+        auto gc_budget = impl->gc_budget;
+        impl->workers->post(i, [shard, gc_budget]() {
+            shard->expireFlows();
+            // Deletions of barrier rules go in a single write
+            SendBatch batch;
+            shard->runtime.gc(gc_budget);
+        });
+    }
 }
 
 void Maple::registerHandler(const char* name,
@@ -879,4 +1954,18 @@ void Maple::registerHandler(const char* name,
     impl->handlers[std::string(name)] = handler;
 }
 
+void Maple::registerHandler(const char* name,
+                            PacketMissHandler handler,
+                            std::initializer_list<oxm::type> reads)
+{
+    registerHandler(name, handler);
+
+    // Always keep the link layer header
+    size_t depth = PacketParser::header_depth(oxm::eth_type());
+    for (oxm::type field : reads) {
+        depth = std::max(depth, PacketParser::header_depth(field));
+    }
+    impl->handler_depth[std::string(name)] = depth;
+}
+
 Maple::~Maple() = default;
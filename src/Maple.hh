@@ -15,10 +15,13 @@
  */
 
 #pragma once
+#include <initializer_list>
+
 #include "Application.hh"
 #include "Loader.hh"
 #include "Controller.hh"
 #include "Common.hh"
+#include "oxm/type.hh"
 
 namespace runos {
 
@@ -30,9 +33,20 @@ public:
     /**
     * Registers new message handler for each worker thread.
     * Used for performance-critical message processing, such as packet-in's.
+    * Switches are sharded between workers by dpid, so handler may be
+    * called concurrently for packets from different switches.
     */
     void registerHandler(const char* name, PacketMissHandler factory);
 
+    /**
+    * Registers handler reading only `reads` fields of the packet.
+    * Switches are asked to send to controller as much of missed packets
+    * as the configured pipeline reads, see Controller::missSendLen.
+    * Pipeline with a handler registered without fields gets the default.
+    */
+    void registerHandler(const char* name, PacketMissHandler factory,
+                         std::initializer_list<oxm::type> reads);
+
     /**
      *  Get number of Maple's table
      */
@@ -47,8 +61,11 @@ public:
     void init(Loader *loader, const Config& config) override;
     void startUp(Loader *loader) override;
     void process(const of13::PacketIn &pi, SwitchConnectionPtr conn);
-public slots:
-    void onSwitchUp(SwitchConnectionPtr conn, of13::FeaturesReply fr);
+
+protected:
+    // Forget flows expired on switches silently
+    void timerEvent(QTimerEvent*) override;
+
 private:
     std::unique_ptr<class MapleImpl> impl;
 };
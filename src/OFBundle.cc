@@ -0,0 +1,122 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "OFBundle.hh"
+#include "BufferPool.hh"
+
+#include <cstring>
+
+#include <arpa/inet.h>
+
+namespace runos {
+
+namespace {
+
+constexpr uint8_t OFP_VERSION = 0x04;
+constexpr uint8_t OFPT_EXPERIMENTER = 4;
+constexpr uint8_t OFPT_FLOW_MOD = 14;
+constexpr uint8_t OFPT_GROUP_MOD = 15;
+constexpr uint32_t OFP_NO_BUFFER = 0xffffffff;
+constexpr size_t flow_mod_buffer_id = 32;
+
+void store16(uint8_t* p, uint16_t v)
+{
+    v = htons(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+void store32(uint8_t* p, uint32_t v)
+{
+    v = htonl(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+uint16_t load16(const uint8_t* p)
+{
+    uint16_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+uint32_t load32(const uint8_t* p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+// ofp_header followed by experimenter id and type
+void experimenter_header(uint8_t* p, uint16_t len, uint32_t xid,
+                         uint32_t exp_type)
+{
+    p[0] = OFP_VERSION;
+    p[1] = OFPT_EXPERIMENTER;
+    store16(p + 2, len);
+    store32(p + 4, xid);
+    store32(p + 8, OFBundle::experimenter);
+    store32(p + 12, exp_type);
+}
+
+} // anonymous namespace
+
+void OFBundle::control(uint8_t* buf, uint32_t xid, uint32_t bundle_id,
+                       ControlType type, uint16_t flags)
+{
+    experimenter_header(buf, control_len, xid, control_type);
+    store32(buf + 16, bundle_id);
+    store16(buf + 20, type);
+    store16(buf + 22, flags);
+}
+
+bool OFBundle::add(PooledBuffer& out, uint32_t bundle_id, uint16_t flags,
+                   const uint8_t* msg, size_t len)
+{
+    if (add_header_len + len > 0xffff)
+        return false;
+
+    // Added message and the bundle add share xid
+    uint8_t header[add_header_len];
+    experimenter_header(header, add_header_len + len, load32(msg + 4), add_type);
+    store32(header + 16, bundle_id);
+    store16(header + 20, 0); // pad
+    store16(header + 22, flags);
+
+    out.append(header, sizeof(header));
+    out.append(msg, len);
+    return true;
+}
+
+bool OFBundle::parseControl(const uint8_t* msg, size_t len,
+                            uint32_t& bundle_id, ControlType& type)
+{
+    if (len < control_len || msg[1] != OFPT_EXPERIMENTER ||
+        load32(msg + 8) != experimenter || load32(msg + 12) != control_type)
+        return false;
+
+    bundle_id = load32(msg + 16);
+    type = ControlType(load16(msg + 20));
+    return true;
+}
+
+bool OFBundle::bundleable(const uint8_t* msg, size_t len)
+{
+    if (msg[1] == OFPT_GROUP_MOD)
+        return true;
+    return msg[1] == OFPT_FLOW_MOD && len >= flow_mod_buffer_id + 4 &&
+           load32(msg + flow_mod_buffer_id) == OFP_NO_BUFFER;
+}
+
+} // namespace runos
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace runos {
+
+class PooledBuffer;
+
+/**
+ * Wire format of OpenFlow 1.3 bundles (ONF extension 230, the same
+ * messages OpenFlow 1.4 defines natively). Messages added to a bundle
+ * are applied by the switch on commit, all together or none of them.
+ */
+struct OFBundle {
+    enum ControlType : uint16_t {
+        OPEN_REQUEST = 0,
+        OPEN_REPLY = 1,
+        CLOSE_REQUEST = 2,
+        CLOSE_REPLY = 3,
+        COMMIT_REQUEST = 4,
+        COMMIT_REPLY = 5,
+        DISCARD_REQUEST = 6,
+        DISCARD_REPLY = 7
+    };
+
+    enum Flags : uint16_t {
+        ATOMIC = 1 << 0,
+        ORDERED = 1 << 1
+    };
+
+    static constexpr uint32_t experimenter = 0x4f4e4600; // ONF
+    static constexpr uint32_t control_type = 2300;
+    static constexpr uint32_t add_type = 2301;
+
+    /** Length of bundle control message */
+    static constexpr size_t control_len = 24;
+    /** Bundle add message without the message added */
+    static constexpr size_t add_header_len = 24;
+
+    /** Packs bundle control message into `buf` of control_len bytes */
+    static void control(uint8_t* buf, uint32_t xid, uint32_t bundle_id,
+                        ControlType type, uint16_t flags);
+
+    /**
+     * Appends bundle add message carrying OpenFlow message `msg`.
+     * @return false if the result doesn't fit into a message.
+     */
+    static bool add(PooledBuffer& out, uint32_t bundle_id, uint16_t flags,
+                    const uint8_t* msg, size_t len);
+
+    /**
+     * Reads bundle control message.
+     * @return false if `msg` isn't one.
+     */
+    static bool parseControl(const uint8_t* msg, size_t len,
+                             uint32_t& bundle_id, ControlType& type);
+
+    /**
+     * Message may be added to a bundle: flow and group modifications.
+     * Flow-mods releasing a buffered packet are sent as usual.
+     */
+    static bool bundleable(const uint8_t* msg, size_t len);
+};
+
+} // namespace runos
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "OFEncode.hh"
+
+#include <cstring>
+
+#include <arpa/inet.h>
+
+namespace runos {
+
+namespace {
+
+constexpr uint8_t OFP_VERSION = 0x04;
+constexpr uint8_t OFPT_PACKET_OUT = 13;
+constexpr uint8_t OFPT_FLOW_MOD = 14;
+constexpr uint8_t OFPT_BARRIER_REQUEST = 20;
+constexpr uint16_t OFPIT_APPLY_ACTIONS = 4;
+constexpr uint16_t OFPIT_METER = 6;
+
+// ofp_flow_mod up to the match
+constexpr size_t flow_mod_len = 48;
+constexpr size_t meter_len = 8;
+constexpr size_t apply_actions_len = 8;
+// ofp_packet_out up to the actions
+constexpr size_t packet_out_len = 24;
+
+void store16(uint8_t* p, uint16_t v)
+{
+    v = htons(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+void store32(uint8_t* p, uint32_t v)
+{
+    v = htonl(v);
+    std::memcpy(p, &v, sizeof(v));
+}
+
+void store64(uint8_t* p, uint64_t v)
+{
+    store32(p, uint32_t(v >> 32));
+    store32(p + 4, uint32_t(v));
+}
+
+void header(uint8_t* p, uint8_t type, size_t len, uint32_t xid)
+{
+    p[0] = OFP_VERSION;
+    p[1] = type;
+    store16(p + 2, uint16_t(len));
+    store32(p + 4, xid);
+}
+
+// ofp_match is padded to 8 bytes
+size_t match_len(fluid_msg::of13::Match& match)
+{
+    return (size_t(match.length()) + 7) / 8 * 8;
+}
+
+} // anonymous namespace
+
+size_t OFEncode::length(const FlowMod& fm)
+{
+    size_t ret = flow_mod_len + match_len(*fm.match);
+    if (fm.meter)
+        ret += meter_len;
+    if (fm.actions)
+        ret += apply_actions_len + fm.actions->length();
+    return ret;
+}
+
+void OFEncode::encode(const FlowMod& fm, uint8_t* buf)
+{
+    size_t len = length(fm);
+    std::memset(buf, 0, len);
+
+    header(buf, OFPT_FLOW_MOD, len, fm.xid);
+    store64(buf + 8, fm.cookie);
+    store64(buf + 16, fm.cookie_mask);
+    buf[24] = fm.table_id;
+    buf[25] = fm.command;
+    store16(buf + 26, fm.idle_timeout);
+    store16(buf + 28, fm.hard_timeout);
+    store16(buf + 30, fm.priority);
+    store32(buf + 32, fm.buffer_id);
+    store32(buf + 36, fm.out_port);
+    store32(buf + 40, fm.out_group);
+    store16(buf + 44, fm.flags);
+
+    uint8_t* p = buf + flow_mod_len;
+    fm.match->pack(p);
+    p += match_len(*fm.match);
+
+    if (fm.meter) {
+        store16(p, OFPIT_METER);
+        store16(p + 2, meter_len);
+        store32(p + 4, fm.meter);
+        p += meter_len;
+    }
+    if (fm.actions) {
+        store16(p, OFPIT_APPLY_ACTIONS);
+        store16(p + 2, uint16_t(apply_actions_len + fm.actions->length()));
+        fm.actions->pack(p + apply_actions_len);
+    }
+}
+
+size_t OFEncode::length(const PacketOut& po)
+{
+    return packet_out_len + po.actions->length() + po.data_len;
+}
+
+void OFEncode::encode(const PacketOut& po, uint8_t* buf)
+{
+    size_t actions_len = po.actions->length();
+    std::memset(buf, 0, packet_out_len);
+
+    header(buf, OFPT_PACKET_OUT, length(po), po.xid);
+    store32(buf + 8, po.buffer_id);
+    store32(buf + 12, po.in_port);
+    store16(buf + 16, uint16_t(actions_len));
+
+    po.actions->pack(buf + packet_out_len);
+    if (po.data_len > 0)
+        std::memcpy(buf + packet_out_len + actions_len, po.data, po.data_len);
+}
+
+void OFEncode::barrier(uint8_t* buf, uint32_t xid)
+{
+    header(buf, OFPT_BARRIER_REQUEST, barrier_len, xid);
+}
+
+} // namespace runos
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <fluid/of13msg.hh>
+
+namespace runos {
+
+/**
+ * Encoders of messages sent on every packet-in. libfluid packs
+ * a message into a freshly allocated buffer, these write it in place,
+ * see SwitchConnection::send(size_t, Encode&&).
+ * Match and actions are still packed by libfluid.
+ */
+struct OFEncode {
+    struct FlowMod {
+        uint32_t xid {0};
+        uint64_t cookie {0};
+        uint64_t cookie_mask {0};
+        uint8_t table_id {0};
+        uint8_t command {0};
+        uint16_t idle_timeout {0};
+        uint16_t hard_timeout {0};
+        uint16_t priority {0};
+        uint32_t buffer_id {0xffffffff};
+        uint32_t out_port {0xffffffff};
+        uint32_t out_group {0xffffffff};
+        uint16_t flags {0};
+        uint32_t meter {0}; ///< meter instruction, 0 for none
+        fluid_msg::of13::Match* match {nullptr};
+        fluid_msg::ActionList* actions {nullptr}; ///< apply-actions, may be null
+    };
+
+    struct PacketOut {
+        uint32_t xid {0};
+        uint32_t buffer_id {0xffffffff};
+        uint32_t in_port {0};
+        fluid_msg::ActionList* actions {nullptr};
+        const void* data {nullptr};
+        size_t data_len {0};
+    };
+
+    static size_t length(const FlowMod& fm);
+    static void encode(const FlowMod& fm, uint8_t* buf);
+
+    static size_t length(const PacketOut& po);
+    static void encode(const PacketOut& po, uint8_t* buf);
+
+    static constexpr size_t barrier_len = 8;
+    static void barrier(uint8_t* buf, uint32_t xid);
+};
+
+} // namespace runos
@@ -46,34 +46,36 @@ OFMsgUnion::OFMsgUnion(uint8_t type, void *data, size_t len)
     case of13::OFPT_GET_ASYNC_REPLY:
         m_base = new (&getAsyncReply) of13::GetAsyncReply; break;
     case of13::OFPT_MULTIPART_REPLY:
-        m_base = new (&multipartReply) of13::MultipartReply;
-        break;
+        constructMultipartReply(data, len); break;
     default:
         throw OFMsgUnhandledType(type);
     }
 
     if (m_base->unpack(static_cast<uint8_t*>(data)) != 0) {
+        m_base->~OFMsg();
+        m_base = nullptr;
         throw OFMsgParseError();
     }
-
-    if (type == of13::OFPT_MULTIPART_REPLY)
-        reparseMultipartReply(data, len);
 }
 
-void OFMsgUnion::reparseMultipartReply(void* data, size_t len)
+void OFMsgUnion::constructMultipartReply(void* data, size_t len)
 {
-    uint16_t type = multipartReply.mpart_type();
-
-    m_base->~OFMsg();
-    m_base = nullptr;
+    // ofp_multipart_reply: header, type, flags, pad[4]
+    if (len < 16) {
+        throw OFMsgParseError();
+    }
+    auto bytes = static_cast<const uint8_t*>(data);
+    uint16_t type = (uint16_t(bytes[8]) << 8) | bytes[9];
 
+    // Pick concrete class before parsing, so the body
+    // (possibly megabytes of flow stats) is unpacked only once
     switch (type) {
     case of13::OFPMP_DESC:
         m_base = new (&multipartReplyDesc) of13::MultipartReplyDesc; break;
     case of13::OFPMP_FLOW:
         m_base = new (&multipartReplyFlow) of13::MultipartReplyFlow; break;
     case of13::OFPMP_AGGREGATE:
-        m_base = new (&multipartReplyAggregate) of13::MultipartReplyAggregate;
+        m_base = new (&multipartReplyAggregate) of13::MultipartReplyAggregate; break;
     case of13::OFPMP_TABLE:
         m_base = new (&multipartReplyTable) of13::MultipartReplyTable; break;
     case of13::OFPMP_TABLE_FEATURES:
@@ -97,11 +99,10 @@ void OFMsgUnion::reparseMultipartReply(void* data, size_t len)
     case of13::OFPMP_METER_FEATURES:
         m_base = new (&multipartReplyMeterFeatures) of13::MultipartReplyMeterFeatures; break;
     default:
+        // Header is still usable to route the reply by xid
         LOG(WARNING) << "Unknown multipart type " << (int) type;
-        return;
+        m_base = new (&multipartReply) of13::MultipartReply; break;
     }
-
-    m_base->unpack(static_cast<uint8_t*>(data));
 }
 
 //OFMsgUnion::OFMsgUnion(OFMsgUnion &&other)
@@ -69,16 +69,26 @@ struct OFMsgUnion {
     /** Construct empty message (base() == nullptr) */
     OFMsgUnion();
     
-    /** Construct from data */
+    /**
+     * Construct from data.
+     * Message is parsed once into its concrete class, multipart replies
+     * are decoded straight into the member matching their type.
+     * Parsed message doesn't reference `data`, so the union is usually
+     * shared with std::make_shared and passed around by pointer.
+     */
     OFMsgUnion(uint8_t type, void* data, size_t len);
     //OFMsgUnion(OFMsgUnion&& other);
     ~OFMsgUnion();
 
+    // Shared by pointer, never copied
+    OFMsgUnion(const OFMsgUnion&) = delete;
+    OFMsgUnion& operator=(const OFMsgUnion&) = delete;
+
     OFMsg* base() const { return m_base; }
 
 private:
     OFMsg* m_base;
-    void reparseMultipartReply(void* data, size_t len);
+    void constructMultipartReply(void* data, size_t len);
 };
 
 Q_DECLARE_METATYPE(std::shared_ptr<OFMsgUnion>)
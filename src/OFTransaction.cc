@@ -27,3 +27,8 @@ void OFTransaction::request(SwitchConnectionPtr conn, OFMsg& msg)
     msg.xid(m_xid);
     conn->send(msg);
 }
+
+OFSession::OFSession(uint32_t xid, SwitchConnectionPtr conn,
+                     clock::time_point deadline)
+    : m_xid(xid), m_conn(conn), m_deadline(deadline)
+{ }
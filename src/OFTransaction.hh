@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <chrono>
+#include <functional>
+
 #include "Common.hh"
 #include "OFMsgUnion.hh"
 #include "SwitchConnectionFwd.hh"
@@ -63,3 +66,46 @@ private:
     uint32_t m_xid;
 };
 
+/**
+ * Single request sent by Controller::request with its own xid.
+ *
+ * Unlike OFTransaction, replies are matched to this request only,
+ * so any number of sessions may be in flight at the same time.
+ * Session deletes itself after the final reply, an error or a timeout.
+ */
+class OFSession : public QObject {
+    Q_OBJECT
+public:
+    typedef std::chrono::steady_clock clock;
+
+    /**
+     * Called for every reply. Multipart reply is delivered by parts,
+     * `more` is true for all of them except the last one.
+     */
+    typedef std::function<void(SwitchConnectionPtr conn,
+                               std::shared_ptr<OFMsgUnion> reply,
+                               bool more)> ReplyHandler;
+    typedef std::function<void(SwitchConnectionPtr conn,
+                               std::shared_ptr<OFMsgUnion> error)> ErrorHandler;
+    typedef std::function<void(SwitchConnectionPtr conn)> TimeoutHandler;
+
+    uint32_t xid() const { return m_xid; }
+    SwitchConnectionPtr connection() const { return m_conn; }
+    clock::time_point deadline() const { return m_deadline; }
+
+signals:
+    void reply(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> reply, bool more);
+    void error(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> error);
+    void timeout(SwitchConnectionPtr conn);
+
+private:
+    friend class Controller;
+    friend class ControllerImpl;
+
+    OFSession(uint32_t xid, SwitchConnectionPtr conn,
+              clock::time_point deadline);
+
+    uint32_t m_xid;
+    SwitchConnectionPtr m_conn;
+    clock::time_point m_deadline;
+};
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "OFTransport.hh"
+#include "EpollTransport.hh"
+
+#include <fluid/OFServer.hh>
+#include <fluid/of13msg.hh>
+
+#include <glog/logging.h>
+
+using namespace fluid_base;
+
+namespace runos {
+
+namespace {
+
+class FluidConnection final : public OFTransportConnection {
+    OFConnection* m_conn;
+public:
+    explicit FluidConnection(OFConnection* conn)
+        : m_conn(conn)
+    { }
+
+    int id() const override
+    { return m_conn->get_id(); }
+
+    bool alive() const override
+    { return m_conn->is_alive(); }
+
+    uint8_t version() const override
+    { return m_conn->get_version(); }
+
+    void send(const void* data, size_t len) override
+    { m_conn->send(const_cast<void*>(data), len); }
+
+    void close() override
+    { m_conn->close(); }
+};
+
+class FluidTransport final : public OFTransport, private OFServer {
+    OFTransportHandler& handler;
+
+public:
+    FluidTransport(const Settings& settings, OFTransportHandler& handler)
+        : OFServer(settings.address.c_str(),
+                   settings.port,
+                   settings.nthreads,
+                   settings.secure,
+                   OFServerSettings()
+                       .supported_version(fluid_msg::of13::OFP_VERSION)
+                       .keep_data_ownership(false)
+                       .echo_interval(settings.echo_interval)
+                       .liveness_check(settings.liveness_check))
+        , handler(handler)
+    { }
+
+    bool start() override
+    { return OFServer::start(/* block: */ false); }
+
+    void stop() override
+    { OFServer::stop(); }
+
+private:
+    void message_callback(OFConnection* ofconn, uint8_t type,
+                          void* data, size_t len) override
+    {
+        auto conn = static_cast<FluidConnection*>(ofconn->get_application_data());
+        if (conn) {
+            handler.message_callback(conn, type, data, len);
+        }
+        free_data(data);
+    }
+
+    void connection_callback(OFConnection* ofconn,
+                             OFConnection::Event event) override
+    {
+        auto conn = static_cast<FluidConnection*>(ofconn->get_application_data());
+
+        switch (event) {
+        case OFConnection::EVENT_STARTED:
+            conn = new FluidConnection(ofconn);
+            ofconn->set_application_data(conn);
+            handler.connection_callback(conn, OFTransportConnection::EVENT_STARTED);
+            break;
+        case OFConnection::EVENT_ESTABLISHED:
+            handler.connection_callback(conn, OFTransportConnection::EVENT_ESTABLISHED);
+            break;
+        case OFConnection::EVENT_FAILED_NEGOTIATION:
+            handler.connection_callback(conn, OFTransportConnection::EVENT_FAILED_NEGOTIATION);
+            break;
+        case OFConnection::EVENT_CLOSED:
+        case OFConnection::EVENT_DEAD:
+            handler.connection_callback(conn,
+                event == OFConnection::EVENT_CLOSED
+                    ? OFTransportConnection::EVENT_CLOSED
+                    : OFTransportConnection::EVENT_DEAD);
+            // libfluid frees ofconn after this callback
+            ofconn->set_application_data(nullptr);
+            delete conn;
+            break;
+        }
+    }
+};
+
+} // anonymous namespace
+
+std::unique_ptr<OFTransport> OFTransport::create(const std::string& backend,
+                                                 const Settings& settings,
+                                                 OFTransportHandler& handler)
+{
+    if (backend == "epoll" || backend == "io_uring") {
+        if (backend == "io_uring") {
+            LOG(WARNING) << "io_uring transport isn't built, using epoll";
+        }
+        return std::unique_ptr<OFTransport>(
+            new EpollTransport(settings, handler));
+    } else if (backend != "fluid") {
+        LOG(ERROR) << "Unknown OpenFlow transport " << backend
+                   << ", using fluid";
+    }
+
+    return std::unique_ptr<OFTransport>(new FluidTransport(settings, handler));
+}
+
+} // namespace runos
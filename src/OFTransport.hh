@@ -0,0 +1,148 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace runos {
+
+/**
+ * Counters of a single connection, see OFTransportConnection::stats().
+ */
+struct OFTransportStats {
+    uint64_t bytes_in {0};   ///< OpenFlow bytes received
+    uint64_t bytes_out {0};  ///< OpenFlow bytes sent
+    bool secure {false};
+    bool resumed {false};    ///< TLS session was resumed
+    bool ktls_tx {false};    ///< sent data is encrypted by the kernel
+    bool ktls_rx {false};    ///< received data is decrypted by the kernel
+    /// Bytes encrypted or decrypted by the controller itself
+    uint64_t user_crypto_bytes {0};
+    /// Output waiting for the socket to become writable
+    uint64_t queued_bytes {0};
+    /// Last echo round trip time, 0 if not measured yet
+    uint32_t echo_rtt_us {0};
+};
+
+/**
+ * OpenFlow connection owned by a transport.
+ * Version negotiation, echo and liveness checks are done by the transport,
+ * handler sees only the messages starting from FEATURES_REPLY.
+ */
+class OFTransportConnection {
+public:
+    enum Event {
+        EVENT_STARTED,
+        EVENT_ESTABLISHED,
+        EVENT_FAILED_NEGOTIATION,
+        EVENT_CLOSED,
+        EVENT_DEAD
+    };
+
+    virtual ~OFTransportConnection() = default;
+
+    virtual int id() const = 0;
+    virtual bool alive() const = 0;
+    virtual uint8_t version() const = 0;
+
+    /**
+     * Sends complete OpenFlow message(s). May be called from any thread,
+     * `data` isn't referenced after return.
+     */
+    virtual void send(const void* data, size_t len) = 0;
+
+    /**
+     * Closes connection, handler gets EVENT_CLOSED on the I/O thread.
+     */
+    virtual void close() = 0;
+
+    /**
+     * Traffic counters, may be called from any thread.
+     * Transports not counting it return zeroes.
+     */
+    virtual OFTransportStats stats() const
+    { return OFTransportStats(); }
+
+    void* application_data() const { return m_application_data; }
+    void application_data(void* data) { m_application_data = data; }
+
+private:
+    void* m_application_data{nullptr};
+};
+
+class OFTransportHandler {
+public:
+    /**
+     * Called on the connection's I/O thread.
+     * `data` points to the whole message and is valid only until return.
+     */
+    virtual void message_callback(OFTransportConnection* conn, uint8_t type,
+                                  void* data, size_t len) = 0;
+    virtual void connection_callback(OFTransportConnection* conn,
+                                     OFTransportConnection::Event event) = 0;
+protected:
+    ~OFTransportHandler() = default;
+};
+
+/**
+ * Accepts OpenFlow switch connections and runs their I/O.
+ *
+ * Backends, chosen by "transport.backend" controller setting:
+ *  - "fluid" (default): libfluid_base OFServer, supports TLS.
+ *  - "epoll" (opt-in): a listener and an epoll loop per I/O thread sharing
+ *    the port with SO_REUSEPORT. Messages are framed in place
+ *    in the connection's read buffer. TLS is done by OpenSSL,
+ *    record encryption is offloaded to kernel TLS when available.
+ */
+class OFTransport {
+public:
+    struct Settings {
+        std::string address{"0.0.0.0"};
+        int port{6653};
+        int nthreads{4};
+        bool secure{false};
+        int echo_interval{15};
+        bool liveness_check{true};
+        // epoll: read buffer of every connection
+        size_t read_buffer{256 * 1024};
+
+        // epoll: TLS settings, used if `secure` is set
+        std::string tls_cert;
+        std::string tls_key;
+        std::string tls_ca;        // verify switch certificates if set
+        bool ktls{true};           // hand records to kernel TLS
+        bool tls_resumption{true}; // session tickets
+    };
+
+    virtual ~OFTransport() = default;
+
+    /**
+     * Starts I/O threads and returns.
+     * @return false if the port can't be listened on.
+     */
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+
+    static std::unique_ptr<OFTransport> create(const std::string& backend,
+                                               const Settings& settings,
+                                               OFTransportHandler& handler);
+};
+
+} // namespace runos
@@ -287,11 +287,12 @@ void PacketParser::parse_l3(uint16_t eth_type, uint8_t* data, size_t data_len)
                 { ofb::IPV6_DST, &ipv6->dst1 },
                 { ofb::IP_PROTO, &ipv6->protocol }
             });
-        }
-        if (data_len > ipv6->header_length()){
-            parse_l4(ipv6->protocol,
-                     data + ipv6->header_length(),
-                     data_len - ipv6->header_length());
+
+            if (data_len > ipv6->header_length()){
+                parse_l4(ipv6->protocol,
+                         data + ipv6->header_length(),
+                         data_len - ipv6->header_length());
+            }
         }
         break;
     }
@@ -350,6 +351,50 @@ PacketParser::PacketParser(fluid_msg::of13::PacketIn& pi, uint64_t dpid)
     }
 }
 
+size_t PacketParser::header_depth(oxm::type t)
+{
+    if (t.ns() != unsigned(of::oxm::ns::OPENFLOW_BASIC))
+        return 0;
+
+    // Assume the longest headers parser accepts:
+    // 802.1Q tagged frames and IPv4 with options
+    const size_t l2 = sizeof(dot1q_hdr);
+    const size_t ipv4 = 15 * 4;
+    const size_t ipv6 = sizeof(ipv6_hdr);
+
+    switch (ofb(t.id())) {
+    case ofb::ETH_DST:
+    case ofb::ETH_SRC:
+    case ofb::ETH_TYPE:
+    case ofb::VLAN_VID:
+        return l2;
+    case ofb::IPV4_SRC:
+    case ofb::IPV4_DST:
+        return l2 + sizeof(ipv4_hdr);
+    case ofb::IP_PROTO:
+    case ofb::IPV6_SRC:
+    case ofb::IPV6_DST:
+        return l2 + std::max(sizeof(ipv4_hdr), ipv6);
+    case ofb::ARP_OP:
+    case ofb::ARP_SPA:
+    case ofb::ARP_TPA:
+    case ofb::ARP_SHA:
+    case ofb::ARP_THA:
+        return l2 + sizeof(arp_hdr);
+    case ofb::TCP_SRC:
+    case ofb::TCP_DST:
+        return l2 + std::max(ipv4, ipv6) + sizeof(tcp_hdr);
+    case ofb::UDP_SRC:
+    case ofb::UDP_DST:
+        return l2 + std::max(ipv4, ipv6) + sizeof(udp_hdr);
+    case ofb::ICMPV4_TYPE:
+    case ofb::ICMPV4_CODE:
+        return l2 + ipv4 + sizeof(icmp_hdr);
+    default:
+        return 0;
+    }
+}
+
 uint8_t* PacketParser::access(oxm::type t) const
 {
     uint8_t* ret(nullptr);
@@ -398,6 +443,20 @@ oxm::field<> PacketParser::load(oxm::mask<> mask) const
     return oxm::value<>{ mask.type(), value_bits } & mask;
 }
 
+const uint8_t* PacketParser::raw(oxm::type t) const noexcept
+{
+    switch (t.ns()) {
+    case unsigned(of::oxm::ns::OPENFLOW_BASIC):
+        return t.id() < ofb_bindings.size()
+            ? static_cast<const uint8_t*>(ofb_bindings[t.id()]) : nullptr;
+    case unsigned(of::oxm::ns::NON_OPENFLOW):
+        return t.id() < nonof_bindings.size()
+            ? static_cast<const uint8_t*>(nonof_bindings[t.id()]) : nullptr;
+    default:
+        return nullptr;
+    }
+}
+
 void PacketParser::modify(oxm::field<> patch)
 {
     oxm::field<> updated =
@@ -69,7 +69,12 @@ class PacketParser final : public SerializablePacket {
 public:
     PacketParser(fluid_msg::of13::PacketIn& pi, uint64_t from_dpid);
 
+    // Bytes from the start of the frame which must be present
+    // to load field `t`. Zero for fields not taken from packet data.
+    static size_t header_depth(oxm::type t);
+
     oxm::field<> load(oxm::mask<> mask) const override;
+    const uint8_t* raw(oxm::type t) const noexcept override;
     void modify(oxm::field<> patch) override;
 
     size_t total_bytes() const override;
@@ -18,6 +18,7 @@
 #pragma once
 
 #include <QtCore>
+#include <functional>
 #include <string>
 #include <unordered_map>
 
@@ -119,6 +120,35 @@ public:
     */
     virtual json11::Json handleDELETE(std::vector<std::string> params, std::string body){return json11::Json::object{{restName(), "not allowed method: DELETE"}};}
 
+    /**
+     * Completion of asynchronous REST request.
+     * Must be called exactly once, from any thread.
+     */
+    using ReplyCallback = std::function<void(json11::Json)>;
+
+    /**
+    * Asynchronous handler of GET request.
+    * Long-running handlers (e.g. waiting for switches) override it
+    * instead of handleGET to not block the web server thread.
+    * By default replies with the result of handleGET.
+    */
+    virtual void handleGETAsync(std::vector<std::string> params, std::string body, ReplyCallback reply){reply(handleGET(std::move(params), std::move(body)));}
+
+    /**
+    * Asynchronous handler of PUT request. By default replies with the result of handlePUT.
+    */
+    virtual void handlePUTAsync(std::vector<std::string> params, std::string body, ReplyCallback reply){reply(handlePUT(std::move(params), std::move(body)));}
+
+    /**
+    * Asynchronous handler of POST request. By default replies with the result of handlePOST.
+    */
+    virtual void handlePOSTAsync(std::vector<std::string> params, std::string body, ReplyCallback reply){reply(handlePOST(std::move(params), std::move(body)));}
+
+    /**
+    * Asynchronous handler of DELETE request. By default replies with the result of handleDELETE.
+    */
+    virtual void handleDELETEAsync(std::vector<std::string> params, std::string body, ReplyCallback reply){reply(handleDELETE(std::move(params), std::move(body)));}
+
     std::vector<RestReq> getPathes() { return pathes; }
 
     /**
@@ -536,13 +536,15 @@ void RestFlowMod::installTableMissRule(uint64_t dpid, uint8_t table_id)
     fm.idle_timeout(0);
     fm.hard_timeout(0);
     fm.table_id(table_id);
-    fm.flags( of13::OFPFF_CHECK_OVERLAP |
-              of13::OFPFF_SEND_FLOW_REM );
+    fm.flags( of13::OFPFF_CHECK_OVERLAP );
+    auto conn = sw_m_->getSwitch(dpid)->connection();
     of13::ApplyActions act;
-    of13::OutputAction out(of13::OFPP_CONTROLLER, 0);
+    of13::OutputAction out(of13::OFPP_CONTROLLER,
+                           conn->buffered() ? ctrl_->missSendLen(table_id)
+                                            : uint16_t(of13::OFPCML_NO_BUFFER));
     act.add_action(out);
     fm.add_instruction(act);
-    sw_m_->getSwitch(dpid)->connection()->send(fm);
+    conn->send(fm);
 }
 
 void RestFlowMod::installGoto(uint64_t dpid, uint8_t table_id)
@@ -554,8 +556,7 @@ void RestFlowMod::installGoto(uint64_t dpid, uint8_t table_id)
     fm.idle_timeout(0);
     fm.hard_timeout(0);
     fm.table_id(table_id);
-    fm.flags( of13::OFPFF_CHECK_OVERLAP |
-              of13::OFPFF_SEND_FLOW_REM );
+    fm.flags( of13::OFPFF_CHECK_OVERLAP );
     of13::ApplyActions act;
     of13::GoToTable go_to_table(table_id + 1);
     fm.add_instruction(go_to_table);
@@ -60,16 +60,23 @@ std::vector<std::string> split(const std::string &s, char delim) {
     return elems;
 }
 
+// Response is sent when the last reference to it is dropped.
+// Handlers may reply from any thread, so the reply callback passes
+// its only reference to the server's thread, where the response
+// is written and sent. Copies of the callback don't hold it.
 #define REGISTER_HANDLER(method) \
-    server->resource[path][#method] = [handler] (std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) { \
-        json11::Json res; \
+    server->resource[path][#method] = [this, handler] (std::shared_ptr<HttpServer::Response> response, std::shared_ptr<HttpServer::Request> request) { \
         std::stringstream ss##method; \
         request->content >> ss##method.rdbuf(); \
         std::vector<std::string> params = split(request->path, '/'); \
         params.erase(params.begin(), params.begin() + 3); \
-        res = handler->handle##method(params, ss##method.str()); \
-        std::string content = res.dump(); \
-        *response << "HTTP/1.1 200 OK\r\nContent-Length: " << content.length() << "\r\n\r\n" << content; \
+        auto io_service = server->io_service; \
+        auto slot = std::make_shared<std::shared_ptr<HttpServer::Response>>(std::move(response)); \
+        handler->handle##method##Async(params, ss##method.str(), [io_service, slot](json11::Json res) { \
+            io_service->post([response = std::move(*slot), content = res.dump()]() { \
+                *response << "HTTP/1.1 200 OK\r\nContent-Length: " << content.length() << "\r\n\r\n" << content; \
+            }); \
+        }); \
     }
 
 void RestListener::startUp(Loader *loader)
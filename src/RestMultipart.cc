@@ -21,6 +21,9 @@
 
 #include <boost/lexical_cast.hpp>
 #include <algorithm>
+#include <iterator>
+#include <memory>
+#include <mutex>
 
 #define SET(field, dst, src) dst.field(toString_cast<decltype(dst.field())>(src.at(#field)))
 
@@ -34,184 +37,279 @@ void RestMultipart::init(Loader *loader, const Config &rootConfig)
     sw_m_ = SwitchManager::get(loader);
     // rest
     RestListener::get(loader)->registerRestHandler(this);
-    acceptPath(Method::GET, "flow/" DPID_);
-    acceptPath(Method::POST, "flow/" DPID_);
-    acceptPath(Method::GET, "port/" DPID_ "/" PORTNUMBER_ALL_);
-    acceptPath(Method::GET, "port-desc/" DPID_);
+    // "all" instead of dpid queries every connected switch in parallel
+    acceptPath(Method::GET, "flow/" DPID_ALL_);
+    acceptPath(Method::POST, "flow/" DPID_ALL_);
+    acceptPath(Method::GET, "port/" DPID_ALL_ "/" PORTNUMBER_ALL_);
+    acceptPath(Method::GET, "port-desc/" DPID_ALL_);
     acceptPath(Method::GET, "switch/" DPID_ALL_);
-    acceptPath(Method::GET, "aggregate-flow/" DPID_);
-    acceptPath(Method::POST, "aggregate-flow/" DPID_);
-    acceptPath(Method::GET, "table/" DPID_);
+    acceptPath(Method::GET, "aggregate-flow/" DPID_ALL_);
+    acceptPath(Method::POST, "aggregate-flow/" DPID_ALL_);
+    acceptPath(Method::GET, "table/" DPID_ALL_);
     // TODO: test (mn does not support queues)
-    acceptPath(Method::GET, "queue/" DPID_ "/" PORTNUMBER_ALL_ "/" QUEUEID_ALL_);
+    acceptPath(Method::GET, "queue/" DPID_ALL_ "/" PORTNUMBER_ALL_ "/" QUEUEID_ALL_);
+}
+
+namespace {
+
+/*
+ * One REST request sent to several switches.
+ * Each switch answer is stored under its dpid, the REST reply
+ * is sent when the last switch answered, failed or timed out.
+ */
+class PendingQuery {
+    RestHandler::ReplyCallback reply_;
+    json11::Json::object result_;
+    size_t pending_;
+    std::mutex mutex_;
+
+public:
+    PendingQuery(RestHandler::ReplyCallback reply, size_t pending)
+        : reply_(std::move(reply)), pending_(pending)
+    { }
+
+    void done(const std::string &dpid, json11::Json value)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        result_[dpid] = std::move(value);
+        if (--pending_ == 0) {
+            lock.unlock();
+            reply_(std::move(result_));
+        }
+    }
+};
+
+} // anonymous namespace
+
+std::vector<Switch*> RestMultipart::selectSwitches(const std::string &dpid)
+{
+    if (dpid == "all")
+        return sw_m_->switches();
+
+    auto sw = sw_m_->getSwitch(boost::lexical_cast<uint64_t>(dpid));
+    if (!sw) {
+        throw "switch not found";
+    }
+    return {sw};
+}
+
+template<class Stats, class Extract>
+void RestMultipart::fanOut(OFMsg &req,
+                           const std::vector<Switch*> &switches,
+                           ReplyCallback reply,
+                           Extract extract)
+{
+    if (switches.empty()) {
+        reply(json11::Json::object{});
+        return;
+    }
 
-    transaction_ = ctrl_->registerStaticTransaction(this);
-    connect(transaction_, &OFTransaction::response, this, &RestMultipart::onResponse);
+    auto query = std::make_shared<PendingQuery>(std::move(reply), switches.size());
+
+    for (Switch* sw : switches) {
+        auto dpid = boost::lexical_cast<std::string>(sw->id());
+        // multipart reply parts are accumulated until the last one
+        auto stats = std::make_shared<Stats>();
+
+        bool sent = ctrl_->request(sw->connection(), req, this,
+            [query, dpid, stats, extract](SwitchConnectionPtr,
+                                          std::shared_ptr<OFMsgUnion> msg,
+                                          bool more)
+            {
+                if (msg->base()->type() != of13::OFPT_MULTIPART_REPLY) {
+                    LOG(ERROR) << "Unexpected response of type " << msg->base()->type()
+                               << " received, expected OFPT_MULTIPART_REPLY";
+                    query->done(dpid, "unexpected reply");
+                    return;
+                }
+                extract(*msg, *stats);
+                if (not more)
+                    query->done(dpid, toJson(*stats));
+            },
+            [query, dpid](SwitchConnectionPtr, std::shared_ptr<OFMsgUnion> error)
+            {
+                query->done(dpid, json11::Json::object{
+                    {"error_type", int(error->error.err_type())},
+                    {"error_code", int(error->error.code())}
+                });
+            },
+            [query, dpid](SwitchConnectionPtr)
+            {
+                query->done(dpid, "timeout");
+            });
+
+        if (not sent) {
+            query->done(dpid, "too many pending requests");
+        }
+    }
 }
 
-json11::Json RestMultipart::handleGET(std::vector<std::string> params, std::string body)
+template<class Stats>
+static void append(std::vector<Stats> &dst, std::vector<Stats> src)
+{
+    dst.insert(dst.end(),
+               std::make_move_iterator(src.begin()),
+               std::make_move_iterator(src.end()));
+}
+
+void RestMultipart::handleGETAsync(std::vector<std::string> params,
+                                   std::string body,
+                                   ReplyCallback reply)
 {
-    QEventLoop pause;
-    connect(this, SIGNAL(ResponseHandlingFinished()), &pause, SLOT(quit()));
     try {
+        if (params[0] == "switch" && params[1] == "all") {
+            json11::Json::array arr;
+            for (const auto &sw : sw_m_->switches()) {
+                arr.emplace_back(boost::lexical_cast<std::string>(sw->id()));
+            }
+            reply(arr);
+            return;
+        }
+
+        auto switches = selectSwitches(params[1]);
+
         if (params[0] == "flow") {
-            sendGetRequest(of13::MultipartRequestFlow{}, boost::lexical_cast<uint64_t>(params[1]));
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseFlow_)}
-            };
+            of13::MultipartRequestFlow req;
+            prepare(req);
+            fanOut<std::vector<of13::FlowStats>>(req, switches, reply,
+                [](OFMsgUnion &r, std::vector<of13::FlowStats> &stats) {
+                    append(stats, r.multipartReplyFlow.flow_stats());
+                });
+            return;
         }
         if (params[0] == "port") {
-            sendGetRequest(of13::MultipartRequestPortStats{}, boost::lexical_cast<uint64_t>(params[1]), params[2]);
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responsePort_)}
-            };
+            of13::MultipartRequestPortStats req;
+            prepare(req, params[2]);
+            fanOut<std::vector<of13::PortStats>>(req, switches, reply,
+                [](OFMsgUnion &r, std::vector<of13::PortStats> &stats) {
+                    append(stats, r.multipartReplyPortStats.port_stats());
+                });
+            return;
         }
         if (params[0] == "switch") {
-            if (params[1] == "all") {
-                json11::Json::array arr;
-                for (const auto &sw : sw_m_->switches()) {
-                    arr.emplace_back(boost::lexical_cast<std::string>(sw->id()));
-                }
-                return arr;
-            }
-            sendGetRequest(of13::MultipartRequestDesc{}, boost::lexical_cast<uint64_t>(params[1]));
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseSwitchDesc_)}
-            };
+            of13::MultipartRequestDesc req;
+            req.flags(0);
+            fanOut<fluid_msg::SwitchDesc>(req, switches, reply,
+                [](OFMsgUnion &r, fluid_msg::SwitchDesc &desc) {
+                    desc = r.multipartReplyDesc.desc();
+                });
+            return;
         }
         if (params[0] == "aggregate-flow") {
-            sendGetRequest(of13::MultipartRequestAggregate{}, boost::lexical_cast<uint64_t>(params[1]));
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseAggregate_)}
-            };
+            of13::MultipartRequestAggregate req;
+            prepare(req);
+            fanOut<of13::MultipartReplyAggregate>(req, switches, reply,
+                [](OFMsgUnion &r, of13::MultipartReplyAggregate &aggregate) {
+                    aggregate = r.multipartReplyAggregate;
+                });
+            return;
         }
         if (params[0] == "table") {
-            sendGetRequest(of13::MultipartRequestTable{}, boost::lexical_cast<uint64_t>(params[1]));
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseTable_)}
-            };
+            of13::MultipartRequestTable req;
+            req.flags(0);
+            fanOut<std::vector<of13::TableStats>>(req, switches, reply,
+                [](OFMsgUnion &r, std::vector<of13::TableStats> &stats) {
+                    append(stats, r.multipartReplyTable.table_stats());
+                });
+            return;
         }
         if (params[0] == "port-desc") {
-            sendGetRequest(of13::MultipartRequestPortDescription{}, boost::lexical_cast<uint64_t>(params[1]));
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responsePortDesc_)}
-            };
+            of13::MultipartRequestPortDescription req;
+            req.flags(0);
+            fanOut<std::vector<of13::Port>>(req, switches, reply,
+                [](OFMsgUnion &r, std::vector<of13::Port> &ports) {
+                    append(ports, r.multipartReplyPortDescription.ports());
+                });
+            return;
         }
         if (params[0] == "queue") {
-            sendGetRequest(of13::MultipartRequestQueue{}, boost::lexical_cast<uint64_t>(params[1]), params[2],
-                           params[3]);
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseQueue_)}
-            };
+            of13::MultipartRequestQueue req;
+            prepare(req, params[2], params[3]);
+            fanOut<std::vector<of13::QueueStats>>(req, switches, reply,
+                [](OFMsgUnion &r, std::vector<of13::QueueStats> &stats) {
+                    append(stats, r.multipartReplyQueue.queue_stats());
+                });
+            return;
         }
     } catch (...) {
-        return json11::Json::object{
+        reply(json11::Json::object{
             {"RestMultipart", "incorrect request"}
-        };
+        });
+        return;
     }
-    return json11::Json::object{
+    reply(json11::Json::object{
             {"RestMultipart", "incorrect request"}
-    };
+    });
 }
 
-/// implementation: tries to parse, convert and send request. If can't, returns a string with description. It's implemented by throwing std::string exception on a processing stage and catching in the body of handlePOST.
-json11::Json RestMultipart::handlePOST(std::vector<std::string> params, std::string body)
+/// implementation: tries to parse, convert and send request. If can't, replies with a string with description. It's implemented by throwing std::string exception on a processing stage and catching in the body of handlePOSTAsync.
+void RestMultipart::handlePOSTAsync(std::vector<std::string> params,
+                                    std::string body,
+                                    ReplyCallback reply)
 {
-    QEventLoop pause;
-    connect(this, SIGNAL(ResponseHandlingFinished()), &pause, SLOT(quit()));
-
     try {
         // body parsing
         auto req = parse(body);
+        auto switches = selectSwitches(params[1]);
 
         if (params[0] == "flow") {
-            sendPostRequest(of13::MultipartRequestFlow{}, boost::lexical_cast<uint64_t>(params[1]), req);
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseFlow_)}
-            };
+            of13::MultipartRequestFlow mpReq;
+            prepare(mpReq, req);
+            fanOut<std::vector<of13::FlowStats>>(mpReq, switches, reply,
+                [](OFMsgUnion &r, std::vector<of13::FlowStats> &stats) {
+                    append(stats, r.multipartReplyFlow.flow_stats());
+                });
+            return;
         }
         // todo: test. Does ovs support sending aggregate flows stats filtered by fields? Guess, no.
         if (params[0] == "aggregate-flow") {
-            sendPostRequest(of13::MultipartRequestAggregate{}, boost::lexical_cast<uint64_t>(params[1]), req);
-            pause.exec();
-            return json11::Json::object{
-                    {params[1], toJson(responseAggregate_)}
-            };
+            of13::MultipartRequestAggregate mpReq;
+            prepare(mpReq, req);
+            fanOut<of13::MultipartReplyAggregate>(mpReq, switches, reply,
+                [](OFMsgUnion &r, of13::MultipartReplyAggregate &aggregate) {
+                    aggregate = r.multipartReplyAggregate;
+                });
+            return;
         }
     } catch (const std::string &errMsg) {
-        return json11::Json::object{
+        reply(json11::Json::object{
                 {"RestMultipart", errMsg.c_str()}
-        };
+        });
+        return;
     } catch (...) {
-        return json11::Json::object{
+        reply(json11::Json::object{
                 {"RestMultipart", "Some error on request handling"}
-        };
+        });
+        return;
     }
-    return json11::Json::object{
+    reply(json11::Json::object{
             {"RestMultipart", "incorrect request"}
-    };
+    });
 }
 
-void RestMultipart::sendGetRequest(of13::MultipartRequestFlow &&req, uint64_t dpid)
+void RestMultipart::prepare(of13::MultipartRequestFlow &req)
 {
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
     req.table_id(of13::OFPTT_ALL);
     req.out_port(of13::OFPP_ANY);
     req.out_group(of13::OFPG_ANY);
     req.cookie(0x0);  // match: cookie & mask == field.cookie & mask
     req.cookie_mask(0x0);
     req.flags(0);
-    transaction_->request(sw->connection(), req);
 }
 
-void RestMultipart::sendGetRequest(of13::MultipartRequestPortStats &&req,
-                                     uint64_t dpid,
-                                     std::string port_number)
+void RestMultipart::prepare(of13::MultipartRequestPortStats &req,
+                            std::string port_number)
 {
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
     try {
         req.port_no(boost::lexical_cast<uint32_t>(port_number));
     } catch (boost::bad_lexical_cast) {
         req.port_no(of13::OFPP_ANY);
     }
     req.flags(0);
-    transaction_->request(sw->connection(), req);
-}
-
-void RestMultipart::sendGetRequest(of13::MultipartRequestDesc &&req, uint64_t dpid)
-{
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
-    req.flags(0);
-    transaction_->request(sw->connection(), req);
 }
 
-void RestMultipart::sendGetRequest(of13::MultipartRequestAggregate &&req, uint64_t dpid)
+void RestMultipart::prepare(of13::MultipartRequestAggregate &req)
 {
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
     req.table_id(of13::OFPTT_ALL);
     // FIXME: libfluid issue: OFPP_ANY: 32 bits -> 16 bits. All bits are set to 1 => everything works
     req.out_port(of13::OFPP_ANY);
@@ -219,41 +317,12 @@ void RestMultipart::sendGetRequest(of13::MultipartRequestAggregate &&req, uint64
     req.cookie(0x0);
     req.cookie_mask(0x0);
     req.flags(0);
-    transaction_->request(sw->connection(), req);
-}
-
-void RestMultipart::sendGetRequest(of13::MultipartRequestTable &&req, uint64_t dpid)
-{
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
-    req.flags(0);
-    transaction_->request(sw->connection(), req);
 }
 
-void RestMultipart::sendGetRequest(of13::MultipartRequestPortDescription &&req, uint64_t dpid)
+void RestMultipart::prepare(of13::MultipartRequestQueue &req,
+                            std::string port_number,
+                            std::string queue_id)
 {
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
-    req.flags(0);
-    transaction_->request(sw->connection(), req);
-}
-
-void RestMultipart::sendGetRequest(of13::MultipartRequestQueue &&req,
-                                     uint64_t dpid,
-                                     std::string port_number,
-                                     std::string queue_id)
-{
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
     try {
         req.port_no(boost::lexical_cast<uint32_t>(port_number));
     } catch (const boost::bad_lexical_cast &) {
@@ -266,7 +335,6 @@ void RestMultipart::sendGetRequest(of13::MultipartRequestQueue &&req,
         req.queue_id(0xFFFFFFFF);
     }
     req.flags(0);
-    transaction_->request(sw->connection(), req);
 }
 
 
@@ -280,77 +348,25 @@ void RestMultipart::sendGetRequest(of13::MultipartRequestQueue &&req,
     } catch (...) {}
 
 /// exceptions are handled by caller
-void RestMultipart::sendPostRequest(of13::MultipartRequestFlow &&mpReq,
-                                    uint64_t dpid,
-                                    json11::Json::object req)
+void RestMultipart::prepare(of13::MultipartRequestFlow &mpReq,
+                            const json11::Json::object &req)
 {
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
     processInfo(mpReq, req);
     if (req.find("match") != req.end()) {
         const auto &matches = req.at("match").object_items();
         processMatches(mpReq, matches);
     }
-    transaction_->request(sw_m_->getSwitch(dpid)->connection(), mpReq);
 }
 
 // note: same as for of13::MultipartRequestFlow
-void RestMultipart::sendPostRequest(of13::MultipartRequestAggregate &&mpReq,
-                                    uint64_t dpid,
-                                    json11::Json::object req)
+void RestMultipart::prepare(of13::MultipartRequestAggregate &mpReq,
+                            const json11::Json::object &req)
 {
-
-    auto sw = sw_m_->getSwitch(dpid);
-    if (!sw) {
-        throw "switch not found";
-    }
-
     processInfo(mpReq, req);
     if (req.find("match") != req.end()) {
         const auto &matches = req.at("match").object_items();
         processMatches(mpReq, matches);
     }
-    transaction_->request(sw->connection(), mpReq);
-}
-
-void RestMultipart::onResponse(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> reply)
-{
-    auto type = reply->base()->type();
-    if (type != of13::OFPT_MULTIPART_REPLY) {
-        LOG(ERROR) << "Unexpected response of type " << type  << " received, expected OFPT_MULTIPART_REPLY";
-        return;
-    }
-
-    switch (reply->multipartReply.mpart_type()) {
-    case of13::OFPMP_FLOW:
-        responseFlow_ = reply->multipartReplyFlow.flow_stats();
-        break;
-    case of13::OFPMP_PORT_STATS:
-        responsePort_ = reply->multipartReplyPortStats.port_stats();
-        break;
-    case of13::OFPMP_DESC:
-        responseSwitchDesc_ = reply->multipartReplyDesc.desc();
-        break;
-    case of13::OFPMP_AGGREGATE:
-        responseAggregate_ = reply->multipartReplyAggregate;
-        break;
-    case of13::OFPMP_TABLE:
-        responseTable_ = reply->multipartReplyTable.table_stats();
-        break;
-    case of13::OFPMP_PORT_DESC:
-        responsePortDesc_ = reply->multipartReplyPortDescription.ports();
-        break;
-    case of13::OFPMP_QUEUE:
-        responseQueue_ = reply->multipartReplyQueue.queue_stats();
-        break;
-    default:
-        LOG(ERROR) << "RestMultipart: unknown MultipartReply type with code: " << reply->multipartReply.mpart_type();
-        return;
-    }
-    emit ResponseHandlingFinished();
 }
 
 void RestMultipart::processInfo(of13::MultipartRequestFlow &mpReq,
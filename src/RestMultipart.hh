@@ -37,13 +37,14 @@
  * That module allows REST users to get switch statistics that can be delivered by MultipleRequest messages.
  * None of Modify actions are implemented in RestFlowMod and StaticFlowPusher modules.
  *
- * Handling of each GET consists of the following steps:
- *  - switching in handleGET method
- *       - calling ``sendGetRequest(corresponding type, <params>)`` and turning in event loop
- *       - waiting for the response from a switch and it's handling
- *           - handler (`onResponse`) updated variable that corresponds to the reply type(of13::MultipartReplyFlow replyFlow, for example)
- *           - handler wakes up `handleGET` method
- *       - responding to the user
+ * Handling of each request is asynchronous and consists of the following steps:
+ *  - switching in handleGETAsync/handlePOSTAsync method
+ *       - preparing request of corresponding type (`prepare(<request>, <params>)`)
+ *       - sending it to the addressed switches (`fanOut`), every switch gets its own session xid
+ *  - replies are accumulated per switch until the last multipart part arrives
+ *  - when every switch answered (or failed or timed out), the merged result `{dpid: stats}` is replied to the user
+ *
+ * Use "all" instead of dpid to query all connected switches in parallel.
  */
 class RestMultipart : public Application, RestHandler {
 Q_OBJECT
@@ -54,39 +55,35 @@ public:
     // rest
     bool eventable() override {return false;}
     AppType type() override { return AppType::None; }
-    json11::Json handleGET(std::vector<std::string> params, std::string body) override;
-    json11::Json handlePOST(std::vector<std::string> params, std::string body) override;
-protected slots:
-    /// called on switch's response
-    void onResponse(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> reply);
-signals:
-    // emitted when response handling (in `onResponse`) is finished
-    void ResponseHandlingFinished();
+    void handleGETAsync(std::vector<std::string> params, std::string body, ReplyCallback reply) override;
+    void handlePOSTAsync(std::vector<std::string> params, std::string body, ReplyCallback reply) override;
 private:
     class Controller *ctrl_;
     class SwitchManager *sw_m_;
-    OFTransaction *transaction_;
 
-    // a set of sendRequest methods -- per one for each supported rest request
-    void sendGetRequest(of13::MultipartRequestFlow &&req, uint64_t dpid);
-    void sendGetRequest(of13::MultipartRequestPortStats &&req,
-                        uint64_t dpid,
-                        std::string port_number);
-    void sendGetRequest(of13::MultipartRequestDesc &&req, uint64_t dpid);
-    void sendGetRequest(of13::MultipartRequestAggregate &&req, uint64_t dpid);
-    void sendGetRequest(of13::MultipartRequestTable &&req, uint64_t dpid);
-    void sendGetRequest(of13::MultipartRequestPortDescription &&req, uint64_t dpid);
-    void sendGetRequest(of13::MultipartRequestQueue &&req,
-                        uint64_t dpid,
-                        std::string port_number,
-                        std::string queue_id);
+    /// switch by dpid or all connected switches for "all"
+    std::vector<Switch*> selectSwitches(const std::string &dpid);
+
+    /// sends request to every switch and replies when all of them answered
+    template<class Stats, class Extract>
+    void fanOut(OFMsg &req,
+                const std::vector<Switch*> &switches,
+                ReplyCallback reply,
+                Extract extract);
+
+    // a set of prepare methods -- per one for each supported rest request
+    void prepare(of13::MultipartRequestFlow &req);
+    void prepare(of13::MultipartRequestPortStats &req,
+                 std::string port_number);
+    void prepare(of13::MultipartRequestAggregate &req);
+    void prepare(of13::MultipartRequestQueue &req,
+                 std::string port_number,
+                 std::string queue_id);
 
-    void sendPostRequest(of13::MultipartRequestFlow &&mpReq,
-                         uint64_t dpid,
-                         json11::Json::object req);
-    void sendPostRequest(of13::MultipartRequestAggregate &&mpReq,
-                         uint64_t dpid,
-                         json11::Json::object req);
+    void prepare(of13::MultipartRequestFlow &mpReq,
+                 const json11::Json::object &req);
+    void prepare(of13::MultipartRequestAggregate &mpReq,
+                 const json11::Json::object &req);
 
     void processInfo(of13::MultipartRequestFlow &mpReq,
                      const json11::Json::object &req);
@@ -97,15 +94,4 @@ private:
                      const json11::Json::object &req);
     void processMatches(of13::MultipartRequestAggregate &mpReq,
                         const json11::Json::object &matches);
-
-    // a set of variables for switch's answer storing -- per one for each supported rest requests type
-    std::vector<of13::FlowStats> responseFlow_;
-    std::vector<of13::PortStats> responsePort_;
-    fluid_msg::SwitchDesc responseSwitchDesc_;
-    of13::MultipartReplyAggregate responseAggregate_;
-    std::vector<of13::TableStats> responseTable_;
-    std::vector<of13::Port> responsePortDesc_;
-    std::vector<of13::QueueStats> responseQueue_;
 };
-
-
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ShardedExecutor.hh"
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <glog/logging.h>
+
+namespace runos {
+
+namespace {
+
+struct Node {
+    std::atomic<Node*> next{nullptr};
+    ShardedExecutor::Task task;
+};
+
+/*
+ * Intrusive multi-producer single-consumer queue (D. Vyukov).
+ * push() is wait-free, pop() is called by the owning worker only.
+ * pop() may spuriously return nullptr while a producer is in the middle
+ * of push(); the producer wakes the worker afterwards anyway.
+ */
+class MpscQueue {
+    std::atomic<Node*> head;
+    Node* tail;
+    Node stub;
+
+public:
+    MpscQueue()
+        : head{&stub}, tail{&stub}
+    { }
+
+    ~MpscQueue()
+    {
+        while (Node* node = pop())
+            delete node;
+    }
+
+    void push(Node* node)
+    {
+        node->next.store(nullptr);
+        Node* prev = head.exchange(node);
+        prev->next.store(node);
+    }
+
+    Node* pop()
+    {
+        Node* first = tail;
+        Node* next = first->next.load();
+
+        if (first == &stub) {
+            if (next == nullptr)
+                return nullptr;
+            tail = next;
+            first = next;
+            next = next->next.load();
+        }
+
+        if (next) {
+            tail = next;
+            return first;
+        }
+
+        if (first != head.load())
+            return nullptr;
+
+        push(&stub);
+
+        next = first->next.load();
+        if (next) {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+};
+
+} // anonymous namespace
+
+struct ShardedExecutor::Worker {
+    MpscQueue queue;
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> stopping{false};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread thread;
+
+    void wake()
+    {
+        if (sleeping.exchange(false)) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_one();
+        }
+    }
+
+    bool run_one()
+    {
+        Node* node = queue.pop();
+        if (node == nullptr)
+            return false;
+
+        try {
+            node->task();
+        } catch (const std::exception& e) {
+            LOG(ERROR) << "Unhandled exception in worker task: " << e.what();
+        } catch (...) {
+            LOG(ERROR) << "Unhandled exception in worker task";
+        }
+        delete node;
+        return true;
+    }
+
+    void loop()
+    {
+        static const int spin_limit = 64;
+        int idle = 0;
+
+        for (;;) {
+            if (run_one()) {
+                idle = 0;
+                continue;
+            }
+
+            if (++idle < spin_limit) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.store(true);
+            // Recheck after publishing `sleeping`: producer that pushed
+            // before this point may have seen sleeping == false.
+            if (run_one()) {
+                sleeping.store(false);
+                idle = 0;
+                continue;
+            }
+            if (stopping.load()) {
+                sleeping.store(false);
+                return;
+            }
+            wakeup.wait(lock, [this] {
+                return not sleeping.load() || stopping.load();
+            });
+            sleeping.store(false);
+            idle = 0;
+        }
+    }
+};
+
+ShardedExecutor::ShardedExecutor(unsigned nshards, std::string name)
+    : m_name(std::move(name))
+{
+    if (nshards == 0)
+        nshards = 1;
+
+    m_workers.reserve(nshards);
+    for (unsigned i = 0; i < nshards; ++i) {
+        m_workers.emplace_back(new Worker);
+    }
+    for (auto& worker : m_workers) {
+        Worker* w = worker.get();
+        w->thread = std::thread([w]{ w->loop(); });
+    }
+
+    VLOG(5) << m_name << ": started " << nshards << " worker threads";
+}
+
+ShardedExecutor::~ShardedExecutor()
+{
+    stop();
+}
+
+unsigned ShardedExecutor::size() const
+{
+    return m_workers.size();
+}
+
+void ShardedExecutor::post(unsigned shard, Task task)
+{
+    Worker& worker = *m_workers.at(shard);
+    Node* node = new Node;
+    node->task = std::move(task);
+    worker.queue.push(node);
+    worker.wake();
+}
+
+void ShardedExecutor::broadcast(const Task& task)
+{
+    for (unsigned i = 0; i < size(); ++i) {
+        post(i, task);
+    }
+}
+
+void ShardedExecutor::stop()
+{
+    for (auto& worker : m_workers) {
+        if (not worker->thread.joinable())
+            continue;
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->stopping.store(true);
+            worker->sleeping.store(false);
+        }
+        worker->wakeup.notify_one();
+        worker->thread.join();
+        VLOG(5) << m_name << ": worker stopped";
+    }
+}
+
+} // namespace runos
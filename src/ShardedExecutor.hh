@@ -0,0 +1,70 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace runos {
+
+/**
+ * Fixed set of worker threads, each one draining its own task queue.
+ *
+ * Tasks posted with the same key always run on the same worker, in
+ * the order they were posted by a single producer. Queues are
+ * intrusive lock-free MPSC lists, so posting from OpenFlow I/O threads
+ * never blocks on a mutex unless the worker is sleeping.
+ */
+class ShardedExecutor {
+public:
+    typedef std::function<void()> Task;
+
+    /**
+     * Starts `nshards` worker threads.
+     * @param name Used in log messages only.
+     */
+    ShardedExecutor(unsigned nshards, std::string name);
+    ~ShardedExecutor();
+
+    ShardedExecutor(const ShardedExecutor&) = delete;
+    ShardedExecutor& operator=(const ShardedExecutor&) = delete;
+
+    unsigned size() const;
+
+    /** Worker index serving the key (e.g. datapath id). */
+    unsigned shard(uint64_t key) const
+    { return key % size(); }
+
+    /** Queue task to the worker `shard`. Thread-safe. */
+    void post(unsigned shard, Task task);
+
+    /** Queue task to every worker. Thread-safe. */
+    void broadcast(const Task& task);
+
+    /** Finish queued tasks and join all workers. */
+    void stop();
+
+private:
+    struct Worker;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::string m_name;
+};
+
+} // namespace runos
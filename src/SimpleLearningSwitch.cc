@@ -75,5 +75,5 @@ void SimpleLearningSwitch::init(Loader *loader, const Config &)
                 }
                 return decision.custom(std::make_shared<STP::Decision>());
             }
-    });
+    }, { switch_id, ofb_in_port, ofb_eth_src, ofb_eth_dst });
 }
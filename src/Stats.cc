@@ -84,16 +84,7 @@ void SwitchStats::init(Loader *loader, const Config& rootConfig)
     /* Get dependencies */
     m_switch_manager = SwitchManager::get(loader);
 
-    pdescr = Controller::get(loader)->registerStaticTransaction(this);
-    QObject::connect(pdescr, &OFTransaction::response,
-                     this, &SwitchStats::portStatsArrived);
-
-    QObject::connect(pdescr, &OFTransaction::error,
-    [](SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> msg) {
-        of13::Error& error = msg->error;
-        LOG(ERROR) << "Switch reports error for OFPT_MULTIPART_REQUEST: "
-            << "type " << (int) error.type() << " code " << error.code();
-    });
+    m_ctrl = Controller::get(loader);
 
     QObject::connect(m_switch_manager, &SwitchManager::switchDiscovered,
                      this, &SwitchStats::newSwitch);
@@ -116,35 +107,23 @@ void SwitchStats::newSwitch(Switch *sw)
     all_switches_stats.insert(std::pair<uint64_t, SwitchPortStats>(sw->id(), newswitch));
 }
 
-void SwitchStats::portStatsArrived(SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion> reply)
+void SwitchStats::portStatsArrived(SwitchConnectionPtr conn, of13::PortStats& stats)
 {
-    auto type = reply->base()->type();
-    if (type != of13::OFPT_MULTIPART_REPLY) {
-        LOG(ERROR) << "Unexpected response of type " << type
-                << " received, expected OFPT_MULTIPART_REPLY";
-        return;
-    }
+    // check and count bytes per second
+    port_packets_bytes newstat{stats};
 
-    of13::MultipartReplyPortStats stats = reply->multipartReplyPortStats;
+    // find switch in old data
+    auto sps = all_switches_stats.find(conn->dpid());
+    if (sps == all_switches_stats.end())
+        return;
 
-    std::vector<of13::PortStats> s = stats.port_stats();
-    for (auto& i : s)
-    {
-        uint64_t sw_id = conn->dpid();
-        // check and count bytes per second
-        port_packets_bytes newstat{i};
-
-        // find switch in old data
-        SwitchPortStats& sps = all_switches_stats.at(sw_id);
-
-        try {
-            // find port in old data
-            sps.getElem(i.port_no()) = newstat;
-        }
-        catch (const std::out_of_range&) {
-            // no old data for this port, speed is not calculated
-            sps.insertElem(std::pair<uint32_t, port_packets_bytes>(i.port_no(), newstat));
-        }
+    try {
+        // find port in old data
+        sps->second.getElem(stats.port_no()) = newstat;
+    }
+    catch (const std::out_of_range&) {
+        // no old data for this port, speed is not calculated
+        sps->second.insertElem(std::pair<uint32_t, port_packets_bytes>(stats.port_no(), newstat));
     }
 }
 
@@ -157,7 +136,16 @@ void SwitchStats::pollTimeout()
         req.flags(0);
         req.port_no(of13::OFPP_ANY);
         if (all_switches_stats.count(sw->id()))
-            pdescr->request(sw->connection(), req);
+            m_ctrl->requestEntries<of13::PortStats>(sw->connection(), req, this,
+                [this](SwitchConnectionPtr conn, of13::PortStats& stats) {
+                    portStatsArrived(conn, stats);
+                },
+                [](SwitchConnectionPtr conn, bool complete) {
+                    if (not complete) {
+                        LOG(ERROR) << "Port stats request to switch "
+                                   << conn->dpid() << " failed";
+                    }
+                });
     }
 }
 
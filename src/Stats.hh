@@ -88,9 +88,10 @@ public:
 
 public slots:
     /**
-    * Called when a switch has answered with MulipartReplyPortStats message
+    * Called for every port in MulipartReplyPortStats message,
+    * as soon as the reply part holding it arrives
     */ 
-    void portStatsArrived(SwitchConnectionPtr, std::shared_ptr<OFMsgUnion>);
+    void portStatsArrived(SwitchConnectionPtr, of13::PortStats& stats);
     // called when a new switch is discovered
     void newSwitch(Switch* sw);
 
@@ -104,7 +105,7 @@ private:
     unsigned c_poll_interval;
     QTimer* m_timer;
     SwitchManager* m_switch_manager;
+    class Controller* m_ctrl;
     // port stats for each switch: {dpid: {port_id: stat}}
     std::unordered_map<uint64_t, SwitchPortStats> all_switches_stats;
-    OFTransaction* pdescr;
 };
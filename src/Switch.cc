@@ -17,8 +17,13 @@
 #include "Switch.hh"
 
 #include <unordered_map>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
 #include <boost/assert.hpp>
 #include <boost/lexical_cast.hpp>
+#include <QTimer>
 
 #include "SwitchConnection.hh"
 
@@ -37,11 +42,55 @@ struct SwitchImpl {
     uint32_t         capabilities;
     SwitchDesc       desc;
 
+    // switchDiscovered was emitted
+    bool discovered {false};
+    // Bring-up of the current connection reached announcement
+    std::atomic<bool> announced {false};
+
     QReadWriteLock port_lock;
     std::unordered_map<uint32_t, of13::Port>
             port;
 };
 
+// Steps of switch initialisation, each one finished by a reply
+enum class BringUpStage {
+    Queued,   // waiting for a free slot of the window
+    Init,     // barrier after controller's table setup
+    Describe, // announced to applications, waiting for port descriptions
+    Settle    // barrier after applications' setup
+};
+
+static const char* stage_name(BringUpStage stage)
+{
+    switch (stage) {
+    case BringUpStage::Queued: return "queued";
+    case BringUpStage::Init: return "init";
+    case BringUpStage::Describe: return "describe";
+    case BringUpStage::Settle: return "settle";
+    }
+    return "unknown";
+}
+
+struct BringUp {
+    typedef std::chrono::steady_clock clock;
+
+    SwitchConnectionPtr conn;
+    of13::FeaturesReply fr;
+    uint64_t attempt;
+    BringUpStage stage {BringUpStage::Queued};
+    clock::time_point queued {clock::now()};
+    clock::time_point started;
+};
+
+struct BringUpStats {
+    uint64_t completed {0};
+    BringUp::clock::duration latency_total {0};
+    BringUp::clock::duration latency_last {0};
+    BringUp::clock::duration latency_max {0};
+    BringUp::clock::duration wait_total {0};
+    BringUp::clock::duration wait_max {0};
+};
+
 struct SwitchManagerImpl {
     Controller* controller;
     OFTransaction* pdescr;
@@ -49,6 +98,16 @@ struct SwitchManagerImpl {
 
     QReadWriteLock switch_lock;
     std::unordered_map<uint64_t, Switch> switches;
+
+    // Switches being initialised, at most `window` at once
+    std::mutex bringup_mutex;
+    std::unordered_map<uint64_t, BringUp> bringup;
+    std::deque<std::pair<uint64_t, uint64_t>> bringup_queue; // dpid, attempt
+    unsigned bringup_window {64}; // 0 is unlimited
+    unsigned bringup_active {0};
+    uint64_t bringup_attempts {0};
+    std::chrono::milliseconds bringup_timeout {std::chrono::seconds(10)};
+    BringUpStats bringup_stats;
 };
 
 SwitchManager::SwitchManager()
@@ -66,16 +125,27 @@ Switch* SwitchManager::getSwitch(uint64_t dpid)
     }
 }
 
-void SwitchManager::init(Loader* loader, const Config&)
+void SwitchManager::init(Loader* loader, const Config& rootConfig)
 {
     auto controller = m->controller = Controller::get(loader);
 
+    auto config = config_cd(rootConfig, "switch-manager");
+    m->bringup_window = std::max(config_get(config, "bring-up-window", 64), 0);
+    m->bringup_timeout = std::chrono::seconds(
+            config_get(config, "bring-up-timeout", 10));
+    // Table setup of connecting switches goes through the window too
+    controller->pacedSetup();
+
     QObject::connect(controller, &Controller::switchUp,
                      this, &SwitchManager::onSwitchUp);
     QObject::connect(controller, &Controller::switchDown,
                      this, &SwitchManager::onSwitchDown);
     QObject::connect(controller, &Controller::portStatus,
                      this, &SwitchManager::onPortStatus);
+    controller->subscribeAsync(of13::OFPT_PORT_STATUS,
+                               1 << of13::OFPPR_ADD |
+                               1 << of13::OFPPR_DELETE |
+                               1 << of13::OFPPR_MODIFY);
 
     m->pdescr = controller->registerStaticTransaction(this);
     QObject::connect(m->pdescr, &OFTransaction::response,
@@ -103,6 +173,7 @@ void SwitchManager::init(Loader* loader, const Config&)
 
     RestListener::get(loader)->registerRestHandler(this);
     acceptPath(Method::GET, "switches/all");
+    acceptPath(Method::GET, "switches/bring-up");
 }
 
 void SwitchManager::onSwitchUp(SwitchConnectionPtr conn, of13::FeaturesReply fr)
@@ -110,6 +181,7 @@ void SwitchManager::onSwitchUp(SwitchConnectionPtr conn, of13::FeaturesReply fr)
     BOOST_ASSERT( fr.datapath_id() == conn->dpid() );
     QWriteLocker locker(&m->switch_lock);
 
+    // Known to getSwitch() at once, announced when its turn comes
     auto it = m->switches.find(conn->dpid());
     if (it == m->switches.end()) {
         it = m->switches.emplace(
@@ -117,21 +189,22 @@ void SwitchManager::onSwitchUp(SwitchConnectionPtr conn, of13::FeaturesReply fr)
                 std::forward_as_tuple(conn->dpid()),
                 std::forward_as_tuple(this, conn, fr)
         ).first;
-        locker.unlock();
-
-        emit switchDiscovered(&it->second);
-        emit switchUp(&it->second);
-    } else {
-        locker.unlock();
-
-        it->second.setUp(conn, fr);
-        emit switchUp(&it->second);
     }
+    it->second.m->announced = false;
+    locker.unlock();
 
-    it->second.requestPortDescriptions();
-    it->second.requestSwitchDescriptions();
-
-    addEvent(Event::Add, &it->second);
+    {
+        std::lock_guard<std::mutex> lock(m->bringup_mutex);
+        cancelBringUp(conn->dpid());
+
+        uint64_t attempt = ++m->bringup_attempts;
+        BringUp& b = m->bringup[conn->dpid()];
+        b.conn = conn;
+        b.fr = fr;
+        b.attempt = attempt;
+        m->bringup_queue.emplace_back(conn->dpid(), attempt);
+    }
+    scheduleBringUp();
 }
 
 void SwitchManager::onSwitchDown(SwitchConnectionPtr conn)
@@ -141,6 +214,18 @@ void SwitchManager::onSwitchDown(SwitchConnectionPtr conn)
         return;
 
     Switch* dp = &it->second;
+    bool announced = dp->m->announced.exchange(false);
+
+    {
+        std::lock_guard<std::mutex> lock(m->bringup_mutex);
+        cancelBringUp(conn->dpid());
+    }
+    scheduleBringUp();
+
+    // Applications haven't seen this connection
+    if (not announced)
+        return;
+
     dp->setDown();
 
     emit switchDown(dp);
@@ -151,7 +236,211 @@ void SwitchManager::onSwitchDown(SwitchConnectionPtr conn)
 void SwitchManager::onPortStatus(SwitchConnectionPtr conn, of13::PortStatus ps)
 {
     // don't acquire lock because operation lives in qt loop
-    m->switches.at(conn->dpid()).portStatus(ps);
+    auto it = m->switches.find(conn->dpid());
+    if (it == m->switches.end() || not it->second.m->announced) {
+        // Port descriptions requested on announcement cover it
+        DVLOG(5) << "Port status from switch " << conn->dpid()
+                 << " before its bring-up, ignoring";
+        return;
+    }
+    it->second.portStatus(ps);
+}
+
+// Must be called with bringup_mutex held
+void SwitchManager::cancelBringUp(uint64_t dpid)
+{
+    auto it = m->bringup.find(dpid);
+    if (it == m->bringup.end())
+        return;
+    if (it->second.stage != BringUpStage::Queued)
+        --m->bringup_active;
+    // Its queue entry is skipped by the attempt mismatch
+    m->bringup.erase(it);
+}
+
+void SwitchManager::scheduleBringUp()
+{
+    std::vector<std::pair<uint64_t, uint64_t>> start;
+    std::vector<SwitchConnectionPtr> setup;
+    {
+        std::lock_guard<std::mutex> lock(m->bringup_mutex);
+        while (not m->bringup_queue.empty() &&
+               (m->bringup_window == 0 ||
+                m->bringup_active < m->bringup_window))
+        {
+            auto next = m->bringup_queue.front();
+            m->bringup_queue.pop_front();
+
+            auto it = m->bringup.find(next.first);
+            if (it == m->bringup.end() || it->second.attempt != next.second)
+                continue;
+
+            ++m->bringup_active;
+            it->second.stage = BringUpStage::Init;
+            it->second.started = BringUp::clock::now();
+            start.push_back(next);
+            setup.push_back(it->second.conn);
+        }
+    }
+
+    for (size_t i = 0; i < start.size(); ++i) {
+        // Controller's flow-mods are applied
+        // when the barrier is answered
+        m->controller->setupSwitch(setup[i]);
+        sendBringUpBarrier(start[i].first, start[i].second);
+    }
+}
+
+void SwitchManager::sendBringUpBarrier(uint64_t dpid, uint64_t attempt)
+{
+    SwitchConnectionPtr conn;
+    {
+        std::lock_guard<std::mutex> lock(m->bringup_mutex);
+        auto it = m->bringup.find(dpid);
+        if (it == m->bringup.end() || it->second.attempt != attempt)
+            return;
+        conn = it->second.conn;
+    }
+
+    of13::BarrierRequest br;
+    auto next = [this, dpid, attempt](SwitchConnectionPtr) {
+        advanceBringUp(dpid, attempt);
+    };
+    bool sent = m->controller->request(conn, br, this,
+        [next](SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion>, bool) {
+            next(conn);
+        },
+        [next](SwitchConnectionPtr conn, std::shared_ptr<OFMsgUnion>) {
+            next(conn);
+        },
+        [next](SwitchConnectionPtr conn) {
+            LOG(WARNING) << "Barrier to switch " << conn->dpid()
+                         << " timed out during bring-up";
+            next(conn);
+        },
+        m->bringup_timeout);
+
+    if (not sent) {
+        // Don't block the window, go on without waiting
+        QTimer::singleShot(0, this, [this, dpid, attempt]() {
+            advanceBringUp(dpid, attempt);
+        });
+    }
+}
+
+void SwitchManager::advanceBringUp(uint64_t dpid, uint64_t attempt)
+{
+    BringUpStage stage;
+    SwitchConnectionPtr conn;
+    of13::FeaturesReply fr;
+    {
+        std::lock_guard<std::mutex> lock(m->bringup_mutex);
+        auto it = m->bringup.find(dpid);
+        if (it == m->bringup.end() || it->second.attempt != attempt)
+            return; // switch went down or reconnected meanwhile
+        BringUp& b = it->second;
+        stage = b.stage;
+        conn = b.conn;
+        fr = b.fr;
+
+        switch (b.stage) {
+        case BringUpStage::Init:
+            b.stage = BringUpStage::Describe;
+            break;
+        case BringUpStage::Describe:
+            b.stage = BringUpStage::Settle;
+            break;
+        case BringUpStage::Settle: {
+            auto now = BringUp::clock::now();
+            auto latency = now - b.queued;
+            auto wait = b.started - b.queued;
+            BringUpStats& stats = m->bringup_stats;
+            stats.completed++;
+            stats.latency_last = latency;
+            stats.latency_total += latency;
+            stats.latency_max = std::max(stats.latency_max, latency);
+            stats.wait_total += wait;
+            stats.wait_max = std::max(stats.wait_max, wait);
+
+            m->bringup.erase(it);
+            --m->bringup_active;
+            break;
+        }
+        case BringUpStage::Queued:
+            BOOST_ASSERT(false);
+            return;
+        }
+    }
+
+    switch (stage) {
+    case BringUpStage::Init:
+        announceSwitch(conn, fr, attempt);
+        break;
+    case BringUpStage::Describe:
+        // Let applications' rules and packets reach the switch
+        sendBringUpBarrier(dpid, attempt);
+        break;
+    case BringUpStage::Settle:
+        VLOG(2) << "Switch " << dpid << " is up";
+        scheduleBringUp();
+        break;
+    case BringUpStage::Queued:
+        break;
+    }
+}
+
+void SwitchManager::announceSwitch(SwitchConnectionPtr conn,
+                                   of13::FeaturesReply fr,
+                                   uint64_t attempt)
+{
+    uint64_t dpid = conn->dpid();
+    Switch* dp = getSwitch(dpid);
+    BOOST_ASSERT(dp);
+
+    dp->m->announced = true;
+    if (not dp->m->discovered) {
+        dp->m->discovered = true;
+        emit switchDiscovered(dp);
+        emit switchUp(dp);
+    } else {
+        dp->setUp(conn, fr);
+        emit switchUp(dp);
+    }
+
+    dp->requestSwitchDescriptions();
+
+    of13::MultipartRequestPortDescription req;
+    req.flags(0); // no more requests will follow
+    bool sent = m->controller->request(conn, req, this,
+        [this, dpid, attempt](SwitchConnectionPtr conn,
+                              std::shared_ptr<OFMsgUnion> reply,
+                              bool more)
+        {
+            onPortDescriptions(conn, reply);
+            if (not more)
+                advanceBringUp(dpid, attempt);
+        },
+        [this, dpid, attempt](SwitchConnectionPtr, std::shared_ptr<OFMsgUnion> msg)
+        {
+            of13::Error& error = msg->error;
+            LOG(ERROR) << "Switch reports error for OFPT_MULTIPART_REQUEST: "
+                << "type " << (int) error.type() << " code " << error.code();
+            advanceBringUp(dpid, attempt);
+        },
+        [this, dpid, attempt](SwitchConnectionPtr) {
+            LOG(WARNING) << "Port descriptions of switch " << dpid
+                         << " timed out during bring-up";
+            advanceBringUp(dpid, attempt);
+        },
+        m->bringup_timeout);
+
+    if (not sent) {
+        QTimer::singleShot(0, this, [this, dpid, attempt]() {
+            advanceBringUp(dpid, attempt);
+        });
+    }
+
+    addEvent(Event::Add, dp);
 }
 
 void SwitchManager::onPortDescriptions(SwitchConnectionPtr conn,
@@ -192,7 +481,7 @@ std::vector<Switch*> SwitchManager::switches()
 
     for (auto& pair : m->switches) {
         SwitchConnectionPtr conn = pair.second.m->conn;
-        if (conn->alive())
+        if (conn->alive() && pair.second.m->announced)
             ret.push_back(&pair.second);
     }
     return ret;
@@ -331,6 +620,10 @@ json11::Json Switch::to_json() const {
         ports_vec.push_back(json_port);
     }
 
+    SendStats send_stats;
+    if (m->conn)
+        send_stats = m->conn->sendStats();
+
     return json11::Json::object {
         {"ID", id_str()},
         {"DPID", boost::lexical_cast<std::string>(id())},
@@ -339,7 +632,12 @@ json11::Json Switch::to_json() const {
         {"hw_desc", hw_desc()},
         {"sw_desc", sw_desc()},
         {"serial_num", serial_number()},
-        {"dp_desc", dp_desc()}
+        {"dp_desc", dp_desc()},
+        {"send_stats", json11::Json::object {
+            {"flushes", (double)send_stats.flushes},
+            {"messages", (double)send_stats.messages},
+            {"bytes", (double)send_stats.bytes}
+        }}
     };
 }
 
@@ -461,6 +759,46 @@ json11::Json SwitchManager::handleGET(std::vector<std::string> params, std::stri
     if (params[0] == "switches" && params[1] == "all") {
         return json11::Json(switches());
     }
+    if (params[0] == "switches" && params[1] == "bring-up") {
+        return bringUpJson();
+    }
 
     return "{}";
 }
+
+json11::Json SwitchManager::bringUpJson()
+{
+    using std::chrono::duration_cast;
+    using ms = std::chrono::duration<double, std::milli>;
+
+    std::lock_guard<std::mutex> lock(m->bringup_mutex);
+    const BringUpStats& stats = m->bringup_stats;
+    auto now = BringUp::clock::now();
+
+    json11::Json::array pending;
+    for (const auto& b : m->bringup) {
+        pending.push_back(json11::Json::object {
+            {"DPID", boost::lexical_cast<std::string>(b.first)},
+            {"stage", stage_name(b.second.stage)},
+            {"elapsed_ms", duration_cast<ms>(now - b.second.queued).count()}
+        });
+    }
+
+    double completed = stats.completed;
+    return json11::Json::object {
+        {"window", (int) m->bringup_window},
+        {"queued", (int) (m->bringup.size() - m->bringup_active)},
+        {"active", (int) m->bringup_active},
+        {"completed", completed},
+        {"latency_ms", json11::Json::object {
+            {"last", duration_cast<ms>(stats.latency_last).count()},
+            {"avg", completed ? duration_cast<ms>(stats.latency_total).count() / completed : 0.0},
+            {"max", duration_cast<ms>(stats.latency_max).count()}
+        }},
+        {"wait_ms", json11::Json::object {
+            {"avg", completed ? duration_cast<ms>(stats.wait_total).count() / completed : 0.0},
+            {"max", duration_cast<ms>(stats.wait_max).count()}
+        }},
+        {"switches", pending}
+    };
+}
@@ -144,6 +144,12 @@ private:
  *
  * You can get information about switchs connected to controller by GET request : GET /api/switch-manager/switches/all
  *
+ * Connected switches are initialised at most "bring-up-window" at once.
+ * Applications learn about a switch after controller's setup of its tables
+ * is confirmed by a barrier, and the next switch is started after the
+ * port descriptions and a barrier following applications' setup are answered.
+ * Progress and latency are reported by GET /api/switch-manager/switches/bring-up
+ *
  * Application support event model.
  */
 
@@ -212,4 +218,12 @@ protected slots:
 private:
     friend class Switch;
     std::unique_ptr<struct SwitchManagerImpl> m;
+
+    void cancelBringUp(uint64_t dpid);
+    void scheduleBringUp();
+    void sendBringUpBarrier(uint64_t dpid, uint64_t attempt);
+    void advanceBringUp(uint64_t dpid, uint64_t attempt);
+    void announceSwitch(SwitchConnectionPtr conn, of13::FeaturesReply fr,
+                        uint64_t attempt);
+    json11::Json bringUpJson();
 };
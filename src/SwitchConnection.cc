@@ -1,39 +1,343 @@
 #include "SwitchConnection.hh"
+#include "BufferPool.hh"
+#include "OFBundle.hh"
+#include "OFTransport.hh"
 
-#include <fluid/OFConnection.hh>
-#include <fluid/ofcommon/msg.hh>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
-using fluid_base::OFConnection;
+#include <fluid/ofcommon/msg.hh>
 
 namespace runos {
 
+namespace {
+
+struct PendingWrite {
+    SwitchConnection* conn {nullptr};
+    PooledBuffer data;
+    size_t messages {0};
+};
+
+struct BatchState {
+    unsigned depth {0};
+    std::vector<PendingWrite> pending;
+    size_t used {0};
+};
+
+thread_local BatchState batch;
+
+// Storage of a batch entry bigger than that is given back to the pool
+constexpr size_t batch_keep_capacity = 64 * 1024;
+
+// Messages reserved outside of a batch entry
+thread_local PooledBuffer scratch;
+// Batch entry holding the message reserved by the thread,
+// null if it is in `scratch`
+thread_local PendingWrite* reserved {nullptr};
+
+PendingWrite& pending_write(SwitchConnection* conn)
+{
+    for (size_t i = 0; i < batch.used; ++i) {
+        if (batch.pending[i].conn == conn)
+            return batch.pending[i];
+    }
+
+    if (batch.used == batch.pending.size())
+        batch.pending.emplace_back();
+    PendingWrite& entry = batch.pending[batch.used++];
+    entry.conn = conn;
+    return entry;
+}
+
+// Threads take counter slots of every connection round-robin
+std::atomic<size_t> last_counter_slot {0};
+
+// Outermost SendBundle of the thread still collecting messages
+thread_local SendBundle* current_bundle {nullptr};
+
+} // anonymous namespace
+
+uint64_t MessageCounters::totalMessages() const
+{
+    uint64_t ret = 0;
+    for (uint64_t n : messages) ret += n;
+    return ret;
+}
+
+uint64_t MessageCounters::totalBytes() const
+{
+    uint64_t ret = 0;
+    for (uint64_t n : bytes) ret += n;
+    return ret;
+}
+
+SwitchConnection::CounterSlots SwitchConnection::allocateSlots(size_t n)
+{
+    void* mem = nullptr;
+    if (posix_memalign(&mem, alignof(CounterSlot), n * sizeof(CounterSlot)))
+        throw std::bad_alloc();
+    auto slots = static_cast<CounterSlot*>(mem);
+    for (size_t i = 0; i < n; ++i)
+        new (slots + i) CounterSlot();
+    return CounterSlots(slots);
+}
+
+void SwitchConnection::FreeSlots::operator()(CounterSlot* slots) const
+{
+    static_assert(std::is_trivially_destructible<CounterSlot>::value,
+                  "slots are freed without destruction");
+    free(slots);
+}
+
+size_t SwitchConnection::counterSlots()
+{
+    static const size_t n =
+        std::max(2 * std::thread::hardware_concurrency(), 8u);
+    return n;
+}
+
+void SwitchConnection::CounterSlot::add(uint8_t type, size_t len)
+{
+    size_t i = MessageCounters::index(type);
+    messages[i].fetch_add(1, std::memory_order_relaxed);
+    bytes[i].fetch_add(len, std::memory_order_relaxed);
+}
+
+void SwitchConnection::CounterSlot::sum(MessageCounters& ret) const
+{
+    for (size_t i = 0; i < MessageCounters::ntypes; ++i) {
+        ret.messages[i] += messages[i].load(std::memory_order_relaxed);
+        ret.bytes[i] += bytes[i].load(std::memory_order_relaxed);
+    }
+}
+
 bool SwitchConnection::alive() const
 {
-    return m_ofconn ? m_ofconn->is_alive() : false;
+    return m_ofconn ? m_ofconn->alive() : false;
 }
 
 uint8_t SwitchConnection::version() const
 { 
-    return m_ofconn ? m_ofconn->get_version() : 0;
+    return m_ofconn ? m_ofconn->version() : 0;
 }
 
 void SwitchConnection::send(const fluid_msg::OFMsg& cmsg)
 {
-    if (not m_ofconn || not m_ofconn->is_alive()) return;
+    if (not m_ofconn || not m_ofconn->alive()) return;
 
     auto& msg = const_cast<fluid_msg::OFMsg&>(cmsg);
     auto buf = msg.pack();
-    m_ofconn->send(buf, msg.length());
+    send(buf, msg.length());
     fluid_msg::OFMsg::free_buffer(buf);
 }
 
+void SwitchConnection::send(const void* data, size_t len)
+{
+    if (not m_ofconn || not m_ofconn->alive()) return;
+
+    countSent(data, len);
+
+    if (current_bundle && bundles() &&
+        current_bundle->append(this, data, len))
+        return;
+
+    if (batch.depth > 0) {
+        SendBatch::append(this, data, len);
+    } else {
+        write(const_cast<void*>(data), len, 1);
+    }
+}
+
+uint8_t* SwitchConnection::reserve(size_t len)
+{
+    if (not m_ofconn || not m_ofconn->alive()) return nullptr;
+
+    if (batch.depth > 0 && not (current_bundle && bundles())) {
+        reserved = &pending_write(this);
+        return reserved->data.extend(len);
+    }
+    reserved = nullptr;
+    scratch.clear();
+    return scratch.extend(len);
+}
+
+void SwitchConnection::sendReserved(uint8_t* buf, size_t len)
+{
+    if (reserved) {
+        countSent(buf, len);
+        ++reserved->messages;
+        reserved = nullptr;
+    } else {
+        send(buf, len);
+    }
+}
+
+void SwitchConnection::write(void* data, size_t len, size_t nmsgs)
+{
+    if (not m_ofconn || not m_ofconn->alive()) return;
+
+    m_ofconn->send(data, len);
+    m_flushes.fetch_add(1, std::memory_order_relaxed);
+    m_messages.fetch_add(nmsgs, std::memory_order_relaxed);
+    m_bytes.fetch_add(len, std::memory_order_relaxed);
+}
+
+SendStats SwitchConnection::sendStats() const
+{
+    SendStats ret;
+    ret.flushes = m_flushes.load(std::memory_order_relaxed);
+    ret.messages = m_messages.load(std::memory_order_relaxed);
+    ret.bytes = m_bytes.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void SwitchConnection::countSent(const void* data, size_t len)
+{
+    static thread_local size_t slot =
+        last_counter_slot.fetch_add(1, std::memory_order_relaxed) % counterSlots();
+    CounterSlot& counters = m_sent[slot];
+
+    auto p = static_cast<const uint8_t*>(data);
+    while (len >= 8) {
+        size_t msg_len = size_t(p[2]) << 8 | p[3];
+        if (msg_len < 8 || msg_len > len)
+            break;
+        counters.add(p[1], msg_len);
+        p += msg_len;
+        len -= msg_len;
+    }
+}
+
+void SwitchConnection::received(uint8_t type, size_t len)
+{
+    m_received[0].add(type, len);
+}
+
+void SwitchConnection::parseError()
+{
+    m_parse_errors.fetch_add(1, std::memory_order_relaxed);
+}
+
+ConnectionTelemetry SwitchConnection::telemetry() const
+{
+    ConnectionTelemetry ret;
+    m_received[0].sum(ret.received);
+    for (size_t i = 0; i < counterSlots(); ++i) {
+        m_sent[i].sum(ret.sent);
+    }
+    ret.parse_errors = m_parse_errors.load(std::memory_order_relaxed);
+    ret.transport = transportStats();
+    return ret;
+}
+
+OFTransportStats SwitchConnection::transportStats() const
+{
+    OFTransportConnection* ofconn = m_ofconn;
+    return ofconn ? ofconn->stats() : OFTransportStats();
+}
+
 void SwitchConnection::close()
 { 
     if (m_ofconn) m_ofconn->close(), m_ofconn = nullptr;
 }
 
-SwitchConnection::SwitchConnection(OFConnection* ofconn, uint64_t dpid)
+SwitchConnection::SwitchConnection(OFTransportConnection* ofconn, uint64_t dpid)
     : m_dpid(dpid), m_ofconn(ofconn)
 { }
 
+SendBundle::SendBundle()
+{
+    if (current_bundle == nullptr)
+        current_bundle = this;
+}
+
+SendBundle::~SendBundle()
+{
+    if (current_bundle == this)
+        current_bundle = nullptr;
+}
+
+std::vector<SendBundle::Part> SendBundle::take()
+{
+    if (current_bundle == this)
+        current_bundle = nullptr;
+    return std::move(m_parts);
+}
+
+bool SendBundle::append(SwitchConnection* conn, const void* data, size_t len)
+{
+    auto msgs = static_cast<const uint8_t*>(data);
+
+    // Messages can't be split between the bundle and the connection
+    for (size_t off = 0; off + 8 <= len; ) {
+        size_t msg_len = size_t(msgs[off + 2]) << 8 | msgs[off + 3];
+        if (msg_len < 8 || off + msg_len > len ||
+            not OFBundle::bundleable(msgs + off, msg_len) ||
+            OFBundle::add_header_len + msg_len > 0xffff)
+            return false;
+        off += msg_len;
+    }
+
+    Part* part = nullptr;
+    for (auto& p : m_parts) {
+        if (p.conn == conn) {
+            part = &p;
+            break;
+        }
+    }
+    if (part == nullptr) {
+        uint32_t id = conn->m_last_bundle.fetch_add(1, std::memory_order_relaxed) + 1;
+        m_parts.push_back(Part{conn, id, PooledBuffer(), 0});
+        part = &m_parts.back();
+    }
+
+    const uint16_t flags = OFBundle::ATOMIC | OFBundle::ORDERED;
+    for (size_t off = 0; off + 8 <= len; ) {
+        size_t msg_len = size_t(msgs[off + 2]) << 8 | msgs[off + 3];
+        OFBundle::add(part->data, part->id, flags, msgs + off, msg_len);
+        ++part->messages;
+        off += msg_len;
+    }
+    return true;
+}
+
+SendBatch::SendBatch()
+{
+    ++batch.depth;
+}
+
+SendBatch::~SendBatch()
+{
+    if (--batch.depth == 0)
+        flush();
+}
+
+void SendBatch::append(SwitchConnection* conn, const void* data, size_t len)
+{
+    PendingWrite& entry = pending_write(conn);
+    entry.data.append(data, len);
+    ++entry.messages;
+}
+
+void SendBatch::flush()
+{
+    for (size_t i = 0; i < batch.used; ++i) {
+        PendingWrite& entry = batch.pending[i];
+        // Transport writes from the buffer itself and copies
+        // only what the socket didn't take
+        entry.conn->write(entry.data.data(), entry.data.size(), entry.messages);
+        entry.conn = nullptr;
+        // Storage is kept for the next batch
+        if (entry.data.capacity() > batch_keep_capacity)
+            entry.data.reset();
+        else
+            entry.data.clear();
+        entry.messages = 0;
+    }
+    batch.used = 0;
+}
+
 } // namespace runos
@@ -1,24 +1,65 @@
 #pragma once
 
 #include "SwitchConnectionFwd.hh"
+#include "BufferPool.hh"
+#include "OFTransport.hh"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
+#include <memory>
+#include <vector>
 
 #include <QMetaType>
 
 /** @file */
 
-namespace fluid_base {
-class OFConnection;
-}
-
 namespace fluid_msg {
 class OFMsg;
 }
 
 namespace runos {
 
+/**
+ * Counters of writes made to the switch connection.
+ */
+struct SendStats {
+    uint64_t flushes {0};  ///< writes handed to the transport
+    uint64_t messages {0}; ///< messages contained in these writes
+    uint64_t bytes {0};
+};
+
+/**
+ * Messages and bytes of every OpenFlow type passed in one direction.
+ */
+struct MessageCounters {
+    // OpenFlow 1.3 types, the last one also counts unknown types
+    static constexpr size_t ntypes = 32;
+    std::array<uint64_t, ntypes> messages {};
+    std::array<uint64_t, ntypes> bytes {};
+
+    static size_t index(uint8_t type)
+    { return std::min<size_t>(type, ntypes - 1); }
+
+    uint64_t totalMessages() const;
+    uint64_t totalBytes() const;
+};
+
+/**
+ * Control channel counters of a switch connection.
+ */
+struct ConnectionTelemetry {
+    MessageCounters received;
+    MessageCounters sent;
+    uint64_t parse_errors {0};
+    /// Packet-in's per second over the last telemetry interval
+    double packet_in_rate {0};
+    /// Bytes, send queue depth and echo RTT seen by the transport
+    OFTransportStats transport;
+};
+
 /**
  * Connection with physical switch for OpenFlow communication
  */
@@ -36,17 +77,172 @@ public:
     uint8_t version() const;
 
     /**
-     * Send OpenFlow message to switch
+     * Switch keeps packets sent to controller in its buffers,
+     * so they may be truncated without losing the payload.
+     */
+    bool buffered() const
+    { return m_buffered.load(std::memory_order_relaxed); }
+
+    /**
+     * Switch applies bundles of messages atomically, see SendBundle.
+     * Known shortly after the switch is up, false until then.
+     */
+    bool bundles() const
+    { return m_bundles.load(std::memory_order_relaxed); }
+
+    /**
+     * Switch has the packet-in meter, see Controller::packetInMeter().
+     * Known shortly after the switch is up, false until then.
+     */
+    bool meters() const
+    { return m_meters.load(std::memory_order_relaxed); }
+
+    /**
+     * Send OpenFlow message to switch.
+     * Inside of SendBatch scope the message is queued and written
+     * later together with other messages of the batch.
      *
      * @param msg message.
      */
     void send(const fluid_msg::OFMsg& msg);
 
+    /**
+     * Send already packed OpenFlow message(s), same as above.
+     */
+    void send(const void* data, size_t len);
+
+    /**
+     * Send message of `len` bytes written by `encode(uint8_t* buf)`
+     * straight into pooled output memory, see OFEncode.
+     * Same as above otherwise.
+     */
+    template<class Encode>
+    void send(size_t len, Encode&& encode)
+    {
+        if (uint8_t* buf = reserve(len)) {
+            encode(buf);
+            sendReserved(buf, len);
+        }
+    }
+
     void close();
 
+    /** Write statistics of this connection */
+    SendStats sendStats() const;
+
+    /** Traffic and TLS counters kept by the transport */
+    OFTransportStats transportStats() const;
+
+    /**
+     * Messages by type in both directions and transport counters.
+     * Packet-in rate is known to Controller::telemetry() only.
+     */
+    ConnectionTelemetry telemetry() const;
+
 protected:
-    fluid_base::OFConnection* m_ofconn;
-    SwitchConnection(fluid_base::OFConnection* ofconn, uint64_t dpid);
+    OFTransportConnection* m_ofconn;
+    std::atomic<bool> m_buffered {true};
+    std::atomic<bool> m_bundles {false};
+    std::atomic<bool> m_meters {false};
+    SwitchConnection(OFTransportConnection* ofconn, uint64_t dpid);
+
+    // Called by the I/O thread for every message of the switch
+    void received(uint8_t type, size_t len);
+    void parseError();
+
+private:
+    friend class SendBatch;
+    friend class SendBundle;
+    // Memory for a message in the thread's batch, or in a scratch
+    // buffer if it may go to a bundle or isn't batched
+    uint8_t* reserve(size_t len);
+    void sendReserved(uint8_t* buf, size_t len);
+    void write(void* data, size_t len, size_t nmsgs);
+    void countSent(const void* data, size_t len);
+
+    std::atomic<uint64_t> m_flushes {0};
+    std::atomic<uint64_t> m_messages {0};
+    std::atomic<uint64_t> m_bytes {0};
+
+    // Counters of one direction on their own cache lines. Messages
+    // are sent by many threads, a thread takes the next slot when it
+    // sends the first time. There are two slots per hardware thread,
+    // enough for I/O threads and Maple workers, more threads share them.
+    struct alignas(64) CounterSlot {
+        std::array<std::atomic<uint64_t>, MessageCounters::ntypes> messages;
+        std::array<std::atomic<uint64_t>, MessageCounters::ntypes> bytes;
+
+        void add(uint8_t type, size_t len);
+        void sum(MessageCounters& ret) const;
+    };
+    // Plain new doesn't align them before C++17
+    struct FreeSlots {
+        void operator()(CounterSlot* slots) const;
+    };
+    typedef std::unique_ptr<CounterSlot[], FreeSlots> CounterSlots;
+    static CounterSlots allocateSlots(size_t n);
+    static size_t counterSlots();
+
+    CounterSlots m_received {allocateSlots(1)};
+    CounterSlots m_sent {allocateSlots(counterSlots())};
+    std::atomic<uint64_t> m_parse_errors {0};
+    std::atomic<uint32_t> m_last_bundle {0};
+};
+
+/**
+ * Corks messages sent by the current thread until the end of scope.
+ * Messages are grouped by connection and every group is written
+ * with a single call, preserving the order they were sent in.
+ * Nested batches join the outermost one.
+ */
+class SendBatch {
+public:
+    SendBatch();
+    ~SendBatch();
+
+    SendBatch(const SendBatch&) = delete;
+    SendBatch& operator=(const SendBatch&) = delete;
+
+    /** Write messages queued by the current thread now */
+    static void flush();
+
+private:
+    friend class SwitchConnection;
+    static void append(SwitchConnection* conn, const void* data, size_t len);
+};
+
+/**
+ * Collects flow and group modifications sent by the current thread
+ * to switches supporting bundles until the end of scope or take().
+ * Controller::commitBundle sends them as a single atomic bundle
+ * per switch, messages not taken are dropped.
+ * Other messages and other switches aren't affected.
+ * Nested objects collect nothing.
+ */
+class SendBundle {
+public:
+    struct Part {
+        SwitchConnection* conn;
+        uint32_t id;
+        PooledBuffer data; ///< bundle add messages
+        size_t messages;
+    };
+
+    SendBundle();
+    ~SendBundle();
+
+    SendBundle(const SendBundle&) = delete;
+    SendBundle& operator=(const SendBundle&) = delete;
+
+    /** Stops collecting and returns messages of every switch */
+    std::vector<Part> take();
+
+private:
+    friend class SwitchConnection;
+    // false if the message has to be sent as usual
+    bool append(SwitchConnection* conn, const void* data, size_t len);
+
+    std::vector<Part> m_parts;
 };
 
 } // namespace runos
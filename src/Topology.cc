@@ -90,12 +90,23 @@ typedef TopologyGraph::vertex_descriptor
     vertex_descriptor;
 
 struct TopologyImpl {
+    // Routes are computed by Maple workers concurrently,
+    // links are changed on the Qt thread
     QReadWriteLock graph_mutex;
 
     TopologyGraph graph;
     std::unordered_map<uint64_t, vertex_descriptor>
         vertex_map;
 
+    // Doesn't change the graph, safe under the read lock
+    bool find(uint64_t dpid, vertex_descriptor& v) const {
+        auto it = vertex_map.find(dpid);
+        if (it == vertex_map.end())
+            return false;
+        v = it->second;
+        return true;
+    }
+
     vertex_descriptor vertex(uint64_t dpid) {
         auto it = vertex_map.find(dpid);
         if (it != vertex_map.end()) {
@@ -169,9 +180,13 @@ data_link_route Topology::computeRoute(uint64_t from_dpid, uint64_t to_dpid)
     QReadLocker locker(&m->graph_mutex);
     const auto& graph = m->graph;
     vector_property_map<vertex_descriptor> p;
-    vertex_descriptor v = m->vertex(from_dpid);
+    vertex_descriptor v, to;
 
-    dijkstra_shortest_paths_no_color_map(graph, m->vertex(to_dpid),
+    // Switches without links have no route to others
+    if (not m->find(from_dpid, v) || not m->find(to_dpid, to))
+        return data_link_route();
+
+    dijkstra_shortest_paths_no_color_map(graph, to,
          weight_map( boost::get(&link_property::weight, graph) )
         .predecessor_map( p )
     );
@@ -208,8 +223,10 @@ void Topology::apply(std::function<void(const TopologyGraph&)> f) const
 
 json11::Json Topology::handleGET(std::vector<std::string> params, std::string body)
 {
-    if (params[0] == "links")
+    if (params[0] == "links") {
+        QReadLocker locker(&m->graph_mutex);
         return json11::Json(topo).dump();
+    }
 
     return "{}";
 }
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <exception>
 #include <type_traits>
 
@@ -37,6 +38,12 @@ public:
 
     virtual void modify(oxm::field<> patch) = 0;
 
+    // Big-endian bytes of the field kept in place, or nullptr.
+    // Lets hot paths read the field without building oxm::field<>,
+    // they must use load() when it returns nullptr.
+    virtual const uint8_t* raw(oxm::type) const noexcept
+    { return nullptr; }
+
     virtual ~Packet() noexcept = default;
 
     ////////////////////////
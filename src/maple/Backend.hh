@@ -16,13 +16,43 @@ struct Backend {
     virtual void remove(unsigned priority,
                         oxm::field_set const& match) = 0;
     virtual void remove(oxm::field_set const& match) = 0;
+    // Rules installed by install() with the same arguments
+    virtual void remove(unsigned priority,
+                        oxm::expirementer::full_field_set const& match,
+                        FlowPtr flow) = 0;
+    // Installs rules of the flow at the new priority
+    // if the flow has them on switches
+    virtual void reinstall(unsigned priority,
+                           oxm::expirementer::full_field_set const& match,
+                           FlowPtr flow) = 0;
 
     // test would be repeated in match
     virtual void barrier_rule(unsigned priority,
                             oxm::expirementer::full_field_set const& match,
                             oxm::field<> const& test,
                             uint64_t id) = 0;
+    // Removes rule installed by barrier_rule() with the same arguments
+    virtual void remove_barrier_rule(unsigned priority,
+                            oxm::expirementer::full_field_set const& match,
+                            oxm::field<> const& test,
+                            uint64_t id) = 0;
     virtual void barrier() { }
+
+    // Modifications made until commit_bundle() may be applied
+    // by switches at once. Barriers still order them on switches
+    // applying modifications one by one.
+    virtual void begin_bundle() { }
+    virtual void commit_bundle() { }
+
+    // Rules given by install(), reinstall() and barrier_rule()
+    // until end_sync() replace all rules of the table. Backend
+    // knowing rules on switches may send only the difference.
+    virtual void begin_sync()
+    {
+        remove(oxm::field_set{});
+        barrier();
+    }
+    virtual void end_sync() { }
 };
 
 } // namespace maple
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Epoch.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace runos {
+namespace maple {
+
+namespace {
+
+// Epoch seen by a reader thread, 0 outside of guards
+struct Record {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> used{true};
+    unsigned nesting{0};
+    Record* next{nullptr};
+    // Records are written by different threads
+    char padding[64];
+};
+
+struct Retired {
+    void* ptr;
+    void (*deleter)(void*);
+    uint64_t epoch;
+};
+
+std::atomic<uint64_t> global_epoch{1};
+// Records of exited threads are reused, never freed
+std::atomic<Record*> records{nullptr};
+
+std::mutex retired_mutex;
+std::vector<Retired> retired;
+
+Record* acquire_record()
+{
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next) {
+        bool used = false;
+        if (r->used.compare_exchange_strong(used, true))
+            return r;
+    }
+
+    Record* r = new Record;
+    Record* head = records.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while (not records.compare_exchange_weak(head, r,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+    return r;
+}
+
+struct ThreadRecord {
+    Record* record{acquire_record()};
+
+    ~ThreadRecord()
+    {
+        record->epoch.store(0, std::memory_order_release);
+        record->used.store(false, std::memory_order_release);
+    }
+};
+
+Record& thread_record()
+{
+    static thread_local ThreadRecord local;
+    return *local.record;
+}
+
+// Moves the epoch forward if every reader inside a guard has seen it
+uint64_t try_advance()
+{
+    // Pairs with the fence of Guard, objects retired by the caller
+    // are unlinked before readers are checked
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    uint64_t epoch = global_epoch.load(std::memory_order_relaxed);
+    for (Record* r = records.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t seen = r->epoch.load(std::memory_order_acquire);
+        if (seen != 0 && seen != epoch)
+            return epoch;
+    }
+
+    if (global_epoch.compare_exchange_strong(epoch, epoch + 1))
+        return epoch + 1;
+    return epoch;
+}
+
+} // anonymous namespace
+
+Epoch::Guard::Guard()
+{
+    Record& r = thread_record();
+    if (r.nesting++ == 0) {
+        r.epoch.store(global_epoch.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+Epoch::Guard::~Guard()
+{
+    Record& r = thread_record();
+    if (--r.nesting == 0) {
+        r.epoch.store(0, std::memory_order_release);
+    }
+}
+
+void Epoch::retire(void* ptr, void (*deleter)(void*))
+{
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        retired.push_back(Retired{ptr, deleter,
+                global_epoch.load(std::memory_order_acquire)});
+    }
+    collect();
+}
+
+size_t Epoch::collect()
+{
+    std::vector<Retired> ready;
+    size_t waiting;
+    {
+        std::lock_guard<std::mutex> lock(retired_mutex);
+        // Readers seeing the object have left when the epoch
+        // moved twice after it was retired
+        uint64_t epoch = try_advance();
+        auto it = std::partition(retired.begin(), retired.end(),
+                [epoch](const Retired& r) { return r.epoch + 2 > epoch; });
+        ready.assign(it, retired.end());
+        retired.erase(it, retired.end());
+        waiting = retired.size();
+    }
+
+    for (auto& r : ready) {
+        r.deleter(r.ptr);
+    }
+    return waiting;
+}
+
+} // namespace maple
+} // namespace runos
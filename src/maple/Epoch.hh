@@ -0,0 +1,61 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace runos {
+namespace maple {
+
+/**
+ * Epoch-based reclamation of objects read without locks.
+ *
+ * Readers access shared objects only inside an Epoch::Guard.
+ * Writer unlinks an object so new readers can't reach it and retires it,
+ * the object is deleted after every reader which could see it has left
+ * its guard. Guards are cheap and may be nested.
+ */
+class Epoch {
+public:
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    /** Deletes `ptr` when no reader can reference it. Thread-safe. */
+    template<class T>
+    static void retire(T* ptr)
+    {
+        retire(ptr, [](void* p) { delete static_cast<T*>(p); });
+    }
+
+    static void retire(void* ptr, void (*deleter)(void*));
+
+    /**
+     * Deletes retired objects not referenced anymore.
+     * Called by retire(), may be called to free memory sooner.
+     * @return number of objects still waiting.
+     */
+    static size_t collect();
+};
+
+} // namespace maple
+} // namespace runos
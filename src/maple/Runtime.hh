@@ -55,6 +55,7 @@ public:
         return {flow, installer};
     }
 
+    // Thread-safe, other methods are called by the owner thread
     FlowPtr operator()(Packet& pkt)
     {
         auto flow = trace_tree->lookup(pkt);
@@ -71,9 +72,15 @@ public:
         trace_tree->update();
     }
 
+    // Returns true when the whole tree was collected
+    bool gc(std::chrono::steady_clock::duration budget)
+    {
+        return trace_tree->gc(budget);
+    }
+
     void invalidate()
     {
-        trace_tree.reset(new TraceTree{backend});
+        trace_tree->clear();
     }
 };
 
@@ -16,8 +16,11 @@
 
 #include "TraceTree.hh"
 
+#include <atomic>
 #include <unordered_map>
-#include <cmath>
+#include <vector>
+#include <limits>
+#include <tuple>
 
 #include <boost/variant/variant.hpp>
 #include <boost/variant/get.hpp>
@@ -27,6 +30,7 @@
 #include <boost/optional.hpp>
 
 #include "api/Packet.hh"
+#include "Epoch.hh"
 #include "TraceablePacketImpl.hh"
 
 namespace runos {
@@ -70,7 +74,6 @@ struct TraceTree::load_node {
 };
 
 struct TraceTree::Impl {
-    class Lookup;
     class Compiler;
     class TracerImpl;
     class PriorityUpdater;
@@ -82,6 +85,9 @@ class TraceTree::Impl::Compiler : public boost::static_visitor<>
     oxm::expirementer::full_field_set match;
 
 public:
+    // Give rules of flows already having them instead of new ones
+    bool reinstall{false};
+
     Compiler(Backend& backend,
             const oxm::expirementer::full_field_set &match)
         : backend(backend), match(match)
@@ -132,63 +138,524 @@ public:
 
     void operator()(flow_node& node)
     {
-        if (auto flow = node.flow.lock())
+        auto flow = node.flow.lock();
+        if (not flow)
+            return;
+        if (reinstall)
+            backend.reinstall(node.prio, match, flow);
+        else
             backend.install(node.prio, match, flow);
     }
 
 };
 
-class TraceTree::Impl::Lookup : public boost::static_visitor<FlowPtr>
-{
-    const Packet& pkt;
-public:
-    explicit Lookup(const Packet& pkt)
-        : pkt(pkt)
-    { }
+// Lookup program: the tree lowered to an array of instructions.
+// Fields are read from packet bytes and compared as integers,
+// loads with few cases scan them inline and bigger ones use
+// a hash table. Instruction of a node keeps its index while
+// the node is alive, so the tracer patches only the nodes on its path.
+//
+// Lookups of any thread read the program without locks while the tree
+// owner changes it. Instruction is filled before its kind is published
+// and stays the same after that, except cases added to a load, targets
+// and the flow of a leaf, each published by a single store. Replaced
+// tables, flows and chunk directories are retired to Epoch.
+//
+// Node pruned by gc() gets a new empty instruction, the old ones are
+// left for running lookups until the program is rebuilt.
+struct TraceTree::Program {
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+    static constexpr unsigned inline_cases = 4;
+    static constexpr unsigned chunk_size = 256;
+
+    enum Kind : uint8_t {
+        MISS,      // unexplored
+        FLOW,      // leaf, see flow
+        TEST,      // next[0] if matches value, next[1] otherwise
+        LOAD,      // inline keys or table
+        WIDE_TEST, // fields wider than 64 bits, IPv6 addresses
+        WIDE_LOAD  // always uses wide table
+    };
+
+    // Up to 128 bits
+    struct Wide {
+        uint64_t hi, lo;
+
+        bool operator==(const Wide& other) const
+        { return hi == other.hi && lo == other.lo; }
+    };
+
+    static uint64_t mix(uint64_t k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    struct KeyHash {
+        size_t operator()(uint64_t k) const { return mix(k); }
+    };
+
+    struct WideHash {
+        size_t operator()(const Wide& w) const { return mix(w.hi ^ mix(w.lo)); }
+    };
+
+    // Open addressing filled by a single writer,
+    // slot is published by its target
+    template<class Key, class Hash>
+    struct Table {
+        struct Slot {
+            Key key;
+            std::atomic<uint32_t> target{none};
+        };
+
+        std::vector<Slot> slots;
+        size_t size{0};
+
+        explicit Table(size_t capacity)
+            : slots(capacity)
+        { }
+
+        uint32_t find(const Key& key) const
+        {
+            size_t mask = slots.size() - 1;
+            for (size_t i = Hash()(key) & mask; ; i = (i + 1) & mask) {
+                uint32_t target = slots[i].target.load(std::memory_order_acquire);
+                if (target == none)
+                    return none;
+                if (slots[i].key == key)
+                    return target;
+            }
+        }
+
+        // False if the table has to grow first
+        bool insert(const Key& key, uint32_t target)
+        {
+            if ((size + 1) * 2 > slots.size())
+                return false;
+            size_t mask = slots.size() - 1;
+            for (size_t i = Hash()(key) & mask; ; i = (i + 1) & mask) {
+                if (slots[i].target.load(std::memory_order_relaxed) == none) {
+                    slots[i].key = key;
+                    slots[i].target.store(target, std::memory_order_release);
+                    ++size;
+                    return true;
+                }
+                if (slots[i].key == key) {
+                    slots[i].target.store(target, std::memory_order_release);
+                    return true;
+                }
+            }
+        }
 
-    FlowPtr operator()(const unexplored&) const
+        Table* grown() const
+        {
+            Table* ret = new Table(slots.size() * 2);
+            for (auto& slot : slots) {
+                uint32_t target = slot.target.load(std::memory_order_relaxed);
+                if (target != none)
+                    ret->insert(slot.key, target);
+            }
+            return ret;
+        }
+    };
+
+    using NarrowTable = Table<uint64_t, KeyHash>;
+    using WideTable = Table<Wide, WideHash>;
+
+    struct FlowRef {
+        std::weak_ptr<Flow> flow;
+    };
+
+    struct Insn {
+        std::atomic<Kind> kind{MISS};
+        std::atomic<uint8_t> ncases{0};
+        oxm::type type{0, 0, false, 0};
+        uint64_t mask{0};
+        uint64_t value{0};
+        uint64_t mask_hi{0};
+        uint64_t value_hi{0};
+        std::atomic<uint32_t> next[inline_cases];
+        uint64_t keys[inline_cases];
+        std::atomic<NarrowTable*> table{nullptr};
+        std::atomic<WideTable*> wide{nullptr};
+        std::atomic<FlowRef*> flow{nullptr};
+    };
+
+    // Replaced when a chunk is added, chunks are owned by the program
+    struct Directory {
+        std::vector<Insn*> chunks;
+    };
+
+    struct Lowered {
+        uint32_t pc;
+        size_t cases; // of a load
+    };
+
+    std::atomic<const Directory*> directory;
+    // Rest is used by the tree owner only
+    uint32_t size{0};
+    // Instructions not reachable anymore
+    uint32_t garbage{0};
+    // Instruction of every lowered node
+    std::unordered_map<const node*, Lowered> index;
+
+    explicit Program(const node& root)
+        : directory(new Directory)
     {
+        lower(root);
+    }
+
+    ~Program()
+    {
+        const Directory* dir = directory.load(std::memory_order_relaxed);
+        for (Insn* chunk : dir->chunks) {
+            for (unsigned i = 0; i < chunk_size; ++i) {
+                delete chunk[i].table.load(std::memory_order_relaxed);
+                delete chunk[i].wide.load(std::memory_order_relaxed);
+                delete chunk[i].flow.load(std::memory_order_relaxed);
+            }
+            delete[] chunk;
+        }
+        delete dir;
+    }
+
+    // Replaces the program seen by lookups
+    static void publish(std::atomic<Program*>& slot, Program* program)
+    {
+        Program* old = slot.exchange(program, std::memory_order_acq_rel);
+        if (old)
+            Epoch::retire(old);
+    }
+
+    // Nodes traced from the root, only they may have changed
+    void trace(const std::vector<node*>& path)
+    {
+        for (const node* n : path) {
+            if (not n)
+                continue;
+            auto it = index.find(n);
+            if (it == index.end())
+                lower(*n);
+            else
+                emit(*n, it->second.pc);
+        }
+    }
+
+    // Node pruned by gc() is unexplored now, `parent` reaches it
+    // by `key` if it is a load
+    void prune(const node& n, const node& parent, const bits<>* key)
+    {
+        auto it = index.find(&n);
+        auto up = index.find(&parent);
+        if (it == index.end() || up == index.end())
+            return;
+
+        uint32_t pc = allocate();
+        it->second = Lowered{pc, 0};
+        ++garbage;
+
+        Insn& insn = at(up->second.pc);
+        if (const test_node* test = boost::get<test_node>(&parent)) {
+            insn.next[&test->positive == &n ? 0 : 1]
+                .store(pc, std::memory_order_release);
+        } else {
+            add_case(insn, *key, pc);
+        }
+    }
+
+    // Node was deleted by gc()
+    void forget(const node& n)
+    {
+        if (index.erase(&n))
+            ++garbage;
+    }
+
+    // Case was deleted from the load by gc(),
+    // its key leads to an empty instruction
+    void forget_case(const node& load)
+    {
+        auto it = index.find(&load);
+        if (it != index.end())
+            --it->second.cases;
+    }
+
+    FlowPtr run(const Packet& pkt) const
+    {
+        uint32_t pc = 0;
+        while (pc != none) {
+            const Insn& insn = at(pc);
+            switch (insn.kind.load(std::memory_order_acquire)) {
+            case MISS:
+                return nullptr;
+            case FLOW:
+                return insn.flow.load(std::memory_order_acquire)->flow.lock();
+            case TEST:
+                pc = insn.next[read(pkt, insn) == insn.value ? 0 : 1]
+                         .load(std::memory_order_acquire);
+                break;
+            case LOAD:
+                pc = find(insn, read(pkt, insn));
+                break;
+            case WIDE_TEST:
+                pc = insn.next[read_wide(pkt, insn) ==
+                               Wide{insn.value_hi, insn.value} ? 0 : 1]
+                         .load(std::memory_order_acquire);
+                break;
+            case WIDE_LOAD:
+                pc = insn.wide.load(std::memory_order_acquire)
+                         ->find(read_wide(pkt, insn));
+                break;
+            }
+        }
         return nullptr;
     }
 
-    FlowPtr operator()(const test_node& test) const
+private:
+    Insn& at(uint32_t pc) const
     {
-        if (pkt.test(test.need))
-            return boost::apply_visitor(*this, test.positive);
-        else
-            return boost::apply_visitor(*this, test.negative);
+        // Loaded again every time, index may come from
+        // an instruction published after the previous load
+        const Directory* dir = directory.load(std::memory_order_acquire);
+        return dir->chunks[pc / chunk_size][pc % chunk_size];
     }
 
-    FlowPtr operator()(const load_node& load) const
+    uint32_t allocate()
     {
-        auto it = load.cases.find( pkt.load(load.mask).value_bits() );
-        if (it != load.cases.end())
-            return boost::apply_visitor(*this, it->second);
-        else
-            return nullptr;
+        uint32_t pc = size++;
+        const Directory* dir = directory.load(std::memory_order_relaxed);
+        if (pc / chunk_size == dir->chunks.size()) {
+            Directory* grown = new Directory(*dir);
+            grown->chunks.push_back(new Insn[chunk_size]);
+            directory.store(grown, std::memory_order_release);
+            Epoch::retire(const_cast<Directory*>(dir));
+        }
+        return pc;
     }
 
-    FlowPtr operator()(const vload_node& vload) const
+    static Wide big_endian(const uint8_t* data, size_t len)
     {
-        auto it = vload.cases.find( pkt.load(vload.mask).value_bits() );
-        if (it != vload.cases.end())
-            return boost::apply_visitor(*this, *it->second);
-        else
-            return nullptr;
+        Wide ret{0, 0};
+        for (size_t i = 0; i < len; ++i) {
+            ret.hi = ret.hi << 8 | ret.lo >> 56;
+            ret.lo = ret.lo << 8 | data[i];
+        }
+        return ret;
     }
 
-    FlowPtr operator()(const flow_node& leaf) const
+    static Wide words(const bits<>& b)
     {
-        if (auto flow = leaf.flow.lock())
-            return flow;
-        else
-            return nullptr;
+        uint8_t buf[16];
+        b.to_buffer(buf);
+        return big_endian(buf, b.num_blocks());
+    }
+
+    static uint64_t read(const Packet& pkt, const Insn& insn)
+    {
+        uint64_t ret = 0;
+        if (const uint8_t* raw = pkt.raw(insn.type)) {
+            for (size_t i = 0; i < insn.type.nbytes(); ++i) {
+                ret = ret << 8 | raw[i];
+            }
+        } else {
+            oxm::mask<> mask {insn.type, bits<>(insn.type.nbits(), insn.mask)};
+            ret = pkt.load(mask).value_bits().to_ulong();
+        }
+        return ret & insn.mask;
+    }
+
+    static Wide read_wide(const Packet& pkt, const Insn& insn)
+    {
+        Wide ret;
+        if (const uint8_t* raw = pkt.raw(insn.type)) {
+            ret = big_endian(raw, insn.type.nbytes());
+        } else {
+            // bits<> reads a byte before the buffer
+            uint8_t buf[17] = {0};
+            for (unsigned i = 0; i < 8; ++i) {
+                buf[1 + i] = insn.mask_hi >> (56 - 8 * i);
+                buf[9 + i] = insn.mask >> (56 - 8 * i);
+            }
+            size_t nbytes = insn.type.nbytes();
+            bits<> mask_bits(insn.type.nbits(), buf + sizeof(buf) - nbytes);
+            ret = words(pkt.load(oxm::mask<>{insn.type, mask_bits}).value_bits());
+        }
+        return Wide{ret.hi & insn.mask_hi, ret.lo & insn.mask};
+    }
+
+    static uint32_t find(const Insn& insn, uint64_t key)
+    {
+        if (const NarrowTable* table = insn.table.load(std::memory_order_acquire))
+            return table->find(key);
+
+        unsigned n = insn.ncases.load(std::memory_order_acquire);
+        for (unsigned i = 0; i < n; ++i) {
+            if (insn.keys[i] == key)
+                return insn.next[i].load(std::memory_order_acquire);
+        }
+        return none;
+    }
+
+    static const node& child(const node& n) { return n; }
+    static const node& child(const std::shared_ptr<node>& n) { return *n; }
+
+    uint32_t lower(const node& n)
+    {
+        auto it = index.find(&n);
+        if (it != index.end())
+            return it->second.pc;
+
+        uint32_t pc = allocate();
+        index.emplace(&n, Lowered{pc, 0});
+        emit(n, pc);
+        return pc;
+    }
+
+    void emit(const node& n, uint32_t pc)
+    {
+        if (boost::get<unexplored>(&n)) {
+            // do nothing
+        } else if (const flow_node* leaf = boost::get<flow_node>(&n)) {
+            emit_flow(*leaf, at(pc));
+        } else if (const test_node* test = boost::get<test_node>(&n)) {
+            emit_test(*test, pc);
+        } else if (const load_node* load = boost::get<load_node>(&n)) {
+            emit_load(n, load->mask, load->cases, pc);
+        } else if (const vload_node* vload = boost::get<vload_node>(&n)) {
+            emit_load(n, vload->mask, vload->cases, pc);
+        }
+    }
+
+    void emit_flow(const flow_node& leaf, Insn& insn)
+    {
+        FlowRef* old = insn.flow.load(std::memory_order_relaxed);
+        if (old && not old->flow.owner_before(leaf.flow) &&
+                   not leaf.flow.owner_before(old->flow))
+            return;
+
+        insn.flow.store(new FlowRef{leaf.flow}, std::memory_order_release);
+        if (old)
+            Epoch::retire(old);
+        insn.kind.store(FLOW, std::memory_order_release);
+    }
+
+    static void field(Insn& insn, const oxm::mask<>& mask)
+    {
+        insn.type = mask.type();
+        if (insn.type.nbits() <= 64) {
+            insn.mask = mask.mask_bits().to_ulong();
+        } else {
+            Wide wide = words(mask.mask_bits());
+            insn.mask = wide.lo;
+            insn.mask_hi = wide.hi;
+        }
+    }
+
+    void emit_test(const test_node& test, uint32_t pc)
+    {
+        // Branches are never replaced
+        if (at(pc).kind.load(std::memory_order_relaxed) != MISS)
+            return;
+
+        uint32_t positive = lower(test.positive);
+        uint32_t negative = lower(test.negative);
+
+        Insn& insn = at(pc);
+        field(insn, oxm::mask<>(test.need));
+        Wide value = words(test.need.value_bits());
+        insn.value = value.lo;
+        insn.value_hi = value.hi;
+        insn.next[0].store(positive, std::memory_order_relaxed);
+        insn.next[1].store(negative, std::memory_order_relaxed);
+        insn.kind.store(insn.type.nbits() <= 64 ? TEST : WIDE_TEST,
+                        std::memory_order_release);
+    }
+
+    template<class Cases>
+    void emit_load(const node& n, const oxm::mask<>& mask,
+                   const Cases& cases, uint32_t pc)
+    {
+        // Cases are only added, except ones deleted by gc()
+        size_t& lowered = index.at(&n).cases;
+        bool published = at(pc).kind.load(std::memory_order_relaxed) != MISS;
+        if (published && lowered == cases.size())
+            return;
+
+        if (not published) {
+            Insn& insn = at(pc);
+            field(insn, mask);
+            if (insn.type.nbits() > 64)
+                insn.wide.store(new WideTable(16), std::memory_order_relaxed);
+        }
+        for (auto& record : cases) {
+            uint32_t target = lower(child(record.second));
+            add_case(at(pc), record.first, target);
+        }
+        lowered = cases.size();
+        if (not published) {
+            Insn& insn = at(pc);
+            insn.kind.store(insn.type.nbits() <= 64 ? LOAD : WIDE_LOAD,
+                            std::memory_order_release);
+        }
+    }
+
+    template<class T, class Key>
+    static void insert(std::atomic<T*>& slot, const Key& key, uint32_t target)
+    {
+        T* table = slot.load(std::memory_order_relaxed);
+        if (table->insert(key, target))
+            return;
+        T* grown = table->grown();
+        grown->insert(key, target);
+        slot.store(grown, std::memory_order_release);
+        Epoch::retire(table);
+    }
+
+    static void add_case(Insn& insn, const bits<>& key, uint32_t target)
+    {
+        if (insn.wide.load(std::memory_order_relaxed)) {
+            insert(insn.wide, words(key), target);
+            return;
+        }
+
+        uint64_t k = key.to_ulong();
+        if (insn.table.load(std::memory_order_relaxed)) {
+            insert(insn.table, k, target);
+            return;
+        }
+
+        unsigned n = insn.ncases.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < n; ++i) {
+            if (insn.keys[i] == k) {
+                insn.next[i].store(target, std::memory_order_release);
+                return;
+            }
+        }
+        if (n < inline_cases) {
+            insn.keys[n] = k;
+            insn.next[n].store(target, std::memory_order_relaxed);
+            insn.ncases.store(n + 1, std::memory_order_release);
+            return;
+        }
+
+        // Inline cases stay valid for lookups started before
+        NarrowTable* table = new NarrowTable(4 * inline_cases);
+        for (unsigned i = 0; i < n; ++i) {
+            table->insert(insn.keys[i],
+                          insn.next[i].load(std::memory_order_relaxed));
+        }
+        table->insert(k, target);
+        insn.table.store(table, std::memory_order_release);
     }
 };
 
 class TraceTree::Impl::TracerImpl : public Tracer {
     std::vector<node*> path;
     Backend& backend;
+    std::atomic<Program*>& program;
+    // Priorities of the root and of the end of the path
+    const uint16_t root_left, root_right;
     uint16_t left_prio, right_prio;
 
     bool isVloadOccured = false;
@@ -207,9 +674,12 @@ class TraceTree::Impl::TracerImpl : public Tracer {
 public:
     explicit TracerImpl(node& root,
                         Backend& backend,
+                        std::atomic<Program*>& program,
                         uint16_t left_prio,
                         uint16_t right_prio)
-        : backend(backend), left_prio(left_prio), right_prio(right_prio)
+        : backend(backend), program(program)
+        , root_left(left_prio), root_right(right_prio)
+        , left_prio(left_prio), right_prio(right_prio)
     {
         path.push_back(&root);
     }
@@ -293,9 +763,9 @@ public:
     {
         uint16_t test_prio;
         if (boost::get<unexplored>(node_ptr())) {
+            if (right_prio - left_prio < 2)
+                rebalance();
             test_prio = (left_prio + right_prio) / 2;
-            if (test_prio <= left_prio or test_prio >= right_prio)
-                RUNOS_THROW(priority_exceeded());
             uint64_t id = id_generator();
             *node_ptr() = test_node{
                 pred, unexplored(), unexplored{}, id, test_prio
@@ -330,9 +800,9 @@ public:
     Installer finish(FlowPtr new_flow) override
     {
         if (boost::get<unexplored>(node_ptr())) {
+            if (right_prio - left_prio < 2)
+                rebalance();
             uint16_t prio = (left_prio + right_prio) / 2;
-            if (prio <= left_prio or prio >= right_prio)
-                RUNOS_THROW(priority_exceeded());
             *node_ptr() = flow_node{ new_flow, prio };
         } else if (flow_node* leaf = boost::get<flow_node>(node_ptr())) {
             leaf->flow = new_flow;
@@ -356,14 +826,69 @@ public:
             }
         }
 
+        // Virtual fields link nodes outside of the path
+        if (isVloadOccured)
+            Program::publish(program, new Program(*path.front()));
+        else
+            program.load(std::memory_order_relaxed)->trace(path);
+
         return [node=node, match=match, &backend=backend](){
             backend.barrier();
+            backend.begin_bundle();
             Impl::Compiler compiler(backend, match);
             boost::apply_visitor(compiler, *node);
+            backend.commit_bundle();
             backend.barrier();
         };
     }
 
+    // Priorities available to path[i]
+    std::pair<uint16_t, uint16_t> bounds(size_t i) const
+    {
+        uint16_t left = root_left, right = root_right;
+        for (size_t k = 0; k < i; ++k) {
+            if (const test_node* test = boost::get<test_node>(path[k])) {
+                if (path[k + 1] == &test->positive)
+                    left = test->prio;
+                else
+                    right = test->prio;
+            }
+        }
+        return {left, right};
+    }
+
+    // Match of path[i], built like Compiler does
+    oxm::expirementer::full_field_set match_of(size_t i) const
+    {
+        oxm::expirementer::full_field_set ret;
+        for (size_t k = 0; k < i; ++k) {
+            const node* next = path[k + 1];
+            if (const test_node* test = boost::get<test_node>(path[k])) {
+                if (next == &test->positive)
+                    ret.add(test->need);
+                else
+                    ret.exclude(test->need);
+            } else if (const load_node* load = boost::get<load_node>(path[k])) {
+                for (auto& record : load->cases) {
+                    if (&record.second == next) {
+                        ret.add((load->mask.type() == record.first) & load->mask);
+                        break;
+                    }
+                }
+            } else if (const vload_node* vload = boost::get<vload_node>(path[k])) {
+                for (auto& record : vload->cases) {
+                    if (record.second.get() == next) {
+                        ret.add((vload->mask.type() == record.first) & vload->mask);
+                        break;
+                    }
+                }
+            }
+        }
+        return ret;
+    }
+
+    void rebalance();
+
     void connect_nodes(node* from, std::shared_ptr<node> to,
                     oxm::field<> by, oxm::field<> what)
     {
@@ -384,6 +909,15 @@ public:
 };
 
 class TraceTree::Impl::PriorityUpdater {
+    // Rule of a node which priority has changed
+    struct Move {
+        uint16_t from, to;
+        oxm::expirementer::full_field_set match;
+        // barrier rule of a test or rules of a flow
+        const test_node* test;
+        FlowPtr flow;
+    };
+
     struct Scope{
         unsigned positive; // count of test/flow nodes under test
         unsigned negative;;
@@ -450,14 +984,28 @@ class TraceTree::Impl::PriorityUpdater {
     class PriorityAssigner : public boost::static_visitor<>
     {
         const Depth& depth;
-        double from, to;
-
-        double average(double from, double to, unsigned k, unsigned m)
-        { return (from * m + to * k) / (m + k); }
+        // Priorities strictly between them are available
+        int from, to;
+        // Built like Compiler does
+        oxm::expirementer::full_field_set match;
+
+        // Branch of weight w needs w + 1 to be free, rest of the range
+        // is divided in proportion to the weights
+        int split(unsigned negative, unsigned positive) const
+        {
+            int64_t total = negative + positive;
+            int64_t slack = to - from - total - 2;
+            if (slack < 0) // not enough, keep the order at least
+                return from + (to - from) * negative / total;
+            return from + negative + 1 + slack * negative / total;
+        }
 
     public:
-        PriorityAssigner(const Depth& depth, uint16_t from, uint16_t to)
-            : depth(depth), from(from), to(to)
+        std::vector<Move> moves;
+
+        PriorityAssigner(const Depth& depth, uint16_t from, uint16_t to,
+                         const oxm::expirementer::full_field_set& match)
+            : depth(depth), from(from), to(to), match(match)
         { }
 
         void operator() (unexplored&)
@@ -467,41 +1015,58 @@ class TraceTree::Impl::PriorityUpdater {
 
         void operator() (load_node& load)
         {
+            auto type = load.mask.type();
             for (auto& record : load.cases) {
+                match.add((type == record.first) & load.mask);
                 boost::apply_visitor(*this, record.second);
+                match.erase(load.mask);
             }
         }
 
         void operator() (vload_node& vload)
         {
+            auto type = vload.mask.type();
             for (auto& record : vload.cases) {
+                match.add((type == record.first) & vload.mask);
                 boost::apply_visitor(*this, *record.second);
+                match.erase(vload.mask);
             }
         }
 
 
         void operator() (test_node& test)
         {
-            double old_from = from, old_to = to;
+            int old_from = from, old_to = to;
             auto d = depth.at(test.id);
-            double this_prio = average(from, to, d.negative, d.positive);
+            uint16_t prio = split(d.negative, d.positive);
 
             // handle negative branch
-            to = this_prio;
+            to = prio;
+            match.exclude(test.need);
             boost::apply_visitor(*this, test.negative);
+            match.include(oxm::mask<>(test.need));
             to = old_to;
 
             // handle positive branch
-            from = this_prio;
+            from = prio;
+            match.add(test.need);
+            if (prio != test.prio)
+                moves.push_back(Move{test.prio, prio, match, &test, nullptr});
             boost::apply_visitor(*this, test.positive);
+            match.erase(oxm::mask<>(test.need));
             from = old_from;
 
-            test.prio = std::round(this_prio);
+            test.prio = prio;
         }
 
         void operator() (flow_node& node)
         {
-            node.prio = std::round(average(from, to, 1, 1));
+            uint16_t prio = (from + to) / 2;
+            // Expired flow has no rules
+            auto flow = node.flow.lock();
+            if (prio != node.prio && flow)
+                moves.push_back(Move{node.prio, prio, match, nullptr, flow});
+            node.prio = prio;
         }
     };
 
@@ -511,41 +1076,375 @@ public:
         : from(from), to(to)
     { }
 
-    void operator() (node& node)
+    // Count of priorities the subtree needs
+    static unsigned weight(const node& node)
+    {
+        Depth depth;
+        return boost::apply_visitor(DepthCounter{depth}, node);
+    }
+
+    // Renumbers the subtree having `match` and moves rules
+    // of the nodes which priority has changed
+    void operator() (node& node,
+                     const oxm::expirementer::full_field_set& match,
+                     Backend& backend)
     {
         DepthCounter dc{depth};
         boost::apply_visitor(dc, node);
 
-        PriorityAssigner pa{depth, from, to};
+        PriorityAssigner pa{depth, from, to, match};
         boost::apply_visitor(pa, node);
+        if (pa.moves.empty())
+            return;
+
+        // New priority of a rule may be the old one of another,
+        // so every old rule is removed first
+        backend.begin_bundle();
+        for (auto& move : pa.moves) {
+            if (move.flow)
+                backend.remove(move.from, move.match, move.flow);
+            else
+                backend.remove_barrier_rule(move.from, move.match,
+                                            move.test->need, move.test->id);
+        }
+        for (auto& move : pa.moves) {
+            if (move.flow)
+                backend.reinstall(move.to, move.match, move.flow);
+            else
+                backend.barrier_rule(move.to, move.match,
+                                     move.test->need, move.test->id);
+        }
+        backend.commit_bundle();
+    }
+
+};
+
+// No priority is left at the end of the path. Renumbers the smallest
+// subtree around it which isn't too dense. Allowed density decreases
+// from the end of the path to the root down to a half, so a renumbered
+// subtree leaves gaps in its children and only a neighbourhood of the
+// path moves, like order-maintenance lists do.
+void TraceTree::Impl::TracerImpl::rebalance()
+{
+    size_t height = path.size() - 1;
+    for (size_t i = height; i-- > 0; ) {
+        auto range = bounds(i);
+        double density = 1.0 + double(height - i) / height;
+        unsigned weight = PriorityUpdater::weight(*path[i]);
+        if (range.second - range.first <= density * weight + 1)
+            continue;
+
+        PriorityUpdater pu(range.first, range.second);
+        pu(*path[i], match_of(i), backend);
+
+        std::tie(left_prio, right_prio) = bounds(height);
+        if (right_prio - left_prio >= 2)
+            return;
+    }
+    RUNOS_THROW(priority_exceeded());
+}
+
+// Walks the tree depth-first keeping the stack between gc() calls.
+// Tree owner only adds nodes in between, so nodes of the stack stay
+// in place. Load cases are visited by the keys they had when the walk
+// entered the load, cases added later are left for the next walk.
+//
+// Target of a virtual load case may be shared by cases of other
+// virtual loads, it is walked once for every case reaching it.
+// Expired flows and empty loads are pruned on any walk, but a shared
+// target keeps its tests: barrier rules of a test are installed for
+// every case. The case is deleted with its barrier rules when nothing
+// alive is left in the target, the target is collected by the last one.
+struct TraceTree::Collector {
+    struct Frame {
+        node* n;
+        // Match of the node, built like Compiler does
+        oxm::expirementer::full_field_set match;
+        std::vector<bits<>> keys;
+        size_t next;
+        // Node is reached by other virtual load cases too
+        bool shared;
+        // Target of the walked virtual load case,
+        // kept if the tracer replaces the case
+        std::shared_ptr<node> target;
+    };
+
+    Backend& backend;
+    std::atomic<Program*>& program;
+    std::vector<Frame> stack;
+    // Root was pruned, program has to be rebuilt
+    bool rebuild{false};
+
+    Collector(Backend& backend, std::atomic<Program*>& program)
+        : backend(backend), program(program)
+    { }
+
+    void enter(node& n, oxm::expirementer::full_field_set match,
+               bool shared = false)
+    {
+        if (flow_node* leaf = boost::get<flow_node>(&n)) {
+            // Switches have removed rules of expired flow
+            if (leaf->flow.expired()) {
+                n = unexplored();
+                pruned(n);
+            }
+        } else if (boost::get<test_node>(&n)) {
+            stack.push_back(Frame{&n, std::move(match), {}, 0, shared, {}});
+        } else if (load_node* load = boost::get<load_node>(&n)) {
+            stack.push_back(Frame{&n, std::move(match), keys(load->cases),
+                                  0, shared, {}});
+        } else if (vload_node* vload = boost::get<vload_node>(&n)) {
+            stack.push_back(Frame{&n, std::move(match), keys(vload->cases),
+                                  0, shared, {}});
+        }
     }
 
+    template<class Cases>
+    static std::vector<bits<>> keys(const Cases& cases)
+    {
+        std::vector<bits<>> ret;
+        ret.reserve(cases.size());
+        for (auto& record : cases) {
+            ret.push_back(record.first);
+        }
+        return ret;
+    }
+
+    // Enters the next child of the top node, false if there is none
+    bool descend()
+    {
+        Frame& frame = stack.back();
+
+        if (test_node* test = boost::get<test_node>(frame.n)) {
+            auto match = frame.match;
+            switch (frame.next++) {
+            case 0:
+                match.add(test->need);
+                enter(test->positive, std::move(match), frame.shared);
+                return true;
+            case 1:
+                match.exclude(test->need);
+                enter(test->negative, std::move(match), frame.shared);
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        if (vload_node* vload = boost::get<vload_node>(frame.n)) {
+            while (frame.next < frame.keys.size()) {
+                auto it = vload->cases.find(frame.keys[frame.next++]);
+                if (it == vload->cases.end())
+                    continue;
+                frame.target = it->second;
+                // Held by the case and the frame only if not shared
+                bool shared = frame.shared || frame.target.use_count() > 2;
+                auto match = frame.match;
+                match.add((vload->mask.type() == it->first) & vload->mask);
+                enter(*frame.target, std::move(match), shared);
+                return true;
+            }
+            frame.target.reset();
+            return false;
+        }
+
+        load_node& load = boost::get<load_node>(*frame.n);
+        while (frame.next < frame.keys.size()) {
+            auto it = load.cases.find(frame.keys[frame.next++]);
+            if (it == load.cases.end())
+                continue;
+            auto match = frame.match;
+            match.add((load.mask.type() == it->first) & load.mask);
+            enter(it->second, std::move(match), frame.shared);
+            return true;
+        }
+        return false;
+    }
+
+    // Collapses the top node if its children are all unexplored
+    void leave()
+    {
+        Frame frame = std::move(stack.back());
+        stack.pop_back();
+        node& n = *frame.n;
+        Program& prog = *program.load(std::memory_order_relaxed);
+
+        if (test_node* test = boost::get<test_node>(&n)) {
+            // Barrier rules of other cases are removed with them
+            if (frame.shared)
+                return;
+            if (not boost::get<unexplored>(&test->positive) ||
+                not boost::get<unexplored>(&test->negative))
+                return;
+            // Packets of the test are caught by barriers of its parents
+            frame.match.add(test->need);
+            backend.remove_barrier_rule(test->prio, frame.match,
+                                        test->need, test->id);
+            prog.forget(test->positive);
+            prog.forget(test->negative);
+            n = unexplored();
+            pruned(n);
+        } else if (load_node* load = boost::get<load_node>(&n)) {
+            for (auto it = load->cases.begin(); it != load->cases.end(); ) {
+                if (boost::get<unexplored>(&it->second)) {
+                    prog.forget(it->second);
+                    prog.forget_case(n);
+                    it = load->cases.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            if (load->cases.empty()) {
+                n = unexplored();
+                pruned(n);
+            }
+        } else if (vload_node* vload = boost::get<vload_node>(&n)) {
+            auto type = vload->mask.type();
+            for (auto it = vload->cases.begin(); it != vload->cases.end(); ) {
+                if (dead(*it->second)) {
+                    auto match = frame.match;
+                    match.add((type == it->first) & vload->mask);
+                    remove_barriers(*it->second, std::move(match));
+                    it = vload->cases.erase(it);
+                    // Instructions of the target are shared as well
+                    rebuild = true;
+                } else {
+                    ++it;
+                }
+            }
+            if (vload->cases.empty()) {
+                n = unexplored();
+                pruned(n);
+            }
+        }
+    }
+
+    // Nothing but tests which would be collapsed is left
+    static bool dead(const node& n)
+    {
+        if (boost::get<unexplored>(&n)) {
+            return true;
+        } else if (const flow_node* leaf = boost::get<flow_node>(&n)) {
+            return leaf->flow.expired();
+        } else if (const test_node* test = boost::get<test_node>(&n)) {
+            return dead(test->positive) && dead(test->negative);
+        } else if (const load_node* load = boost::get<load_node>(&n)) {
+            for (auto& record : load->cases) {
+                if (not dead(record.second))
+                    return false;
+            }
+            return true;
+        } else {
+            const vload_node& vload = boost::get<vload_node>(n);
+            for (auto& record : vload.cases) {
+                if (not dead(*record.second))
+                    return false;
+            }
+            return true;
+        }
+    }
+
+    // Removes barrier rules installed by Compiler for the dead subtree
+    void remove_barriers(const node& n, oxm::expirementer::full_field_set match)
+    {
+        if (const test_node* test = boost::get<test_node>(&n)) {
+            auto negative = match;
+            negative.exclude(test->need);
+            remove_barriers(test->negative, std::move(negative));
+            match.add(test->need);
+            backend.remove_barrier_rule(test->prio, match,
+                                        test->need, test->id);
+            remove_barriers(test->positive, std::move(match));
+        } else if (const load_node* load = boost::get<load_node>(&n)) {
+            for (auto& record : load->cases) {
+                auto next = match;
+                next.add((load->mask.type() == record.first) & load->mask);
+                remove_barriers(record.second, std::move(next));
+            }
+        } else if (const vload_node* vload = boost::get<vload_node>(&n)) {
+            for (auto& record : vload->cases) {
+                auto next = match;
+                next.add((vload->mask.type() == record.first) & vload->mask);
+                remove_barriers(*record.second, std::move(next));
+            }
+        }
+    }
+
+    // Node became unexplored, the top node is its parent
+    void pruned(const node& n)
+    {
+        if (stack.empty()) {
+            rebuild = true;
+            return;
+        }
+        const Frame& parent = stack.back();
+        // Other virtual loads may lead to the same instruction
+        if (boost::get<vload_node>(parent.n)) {
+            rebuild = true;
+            return;
+        }
+        const bits<>* key = nullptr;
+        if (boost::get<load_node>(parent.n))
+            key = &parent.keys[parent.next - 1];
+        program.load(std::memory_order_relaxed)->prune(n, *parent.n, key);
+    }
 };
 
 FlowPtr TraceTree::lookup(const Packet& pkt) const
 {
-    return boost::apply_visitor(Impl::Lookup(pkt), *m_root);
+    Epoch::Guard guard;
+    return m_program.load(std::memory_order_acquire)->run(pkt);
 }
 
 std::unique_ptr<Tracer> TraceTree::augment()
 {
     return std::unique_ptr<Tracer>(
-            new Impl::TracerImpl(*m_root, m_backend, left_prio, right_prio)
+            new Impl::TracerImpl(*m_root, m_backend, m_program,
+                                 left_prio, right_prio)
         );
 }
 
 void TraceTree::update()
 {
     Impl::PriorityUpdater pu(left_prio, right_prio);
-    pu(*m_root);
+    pu(*m_root, oxm::expirementer::full_field_set(), m_backend);
+}
+
+bool TraceTree::gc(std::chrono::steady_clock::duration budget)
+{
+    using clock = std::chrono::steady_clock;
+    auto deadline = clock::now() + budget;
+    Collector& collector = *m_collector;
+
+    if (collector.stack.empty())
+        collector.enter(*m_root, oxm::expirementer::full_field_set());
+
+    for (unsigned steps = 1; not collector.stack.empty(); ++steps) {
+        if (not collector.descend())
+            collector.leave();
+        if (steps % 64 == 0 && clock::now() >= deadline)
+            break;
+    }
+
+    // Drop instructions of pruned nodes
+    Program* program = m_program.load(std::memory_order_relaxed);
+    if (collector.rebuild || program->garbage > program->size / 2) {
+        Program::publish(m_program, new Program(*m_root));
+        collector.rebuild = false;
+    }
+    return collector.stack.empty();
 }
 
 void TraceTree::commit()
 {
-    m_backend.remove(oxm::field_set{});
-    m_backend.barrier();
+    // Switches supporting bundles never see the table half-filled
+    m_backend.begin_bundle();
+    m_backend.begin_sync();
     Impl::Compiler compiler {m_backend};
+    compiler.reinstall = true;
     boost::apply_visitor(compiler, *m_root);
+    m_backend.end_sync();
+    m_backend.commit_bundle();
     m_backend.barrier();
 }
 
@@ -554,6 +1453,8 @@ TraceTree::TraceTree(Backend &backend,
                      uint16_t right_prio)
     : m_backend(backend)
     , m_root(new node)
+    , m_program(new Program(*m_root))
+    , m_collector(new Collector(backend, m_program))
     , left_prio(left_prio)
     , right_prio(right_prio)
 { }
@@ -563,7 +1464,18 @@ TraceTree::TraceTree(Backend &backend,
     : TraceTree(backend, prio_space.first, prio_space.second)
 { }
 
-TraceTree::~TraceTree() = default;
+void TraceTree::clear()
+{
+    // Lookups don't reference nodes
+    m_collector->stack.clear();
+    m_root.reset(new node);
+    Program::publish(m_program, new Program(*m_root));
+}
+
+TraceTree::~TraceTree()
+{
+    Program::publish(m_program, nullptr);
+}
 
 } // namespace maple
 } // namespace runos
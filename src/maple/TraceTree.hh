@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <boost/variant/variant_fwd.hpp>
 #include <boost/variant/recursive_wrapper_fwd.hpp>
@@ -41,12 +43,22 @@ public:
               std::pair<uint16_t, uint16_t> priority_space);
     ~TraceTree();
 
+    // May be called from any thread, concurrently with the methods
+    // below. They are called by the single thread owning the tree.
     FlowPtr lookup(const Packet& pkt) const;
+
     std::unique_ptr<Tracer> augment();
 
     void commit();
     void update();
-    void gc();
+
+    // Prunes branches of expired flows and their barrier rules.
+    // Continues the walk of the previous call and returns after
+    // about `budget`, true if the walk has finished.
+    bool gc(std::chrono::steady_clock::duration budget);
+
+    // Forget all traces
+    void clear();
 
 protected:
     struct unexplored;
@@ -64,9 +76,15 @@ protected:
                       >;
 
     struct Impl;
+    // Tree lowered to a flat array, see TraceTree.cc
+    struct Program;
+    // Position of gc() in the tree
+    struct Collector;
 
     Backend& m_backend;
     std::unique_ptr<node> m_root;
+    std::atomic<Program*> m_program;
+    std::unique_ptr<Collector> m_collector;
     uint16_t left_prio, right_prio;
 };
 
@@ -0,0 +1,186 @@
+/*
+ * Copyright 2015 Applied Research Center for Computer Networks
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define BOOST_TEST_MODULE OFEncode tests
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include <fluid/of13msg.hh>
+
+#include "OFEncode.hh"
+
+using namespace runos;
+using namespace fluid_msg;
+
+// Message packed by libfluid
+static std::vector<uint8_t> packed(OFMsg& msg)
+{
+    uint8_t* buf = msg.pack();
+    std::vector<uint8_t> ret(buf, buf + msg.length());
+    OFMsg::free_buffer(buf);
+    return ret;
+}
+
+struct Fixture {
+    of13::Match match;
+    ActionList actions;
+
+    Fixture()
+    {
+        match.add_oxm_field(new of13::InPort(3));
+        match.add_oxm_field(new of13::EthType(0x0800));
+        actions.add_action(new of13::SetFieldAction(new of13::VLANVid(42)));
+        actions.add_action(new of13::OutputAction(2, 0));
+    }
+
+    OFEncode::FlowMod flowMod()
+    {
+        OFEncode::FlowMod fm;
+        fm.xid = 0x1234;
+        fm.cookie = 0x1122334455667788ULL;
+        fm.cookie_mask = ~0ULL;
+        fm.table_id = 1;
+        fm.command = of13::OFPFC_ADD;
+        fm.idle_timeout = 10;
+        fm.hard_timeout = 60;
+        fm.priority = 100;
+        fm.buffer_id = OFP_NO_BUFFER;
+        fm.out_port = of13::OFPP_ANY;
+        fm.out_group = of13::OFPG_ANY;
+        fm.flags = of13::OFPFF_CHECK_OVERLAP | of13::OFPFF_SEND_FLOW_REM;
+        fm.match = &match;
+        return fm;
+    }
+
+    of13::FlowMod fluidFlowMod()
+    {
+        of13::FlowMod fm(0x1234, 0x1122334455667788ULL, ~0ULL, 1,
+                         of13::OFPFC_ADD, 10, 60, 100, OFP_NO_BUFFER,
+                         of13::OFPP_ANY, of13::OFPG_ANY,
+                         of13::OFPFF_CHECK_OVERLAP | of13::OFPFF_SEND_FLOW_REM);
+        fm.match(match);
+        return fm;
+    }
+
+    std::vector<uint8_t> encoded(const OFEncode::FlowMod& fm)
+    {
+        std::vector<uint8_t> ret(OFEncode::length(fm));
+        OFEncode::encode(fm, ret.data());
+        return ret;
+    }
+};
+
+BOOST_FIXTURE_TEST_SUITE( runos_ofencode_tests, Fixture )
+
+BOOST_AUTO_TEST_CASE( flow_mod_test ) {
+    auto fm = flowMod();
+    fm.actions = &actions;
+    auto ours = encoded(fm);
+
+    auto fluid = fluidFlowMod();
+    of13::ApplyActions apply;
+    apply.add_action(new of13::SetFieldAction(new of13::VLANVid(42)));
+    apply.add_action(new of13::OutputAction(2, 0));
+    fluid.add_instruction(apply);
+    auto expected = packed(fluid);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(ours.begin(), ours.end(),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( flow_mod_meter_test ) {
+    auto fm = flowMod();
+    fm.meter = 7;
+    fm.actions = &actions;
+    auto ours = encoded(fm);
+
+    auto fluid = fluidFlowMod();
+    fluid.add_instruction(new of13::Meter(7));
+    of13::ApplyActions apply;
+    apply.add_action(new of13::SetFieldAction(new of13::VLANVid(42)));
+    apply.add_action(new of13::OutputAction(2, 0));
+    fluid.add_instruction(apply);
+    auto expected = packed(fluid);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(ours.begin(), ours.end(),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( flow_mod_drop_test ) {
+    auto ours = encoded(flowMod());
+
+    auto fluid = fluidFlowMod();
+    auto expected = packed(fluid);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(ours.begin(), ours.end(),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( packet_out_test ) {
+    std::vector<uint8_t> data(60);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = uint8_t(i);
+
+    OFEncode::PacketOut po;
+    po.xid = 0x5678;
+    po.buffer_id = OFP_NO_BUFFER;
+    po.in_port = 3;
+    po.actions = &actions;
+    po.data = data.data();
+    po.data_len = data.size();
+    std::vector<uint8_t> ours(OFEncode::length(po));
+    OFEncode::encode(po, ours.data());
+
+    of13::PacketOut fluid(0x5678, OFP_NO_BUFFER, 3);
+    fluid.actions(actions);
+    fluid.data(data.data(), data.size());
+    auto expected = packed(fluid);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(ours.begin(), ours.end(),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( buffered_packet_out_test ) {
+    OFEncode::PacketOut po;
+    po.xid = 0x5678;
+    po.buffer_id = 0x100;
+    po.in_port = 3;
+    po.actions = &actions;
+    std::vector<uint8_t> ours(OFEncode::length(po));
+    OFEncode::encode(po, ours.data());
+
+    of13::PacketOut fluid(0x5678, 0x100, 3);
+    fluid.actions(actions);
+    auto expected = packed(fluid);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(ours.begin(), ours.end(),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( barrier_test ) {
+    uint8_t ours[OFEncode::barrier_len];
+    OFEncode::barrier(ours, 0x9abc);
+
+    of13::BarrierRequest fluid(0x9abc);
+    auto expected = packed(fluid);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(ours, ours + sizeof(ours),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_SUITE_END()